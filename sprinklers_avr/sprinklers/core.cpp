@@ -476,6 +476,10 @@ void mainLoop()
                      bDoneMidnightReset = false;
 
              sensorsModule.loop();  // read and process sensors. Note: sensors module has its own scheduler.
+
+#ifdef LOGGING
+             sdlog.loop();          // log files sync policy
+#endif
                      
         }  // one-second block
         
@@ -495,5 +499,10 @@ void mainLoop()
 
         // latch any output modifications
         io_latch();
+
+#ifdef LOGGING
+        // write queued log records
+        sdlog.Poll();
+#endif
 }
 
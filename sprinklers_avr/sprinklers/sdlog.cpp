@@ -28,6 +28,7 @@ limitations under the License.
 #include "sdlog.h"
 #include "port.h"
 #include "settings.h"
+#include <stddef.h>
 
 extern SdFat sd;
 
@@ -35,6 +36,24 @@ extern SdFat sd;
 
 // Local forward declarations
 
+static char * sensorColumnName(char sensor_type);
+static char * sensorSeriesName(char sensor_type);
+static bool sensorLogFileName(char *fname, char sensor_type, int sensor_id, unsigned int nmonth, unsigned int nyear);
+static void emitSensorPoint(FILE* stream_file, char *pbFirstRow, char *sensor_name, int sensor_id, time_t t, int value);
+static bool readSensorRecord(TimedSdFile &lfile, LogLineReader *pReader, byte format, SensorLogRecord *pRec);
+static bool isBinarySensorLog(TimedSdFile &lfile);
+static time_t monthStart(unsigned int nyear, unsigned int nmonth);
+static char logSensorType(byte log_type);
+static byte sensorLogType(char sensor_type);
+static uint32_t findDataEnd(TimedSdFile &lfile, uint32_t base, uint16_t unit);
+static bool isHotLogFile(const char *fname);
+#ifdef LOG_PREALLOCATE
+static bool createPreallocatedFile(TimedSdFile &lfile, const char *fname, uint32_t size);
+#endif
+static bool parseSyslogRecord(const char *line, unsigned int nyear, unsigned int nmonth, time_t *pTime, byte *pType, byte *pTextPos);
+static bool isSyslogFileName(const char *fname, unsigned int *pMonth, unsigned int *pYear);
+static void emitJSONChar(FILE* stream_file, int c);
+
 
 
 Logging::Logging()
@@ -43,6 +62,37 @@ Logging::Logging()
 
   logger_ready = false;
 
+  for( byte i = 0; i < LOG_HANDLE_CACHE_SIZE; i++ ){
+
+        log_handles[i].fname[0] = 0;
+        log_handles[i].bPinned = false;
+  }
+
+  log_handles_month = 0;
+#ifdef SD_STATS
+  log_handle_hits = log_handle_misses = log_handle_evictions = 0;
+#endif  // SD_STATS
+#ifdef SENSOR_STORE
+  store_unavailable = false;
+#endif  // SENSOR_STORE
+
+  for( byte i = 0; i < SENSOR_ROLLUP_SERIES; i++ )
+        rollups[i].sensor_type = 0;
+
+  log_queue_head = log_queue_used = 0;
+  log_queue_draining = false;
+
+#ifdef SYSLOG_COALESCE
+  for( byte i = 0; i < SYSLOG_RECENT_SIZE; i++ )
+        syslog_recent[i].hash = 0;
+
+  syslog_tokens = SYSLOG_RATE_BURST;
+  syslog_tokens_time = 0;
+  syslog_dropped = 0;
+#endif  // SYSLOG_COALESCE
+
+  retention_dir = RETENTION_IDLE;
+  retention_day = 0;
 }
 
 Logging::~Logging()
@@ -59,7 +109,7 @@ Logging::~Logging()
 
 bool Logging::begin(char *str)
 {
-  SdFile  lfile;
+  TimedSdFile  lfile;
   char    log_fname[20];
   time_t  curr_time = nntpTimeServer.LocalNow();
 
@@ -125,6 +175,18 @@ bool Logging::begin(char *str)
   }
   lfile.close();      // close the directory
 
+  sprintf_P(log_fname, PSTR(SENSOR_ROLLUP_DIR));   // Sensor rollups directory
+  if( !lfile.open(log_fname, O_READ) ){
+
+        trace(F("Sensor rollups directory not found, creating it.\n"));
+
+        if( !sd.mkdir(log_fname) ){
+
+           trace(F("Error creating Sensor rollups directory.\n"));
+        }
+  }
+  lfile.close();      // close the directory
+
   sprintf_P(log_fname, PSTR(PRESSURE_LOG_DIR));   // Atmospheric pressure log directory
   if( !lfile.open(log_fname, O_READ) ){
 
@@ -141,7 +203,7 @@ bool Logging::begin(char *str)
 //  generate system log file name
   sprintf_P(log_fname, PSTR(SYSTEM_LOG_FNAME_FORMAT), month(curr_time), year(curr_time) );
 
-  if( !lfile.open(log_fname, O_WRITE | O_APPEND | O_CREAT) ){
+  if( getLogFile(log_fname, NULL) == NULL ){
 
         trace(F("Cannot open system log file (%s)\n"), log_fname);
         logger_ready = false;
@@ -149,8 +211,6 @@ bool Logging::begin(char *str)
         return false;    // failed to open/create log file
   }
 
-  lfile.close();
-
   logger_ready = true;      // we are good to go
 
   return syslog_str_P(SYSEVENT_INFO, str);    // add system log record using the string provided.
@@ -158,688 +218,3837 @@ bool Logging::begin(char *str)
 
 void Logging::Close()
 {
+#ifdef SYSLOG_COALESCE
+   syslogFlushRepeats(true);
+#endif  // SYSLOG_COALESCE
+   drainLogQueue();
+   closeLogFiles();
    logger_ready = false;
 }
 
+// Periodic housekeeping, called from the main loop.
+// Closes log files at month rollover, syncs files that stayed dirty for too long, seeds new sensor rollup series and runs
+// log retention policy.
+//
+void Logging::loop()
+{
+   if( !logger_ready ) return;
 
+   time_t  t = nntpTimeServer.LocalNow();
 
-//
-// internal helpers
-//
+#ifdef LOG_RETENTION
+   if( retention_dir != RETENTION_IDLE )
+        retentionStep();
+   else if( (hour(t) == LOG_RETENTION_HOUR) && (day(t) != retention_day) ){     // start daily retention pass
 
-// Add new log record
-// Takes input string, returns true on success and false on failure
+        retention_day = day(t);
+        retentionStart(0);
+   }
+#endif  // LOG_RETENTION
+
+#ifdef SYSLOG_COALESCE
+   syslogFlushRepeats(false);
+#endif  // SYSLOG_COALESCE
+
+   for( byte i = 0; i < SENSOR_ROLLUP_SERIES; i++ ){
+
+        if( (rollups[i].sensor_type != 0) && (rollups[i].seed_time != 0) ){
+
+              seedRollups(&rollups[i]);     // one series per call
+              break;
+        }
+   }
+
+   if( month(t) != log_handles_month ){
+
+        drainLogQueue();
+        closeLogFiles();
+        return;
+   }
+
+   syncLogFiles(false);
+}
+
+// Write-behind queue processing, called from the main loop on every pass.
+// Queued records are written when enough data is accumulated or the oldest record stayed in the queue for too long.
 //
-byte Logging::syslog_str(char evt_type, char *str)
+void Logging::Poll()
 {
-   return syslog_str_internal(evt_type, str, false);
+   if( log_queue_used == 0 ) return;
+
+   if( (log_queue_used >= LOG_QUEUE_DRAIN_BYTES) || ((millis() - log_queue_time) >= LOG_QUEUE_DRAIN_INTERVAL) )
+        drainLogQueue();
 }
 
-// Add new log record
-// Takes input string FROM PROGRAM MEMORY, returns true on success and false on failure
+// Write all queued records and flush all open log files. Readers open log files independently, so writers data must be on the card first.
 //
-byte Logging::syslog_str_P(char evt_type, char *str)
+void Logging::Sync()
 {
-   return syslog_str_internal(evt_type, str, true);
+   drainLogQueue();
+   syncLogFiles(true);
 }
 
 
-// Internal worker for syslog_str
-// First parameter is the string, second parameter is a flag indicating string location
-//     false == RAM
-//     true   == PROGMEM
+//
+// Open log files cache
 //
 
-// Note: We open/write/close log file on each event. It is kind of expensive, but it allows to keep RAM
-//               usage low. Also close operation flushes buffers (acts as sync()).
+// Get open log file handle from the cache, opening (or creating) the file on cache miss.
+// If the file was created *pCreated is set to true, allowing caller to add column headers.
+// Returns pointer to the cached handle, or NULL on failure.
 //
-byte Logging::syslog_str_internal(char evt_type, char *str, char flag)
+// Note: by default files are opened with O_APPEND, so all writes go to the end of the file regardless of the current position.
+//       Files opened with read access are checked for the binary sensor log signature, and handle format is set accordingly.
+//
+Logging::LogHandle * Logging::getLogFile(const char *fname, bool *pCreated, byte flags, uint32_t prealloc_size)
 {
-   time_t t = nntpTimeServer.LocalNow();
-   SdFile  system_logfile;
-// temp buffer for log strings processing
-   char tmp_buf[20];
+   unsigned long  now_millis = millis();
+   byte           curr_month = month(nntpTimeServer.LocalNow());
+   byte           slot = 0;
 
-   if( !logger_ready ) return false;  //check if the logger is ready
+   if( pCreated ) *pCreated = false;
 
-   sprintf_P(tmp_buf, PSTR(SYSTEM_LOG_FNAME_FORMAT), month(t), year(t) );
+   if( curr_month != log_handles_month ){     // month rollover, close files from the previous month
 
-   if( !system_logfile.open(tmp_buf, O_WRITE | O_APPEND | O_CREAT) ){
+        closeLogFiles();
+        log_handles_month = curr_month;
+   }
 
-            trace(F("Cannot open system log file (%s)\n"), tmp_buf);
+   LogHandle *pHandle = findLogFile(fname);
 
-            logger_ready = false;      // something is wrong with the log file, mark logger as "not ready"
-            return false;    // failed to open/create log file
+   if( pHandle != NULL ){    // cache hit
+
+        pHandle->last_used = now_millis;
+#ifdef SD_STATS
+        log_handle_hits++;
+#endif  // SD_STATS
+        return pHandle;
    }
 
-   if( flag ){   // progmem or regular string
+// cache miss - use free slot if available, otherwise evict least recently used file (pinned files only if there is nothing else)
+   for( byte i = 0; i < LOG_HANDLE_CACHE_SIZE; i++ ){
 
-      if( strlen_P(str) > (CL_TMPB_SIZE-20) ) return false;   // input string too long, reject it. Note: we need almost 20 bytes for the date/time etc
-   }
-   else {
-      if( strlen(str) > (CL_TMPB_SIZE-20) ) return false;   // input string too long, reject it. Note: we need almost 20 bytes for the date/time etc
+        if( log_handles[i].fname[0] == 0 ){
+
+              slot = i;
+              break;
+        }
+        if( (log_handles[slot].bPinned && !log_handles[i].bPinned) ||
+            ((log_handles[slot].bPinned == log_handles[i].bPinned) && ((now_millis - log_handles[i].last_used) > (now_millis - log_handles[slot].last_used))) )
+              slot = i;
    }
 
-   if( flag ){
+   pHandle = &log_handles[slot];
 
-      sprintf_P(tmp_buf, PSTR("%u,%u:%u:%u,"), day(t), hour(t), minute(t), second(t) );
+#ifdef SD_STATS
+   log_handle_misses++;
+   if( pHandle->fname[0] )
+        log_handle_evictions++;
+#endif  // SD_STATS
 
+   if( pHandle->fname[0] ){
 
-      system_logfile.print(tmp_buf);
+        pHandle->file.close();      // close() flushes buffers
+        pHandle->fname[0] = 0;
+   }
 
-// Because this is PROGMEM string we have to output it manually, one char at a time because we don't want to pre-allocate space for the whole string (RAM is a scarse resource!). But SdFat library will buffer output anyway, so it is OK.
-// SdFat will flush the buffer on close().
-      char c;
-      while((c = pgm_read_byte(str++))){
+   if( strlen(fname) >= MAX_LOG_FNAME_SIZE ) return NULL;
 
-         system_logfile.write(c);
-      }
-      system_logfile.write('\n');
-   }
-   else {
+   if( !pHandle->file.open(fname, flags) ){    // we are trying to open existing log file
 
-      sprintf_P(tmp_buf, PSTR("%u,%u:%u:%u,"), day(t), hour(t), minute(t), second(t) );
+// operation failed, usually because log file does not exist yet. Let's create it.
+#ifdef LOG_PREALLOCATE
+        if( (prealloc_size == 0) || !createPreallocatedFile(pHandle->file, fname, prealloc_size) )
+#endif
+        if( !pHandle->file.open(fname, flags | O_CREAT) )
+              return NULL;
 
-      system_logfile.print(tmp_buf);
-      system_logfile.println(str);
+        if( pCreated ) *pCreated = true;
    }
 
-   system_logfile.close();
+   strcpy(pHandle->fname, fname);
+   pHandle->format = LOG_FORMAT_TEXT;
+   pHandle->last_day = 0;
+   pHandle->bDirty = false;
+   pHandle->bPinned = isHotLogFile(fname);
+   pHandle->last_used = pHandle->last_sync = now_millis;
+
+   if( (flags & O_READ) && IsBinarySensorLog(pHandle->file) )
+        pHandle->format = LOG_FORMAT_BINARY;
+
+// find logical end of data. For regular files it is the file size, preallocated files could have free space at the end.
+   if( !(flags & O_READ) )
+        pHandle->data_end = pHandle->file.fileSize();      // write-only files are not preallocated
+#ifdef SENSOR_STORE
+   else if( strcmp_P(fname, PSTR(SENSOR_STORE_FNAME)) == 0 )
+        pHandle->data_end = pHandle->file.fileSize();      // sensor store is updated in place, there is no end of data marker
+#endif  // SENSOR_STORE
+   else if( pHandle->format == LOG_FORMAT_BINARY )
+        pHandle->data_end = findDataEnd(pHandle->file, sizeof(SensorLogHeader), sizeof(SensorLogRecord));
+   else
+        pHandle->data_end = findDataEnd(pHandle->file, 0, 1);
+
+   pHandle->synced_size = pHandle->data_end;
+
+   return pHandle;
+}
+
+// Append data at the logical end of the log file.
+// Data goes through the file system cache: the tail block stays in the cache (marked dirty) and is written to the card when
+// the file is synced (see syncLogFiles()), when the cache is needed for another block, or when the block fills up. Appends
+// to preallocated files overwrite the zero-filled space, so no clusters are allocated and the FAT is not updated.
+//
+// Returns true if successful and false if failure.
+//
+bool Logging::appendLogData(LogHandle *pHandle, const void *data, size_t len)
+{
+   if( !pHandle->file.seekSet(pHandle->data_end) || (pHandle->file.write(data, len) != len) )
+        return false;
 
+   pHandle->data_end += len;
    return true;
 }
 
-
-// Record watering event
+// Find log file in the cache, returns NULL if the file is not open
 //
-// Note: for watering events we open/close file on each event
+Logging::LogHandle * Logging::findLogFile(const char *fname)
+{
+   for( byte i = 0; i < LOG_HANDLE_CACHE_SIZE; i++ ){
 
-#define MAX_WATERING_LOG_RECORD_SIZE    80
+        if( log_handles[i].fname[0] && (strcmp(log_handles[i].fname, fname) == 0) )
+              return &log_handles[i];
+   }
 
-bool Logging::LogZoneEvent(time_t start, int zone, int duration, int schedule, int sadj, int wunderground)
+   return NULL;
+}
+
+void Logging::syncLogFile(LogHandle *pHandle)
 {
-      SdFile  wfile;
-      time_t t = nntpTimeServer.LocalNow();
-// temp buffer for log strings processing
-      char tmp_buf[MAX_WATERING_LOG_RECORD_SIZE];
+   pHandle->file.sync();
+   pHandle->last_sync = millis();
+   pHandle->synced_size = pHandle->data_end;
+   pHandle->bDirty = false;
+}
 
-      sprintf_P(tmp_buf, PSTR(WATERING_LOG_FNAME_FORMAT), year(t), zone );
+// Apply sync policy to all open log files - sync files with too much unsynced data, or files that stayed dirty for too long.
+// If bForce is true all dirty files are synced.
+//
+void Logging::syncLogFiles(bool bForce)
+{
+   unsigned long  now_millis = millis();
 
-      if( !wfile.open(tmp_buf, O_WRITE | O_APPEND) ){    // we are trying to open existing log file for write/append
+   for( byte i = 0; i < LOG_HANDLE_CACHE_SIZE; i++ ){
 
-// operation failed, usually because log file for this year does not exist yet. Let's create it and add column headers.
-         if( !wfile.open(tmp_buf, O_WRITE | O_APPEND | O_CREAT) ){
+        LogHandle *pHandle = &log_handles[i];
 
-               trace(F("Cannot open watering log file (%s)\n"), tmp_buf);    // file create failed, return an error.
-               return false;    // failed to open/create file
-         }
-         wfile.println(F("Month,Day,Time,Run time(min),ScheduleID,Adjustment,WUAdjustment"));
-      }
+        if( pHandle->fname[0] == 0 ) continue;
 
-      sprintf_P(tmp_buf, PSTR("%u,%u,%u:%u,%u,%u,%i,%i"), month(start), day(start), hour(start), minute(start), duration, schedule, sadj, wunderground);
+        uint32_t  dirty = pHandle->data_end - pHandle->synced_size;
 
-      wfile.println(tmp_buf);
-      wfile.close();
+        if( (dirty == 0) && !pHandle->bDirty ) continue;
 
-      return true;
+        if( bForce || (dirty >= LOG_SYNC_BYTES) || ((now_millis - pHandle->last_sync) >= LOG_SYNC_INTERVAL) )
+              syncLogFile(pHandle);
+   }
 }
 
-// Sensors logging - record sensor reading. 
-// Covers all types of basic pressure sensors that provide momentarily (immediate) readings.
-//
-// sensor_type       -  could be SENSOR_TYPE_TEMPERATURE or any other valid defines
-// sensor_id           -  numeric ID of the sensor, minimum 0, maximum 999
-// sensor_reading  -  actual sensor reading
-//
-// Returns true if successful and false if failure.
-//
-bool Logging::LogSensorReading(char sensor_type, int sensor_id, int sensor_reading)
+void Logging::closeLogFiles()
 {
-//    trace(F("LogSensorReading - enter\n"));
-  
-      SdFile  wfile;
-      time_t t = nntpTimeServer.LocalNow();
+   for( byte i = 0; i < LOG_HANDLE_CACHE_SIZE; i++ ){
 
-// temp buffer for log strings processing
-      char tmp_buf[20];
-      char *sensorName;
-
-      switch (sensor_type){
-      
-           case  SENSOR_TYPE_TEMPERATURE:
-          
-                     sprintf_P(tmp_buf, PSTR(TEMPERATURE_LOG_FNAME_FORMAT), month(t), year(t)%100, sensor_id );
-                     sensorName = PSTR("Temperature(F)");
-                     break; 
-      
-           case  SENSOR_TYPE_PRESSURE:
-
-                     sprintf_P(tmp_buf, PSTR(PRESSURE_LOG_FNAME_FORMAT), month(t), year(t)%100, sensor_id );
-                     sensorName = PSTR("AirPressure");
-                     break; 
-      
-           case  SENSOR_TYPE_HUMIDITY:
-          
-                     sprintf_P(tmp_buf, PSTR(HUMIDITY_LOG_FNAME_FORMAT), month(t), year(t)%100, sensor_id );
-                     sensorName = PSTR("Humidity");
-                     break; 
-      
-            default:
-                     return false;    // sensor_type not recognized
-                     break;           
-      }
-//    trace(F("LogSensorReading - about to open file: %s\n"), tmp_buf);
+        if( log_handles[i].fname[0] ){
 
-      if( !wfile.open(tmp_buf, O_WRITE | O_APPEND) ){    // we are trying to open existing log file for write/append
+              log_handles[i].file.close();
+              log_handles[i].fname[0] = 0;
+        }
+   }
+}
 
-// operation failed, usually because log file for this year does not exist yet. Let's create it and add column headers.
-         if( !wfile.open(tmp_buf, O_WRITE | O_APPEND | O_CREAT) ){
+// Close the log file if it is open in the cache. Path is compared ignoring case (file system returns names in upper case).
+//
+void Logging::closeLogFile(const char *path)
+{
+   for( byte i = 0; i < LOG_HANDLE_CACHE_SIZE; i++ ){
 
-               trace(F("Cannot open sensor  log file (%s)\n"), tmp_buf);    // file create failed, return an error.
-               return false;    // failed to open/create file
-         }
-         wfile.print(F("Day,Time,"));  sprintf_P(tmp_buf, PSTR("%S"), sensorName);  wfile.println(tmp_buf);
-         
-//         trace(F("creating new log file for sensor:%S"), sensorName);
-      }
+        if( log_handles[i].fname[0] && (strcasecmp(log_handles[i].fname, path) == 0) ){
 
-      sprintf_P(tmp_buf, PSTR("%u,%u:%u,%d"), day(t), hour(t), minute(t), sensor_reading);
-      wfile.println(tmp_buf);
-      
-      wfile.close();
-      
-      return true;    // standard exit-success
+              log_handles[i].file.close();
+              log_handles[i].fname[0] = 0;
+        }
+   }
 }
 
-
-bool Logging::GraphZone(FILE* stream_file, time_t start, time_t end, GROUPING grouping)
+// Files written most often - the system log (/logs/mm-yyyy.log) and the sensor store
+//
+static bool isHotLogFile(const char *fname)
 {
-        grouping = max(NONE, min(grouping, MONTHLY));
-        char       bins = 0;
-        uint32_t bin_offset = 0;
-        uint32_t bin_scale = 1;
-
-        switch (grouping)
-        {
-        case HOURLY:
-                bins = 24;
-                break;
+   size_t  len = strlen(fname);
 
-        case DAILY:
-                bins = 7;
-                break;
+#ifdef SENSOR_STORE
+   if( strcmp_P(fname, PSTR(SENSOR_STORE_FNAME)) == 0 )
+        return true;
+#endif  // SENSOR_STORE
 
-        case MONTHLY:
-                bins = 12;
-                break;
+   return (strncmp_P(fname, PSTR(SYSTEM_LOG_DIR "/"), sizeof(SYSTEM_LOG_DIR)) == 0) && (len > 4) && (strcmp_P(fname + len - 4, PSTR(".log")) == 0);
+}
 
-        case NONE:
-                bins = 10;
-                bin_offset = start;
-                bin_scale = (end-start)/bins;
-                break;
-        }
+#ifdef SD_STATS
+void Logging::EmitCacheStats(FILE* stream_file)
+{
+   fprintf_P(stream_file, PSTR("\t\"log_handles\": { \"size\":%u, \"hits\":%lu, \"misses\":%lu, \"evictions\":%lu, \"open\":["),
+                               LOG_HANDLE_CACHE_SIZE, log_handle_hits, log_handle_misses, log_handle_evictions);
 
-        int current_zone = -1;
-        bool bFirstZone = true;
-        long int bin_data[bins];
+   for( byte i = 0; i < LOG_HANDLE_CACHE_SIZE; i++ )
+        fprintf_P(stream_file, PSTR("%s\"%s%s\""), i ? ",":"", log_handles[i].fname, log_handles[i].bPinned ? "*":"");
 
-        char tmp_buf[MAX_WATERING_LOG_RECORD_SIZE];
+   fprintf_P(stream_file, PSTR("] }\n"));
+}
+#endif  // SD_STATS
 
-        if (start == 0)
-                start = nntpTimeServer.LocalNow();
 
-        int    nyear=year(start);
 
-        end = max(start,end) + 24*3600;  // add 1 day to end time.
+//
+// Write-behind queue
+//
+// Log records are placed into the RAM ring buffer as compact binary entries (entry header followed by the payload) and formatted
+// and written to the log files later, from the main loop. Queued records are written grouped by the log file, so appends
+// to the same file go through the SdFat block cache together instead of evicting each other's blocks. Records are still appended
+// one at a time - there is no RAM for a sector buffer - the tail block is written to the card when it is evicted, fills up or is synced.
+//
 
-        int curr_zone = 255;
-        char bFirstRow = true;
+// Copy data into the queue at the tail. Caller ensures there is enough free space.
+//
+void Logging::queuePut(const void *data, byte len, bool bProgmem)
+{
+   const byte  *p = (const byte *)data;
+   uint16_t    pos = log_queue_head + log_queue_used;
 
-        for( int xzone = 1; xzone <= NUM_ZONES; xzone++ ){  // iterate over zones
+   if( pos >= LOG_QUEUE_SIZE ) pos -= LOG_QUEUE_SIZE;
 
-                    int bin_res = getZoneBins( xzone, start, end, bin_data, bins, grouping);
-                    if( bin_res > 0 ){  // some data available
-                    
-                                    if( curr_zone != xzone ){
-                                      
-                                         if( curr_zone != 255 ) 
-                                                   fprintf_P(stream_file, PSTR("], "));   // if this is not the first zone, add comma to the previous one
-                                         
-                                         fprintf_P(stream_file, PSTR("\n\t \"%d\": ["), xzone);   // JSON zone header
-                                         curr_zone = xzone;
-                                         bFirstRow = true;
-                                    }
+   while( len-- ){
 
-                                     bFirstRow = false;
-                                     for (int i=0; i<bins; i++)
-                                               fprintf(stream_file, "%s[%i, %lu]", (i==0)?"":",", i, bin_data[i]);
+        log_queue[pos] = bProgmem ? pgm_read_byte(p) : *p;
+        p++;
+        if( ++pos == LOG_QUEUE_SIZE ) pos = 0;
+   }
+}
 
-                    }  // if(bin_res>0)
-                    
-        }   // for( int xzone = 1; xzone <= xmaxzone; xzone++ )
+// Copy data from the queue starting at pos
+//
+void Logging::queueGet(uint16_t pos, void *data, byte len)
+{
+   byte  *p = (byte *)data;
 
-        if( curr_zone != 255)
-                     fprintf_P(stream_file, PSTR("\n\t\t\t\t\t ] \n"));    // close the last zone if we emitted
+   while( len-- ){
 
-        return true;
+        *p++ = log_queue[pos];
+        if( ++pos == LOG_QUEUE_SIZE ) pos = 0;
+   }
 }
 
-int Logging::getZoneBins( int zone, time_t start, time_t end, long int bin_data[], int bins, GROUPING grouping)
+// Add log record to the write-behind queue. If the queue is full, it is drained first.
+//
+// Returns true if successful and false if failure.
+//
+bool Logging::queueLogRecord(byte log_type, int log_id, time_t t, const void *data, byte len, bool bProgmem)
 {
-        char tmp_buf[MAX_WATERING_LOG_RECORD_SIZE];
-        int    bin_counter[bins];
-        int    r_counter = 0;
-        
-        memset( bin_counter, 0, bins*sizeof(int) );
-        memset( bin_data, 0, bins*sizeof(long int) );
-
-        if (start == 0)
-                start = nntpTimeServer.LocalNow();
+   LogQueueEntry  entry;
 
-        int    nyear=year(start);
+   if( !logger_ready ) return false;
 
-        end = max(start,end) + 24*3600;  // add 1 day to end time.
+   if( (LOG_QUEUE_SIZE - log_queue_used) < (sizeof(entry) + len) ){
 
-        unsigned int  nmend = month(end);
-        unsigned int  ndayend = day(end);
+        drainLogQueue();
 
-        if( year(end) != year(start) ){     // currently we cannot handle queries that span multiple years. Truncate the query to the year end.
+        if( (LOG_QUEUE_SIZE - log_queue_used) < (sizeof(entry) + len) ){
 
-             nmend = 12;    ndayend = 31;
+              trace(F("Log queue overflow, record dropped\n"));
+              return false;
         }
-        
-        SdFile lfile;
-        sprintf_P(tmp_buf, PSTR(WATERING_LOG_FNAME_FORMAT), nyear, zone );
+   }
 
-        if( !lfile.open(tmp_buf, O_READ) ){  // logs for each zone are stored in a separate file, with the file name based on the year and zone number. Try to open it.
+   entry.len = len;  entry.log_type = log_type;  entry.id = log_id;  entry.t = t;
 
-             return -1;  // cannot open watering log file
-        }
-        char bFirstRow = true;
+   if( log_queue_used == 0 )
+        log_queue_time = millis();
 
-        lfile.fgets(tmp_buf, MAX_WATERING_LOG_RECORD_SIZE);  // skip first line in the file - column headers
+   queuePut(&entry, sizeof(entry), false);
+   log_queue_used += sizeof(entry);
+   queuePut(data, len, bProgmem);
+   log_queue_used += len;
 
-// OK, we opened required watering log file. Iterate over records, filtering out necessary dates range
-                  
-        while( lfile.available() ){
+   return true;
+}
 
-                    unsigned int nhour = 0, nmonth = 0, nday = 0, nminute = 0;
-                    int  nduration = 0, nschedule = 0;
-                    int  nsadj = 0, nwunderground = 0;
+// Write all queued records to the log files.
+// Records are written one log file at a time - each pass writes all records of the log file of the first pending entry.
+//
+void Logging::drainLogQueue()
+{
+   LogQueueEntry  entry;
 
-                    int bytes = lfile.fgets(tmp_buf, MAX_WATERING_LOG_RECORD_SIZE);
-                    if (bytes <= 0)
-                                  break;
+   if( log_queue_draining || (log_queue_used == 0) ) return;
 
-// Parse the string into fields. First field (up to two digits) is the day of the month
+   log_queue_draining = true;   // writers could trigger queries (e.g. watering summary build), avoid recursion
 
-                    sscanf_P( tmp_buf, PSTR("%u,%u,%u:%u,%i,%i,%i,%i"),
-                                                    &nmonth, &nday, &nhour, &nminute, &nduration, &nschedule, &nsadj, &nwunderground);
-
-                    if( (nmonth > nmend) || ((nmonth == nmend) && (nday > ndayend)) )    // check for the end date
-                                 break;
-
-                    if( (nmonth > month(start)) || ((nmonth == month(start)) && (nday >= day(start)) )  ){        // the record is within required range. nmonth is the month, nday is the day of the month, xzone is the zone we are currently emitting
-
-                         switch (grouping)
-                         {
-                              case HOURLY:
-                              if( nhour <= 24 ){    // basic protection to ensure corrupted data will not crash the system
-                     
-                                   bin_data[nhour] += (long int)nduration;
-                                   bin_counter[nhour]++;
-                              }
-                              break;
-
-                              case DAILY:
-                              {
-                                       tmElements_t tm;   tm.Day = nday;  tm.Month = nmonth; tm.Year = nyear - 1970;  tm.Hour = nhour;  tm.Minute = nminute;  tm.Second = 0; 
-                                       unsigned int  dow=weekday(makeTime(tm));
-                                       
-                                       if( dow <= 7 ){    // basic protection to ensure corrupted data will not crash the system
-                     
-                                                 bin_data[dow] += (long int)nduration;
-                                                 bin_counter[dow]++;
-                                       }
-                              }
-                              break;
-
-                              case MONTHLY:
-                              if( nmonth <= 12 ){    // basic protection to ensure corrupted data will not crash the system
-                     
-                                   bin_data[nmonth] += (long int)nduration;
-                                   bin_counter[nmonth]++;
-                              }
-                              break;
-
-                              default:
-                                      return -2;  // unsupported grouping                        
-                              break;
-                         }  // switch(grouping)
-                    }      
-        } // while
-        
-        lfile.close();
-        
-//        trace(F("Zone=%i. Scaling bins, num bins=%i\n"), zone, bins);
-        
-        for( int i=0; i<bins; i++ ){
-          
-//              trace(F("i=%i, bin_data[i]=%lu, bin_counter[i]=%i\n"), i, bin_data[i], bin_counter[i]);
-              if( bin_counter[i] != 0 ){
-                
-                       bin_data[i] = bin_data[i]/(long int)bin_counter[i];   
-                       r_counter ++;
-              }
-        }
-  
-        return r_counter;
-}
+   while( log_queue_used > 0 ){
 
-bool Logging::TableZone(FILE* stream_file, time_t start, time_t end)
-{
-        char m;
-        char tmp_buf[MAX_WATERING_LOG_RECORD_SIZE];
+        LogQueueEntry  first;
+        uint16_t       pos = log_queue_head;
+        uint16_t       remaining = log_queue_used;
 
-        if (start == 0)
-                start = nntpTimeServer.LocalNow();
+        queueGet(log_queue_head, &first, sizeof(first));
 
-        unsigned int    nyear=year(start);
+        while( remaining > 0 ){
 
-        end = max(start,end) + 24*3600;  // add 1 day to end time.
+              queueGet(pos, &entry, sizeof(entry));
 
-        unsigned int  nmend = month(end);
-        unsigned int  ndayend = day(end);
+              if( (entry.log_type == first.log_type) && ((entry.id == first.id) || (entry.log_type == LOG_TYPE_SYSTEM)) ){    // note: system log id is the event type, all events go to the same file
 
-        if( year(end) != year(start) ){     // currently we cannot handle queries that span multiple years. Truncate the query to the year end.
+                    writeLogRecord(&entry, (pos + sizeof(entry)) % LOG_QUEUE_SIZE);
+                    log_queue[(pos + offsetof(LogQueueEntry, log_type)) % LOG_QUEUE_SIZE] = 0;     // mark entry as written
+              }
 
-             nmend = 12;    ndayend = 31;
+              pos = (pos + sizeof(entry) + entry.len) % LOG_QUEUE_SIZE;
+              remaining -= sizeof(entry) + entry.len;
         }
 
-        int curr_zone = 255;
-        for( int xzone = 1; xzone <= NUM_ZONES; xzone++ ){  // iterate over zones
+// release written entries at the head of the queue
+        while( log_queue_used > 0 ){
 
-                SdFile lfile;
-                sprintf_P(tmp_buf, PSTR(WATERING_LOG_FNAME_FORMAT), nyear, xzone );
+              queueGet(log_queue_head, &entry, sizeof(entry));
+              if( entry.log_type != 0 )
+                    break;
 
-                if( lfile.open(tmp_buf, O_READ) ){  // logs for each zone are stored in a separate file, with the file name based on the year and zone number. Try to open it.
-
-                    char bFirstRow = true;
-                    
-//                    if(xzone==1){
-//                         trace(F("***Reading zone=1, year=%u, month end=%u, day end=%u***\n"), nyear, nmend, ndayend);
-//                    }
+              log_queue_head = (log_queue_head + sizeof(entry) + entry.len) % LOG_QUEUE_SIZE;
+              log_queue_used -= sizeof(entry) + entry.len;
+        }
+   }
+   log_queue_head = 0;
 
-                     lfile.fgets(tmp_buf, MAX_WATERING_LOG_RECORD_SIZE);  // skip first line in the file - column headers
+   log_queue_draining = false;
 
-// OK, we opened required watering log file. Iterate over records, filtering out necessary dates range
-                  
-                     while( lfile.available() ){
+   syncLogFiles(false);
+}
 
-                            int  nmonth = 0, nday = 0, nhour = 0, nminute = 0, nschedule = 0;
-                            int  nduration = 0,  nsadj = 0, nwunderground = 0;
+// Write one queued record. Payload starts at pos in the queue.
+//
+void Logging::writeLogRecord(const LogQueueEntry *pEntry, uint16_t pos)
+{
+   switch (pEntry->log_type){
 
-                            int bytes = lfile.fgets(tmp_buf, MAX_WATERING_LOG_RECORD_SIZE);
-                            if (bytes <= 0)
-                                       break;
+       case LOG_TYPE_SYSTEM:
+                writeSyslogRecord(pEntry->t, pEntry->id, pos, pEntry->len);
+                break;
 
-// Parse the string into fields. First field (up to two digits) is the day of the month
+       case LOG_TYPE_WATERING:
+            {
+                ZoneEventRecord  rec;
 
-                            sscanf_P( tmp_buf, PSTR("%u,%u,%u:%u,%i,%i,%i,%i"),
-                                                            &nmonth, &nday, &nhour, &nminute, &nduration, &nschedule, &nsadj, &nwunderground);
+                queueGet(pos, &rec, sizeof(rec));
+                writeZoneEvent(pEntry->t, pEntry->id, &rec);
+            }
+                break;
 
-                            if( (nmonth > nmend) || ((nmonth == nmend) && (nday > ndayend)) )    // check for the end date
-                                         break;
+       case LOG_TYPE_WATERFLOW:
+            {
+                WaterFlowRecord  rec;
 
-                            if( (nmonth > month(start)) || ((nmonth == month(start)) && (nday >= day(start)) )  ){        // the record is within required range. nmonth is the month, nday is the day of the month, xzone is the zone we are currently emitting
+                queueGet(pos, &rec, sizeof(rec));
+                writeWaterFlow(pEntry->id, pEntry->t, &rec);
+            }
+                break;
 
-//                    if(xzone==1){
-//                      
-//                        trace(F("Found suitable string: %s\n"), tmp_buf);
-//                    }
+       default:     // sensor logs
+            {
+                int  sensor_reading;
 
-// we have something to output.
+                queueGet(pos, &sensor_reading, sizeof(sensor_reading));
+                writeSensorReading(logSensorType(pEntry->log_type), pEntry->id, pEntry->t, sensor_reading);
+            }
+                break;
+   }
+}
 
-                                    if( curr_zone != xzone ){
-                                      
-                                         if( curr_zone != 255 ) 
-                                                   fprintf_P(stream_file, PSTR("\n\t\t\t\t\t]\n\t\t\t\t},\n"));   // if this is not the first zone, close previous one
-                                         
-                                         fprintf_P(stream_file, PSTR("\n\t\t\t\t { \n\t\t\t\t \"zone\": %i,\n\t\t\t\t \"entries\": ["), xzone);   // JSON zone header
-                                         curr_zone = xzone;
-                                         bFirstRow = true;
-                                    }
-
-                                    tmElements_t tm;   tm.Day = nday;  tm.Month = nmonth; tm.Year = nyear - 1970;  tm.Hour = nhour;  tm.Minute = nminute;  tm.Second = 0;
-                            
-                                    fprintf_P(stream_file, PSTR("%s \n\t\t\t\t\t { \"date\":%lu, \"duration\":%i, \"schedule\":%i, \"seasonal\":%i, \"wunderground\":%i}"),
-                                                                       bFirstRow ? "":",",
-                                                                       makeTime(tm), nduration, nschedule, nsadj, nwunderground );
-
-                                     bFirstRow = false;
-                            }
-                     }   // while
-                     lfile.close();
-                }
-        }   // for( int xzone = 1; xzone <= xmaxzone; xzone++ )
 
-        if( curr_zone != 255)
-                     fprintf_P(stream_file, PSTR("\n\t\t\t\t\t ] \n\t\t\t\t } \n"));    // close the last zone if we emitted
+//
+// internal helpers
+//
 
-        return true;
+// Add new log record
+// Takes input string, returns true on success and false on failure
+//
+byte Logging::syslog_str(char evt_type, char *str)
+{
+   return syslog_str_internal(evt_type, str, false);
 }
 
-// emit sensor log as JSON
-bool Logging::EmitSensorLog(FILE* stream_file, time_t start, time_t end, char sensor_type, int sensor_id, char summary_type)
+// Add new log record
+// Takes input string FROM PROGRAM MEMORY, returns true on success and false on failure
+//
+byte Logging::syslog_str_P(char evt_type, char *str)
 {
-        char tmp_buf[MAX_LOG_RECORD_SIZE];
-        char *sensor_name;
+   return syslog_str_internal(evt_type, str, true);
+}
 
-        if (start == 0)
-                start = nntpTimeServer.LocalNow();
 
-        end = max(start,end) + 24*3600;  // add 1 day to end time.
+// Internal worker for syslog_str
+// First parameter is the string, second parameter is a flag indicating string location
+//     false == RAM
+//     true   == PROGMEM
+//
 
-        unsigned int    nyear, nyearend=year(end), nyearstart=year(start);
-        unsigned int    nmonth, nmend = month(end), nmstart=month(start);
-        unsigned int    ndayend = day(end), ndaystart=day(start);
+// Note: records are placed into the write-behind queue and written to the log file later, from the main loop.
+//       Error events force the queue to be written to the card immediately. Records longer than the queue can hold
+//       are written synchronously, after the queued records.
+//
+byte Logging::syslog_str_internal(char evt_type, char *str, char flag)
+{
+   if( !logger_ready ) return false;  //check if the logger is ready
 
-        char bFirstRow = true, bHeader = true;
+   size_t  len = flag ? strlen_P(str) : strlen(str);
 
-//  trace(F("EmitSensorLog - entering, nyearstart=%d, nmstart=%d, ndaystart=%d, nyearend=%d, nmend=%d, ndayend=%d\n"), nyearstart, nmstart, ndaystart, nyearend, nmend, ndayend );
+   if( len > (CL_TMPB_SIZE-20) ) return false;   // input string too long, reject it. Note: we need almost 20 bytes for the date/time etc
 
-        fprintf_P(stream_file, PSTR("\"series\": ["));   // JSON opening header
+#ifdef SYSLOG_COALESCE
+   if( !syslogCoalesce(evt_type, str, len, flag) )
+          return true;     // repeat of a recent event or rate limit exceeded, the event is counted and will be reported in the summary
+#endif  // SYSLOG_COALESCE
 
-        for( nyear=nyearstart; nyear<=nyearend; nyear++ )
-        {
-          for( nmonth=nmstart; nmonth<=nmend; nmonth++ )
-            {
+   if( len > (LOG_QUEUE_SIZE - sizeof(LogQueueEntry)) ){      // the record does not fit the write-behind queue, write it now
 
-                SdFile lfile;
+          if( !writeSyslogDirect(nntpTimeServer.LocalNow(), evt_type, str, flag) )
+                return false;
+   }
+   else if( !queueLogRecord(LOG_TYPE_SYSTEM, evt_type, nntpTimeServer.LocalNow(), str, len, flag) )
+          return false;
 
-//  trace(F("EmitSensorLog - processing month=%d\n"), nmonth );
+   if( evt_type == SYSEVENT_ERROR )
+          Sync();
 
-                if( sensor_type == SENSOR_TYPE_TEMPERATURE )
-                {
-                       sprintf_P(tmp_buf, PSTR(TEMPERATURE_LOG_FNAME_FORMAT), nmonth, nyear%100, sensor_id );
-                       sensor_name = PSTR("Temperature");
-                }
-                else if( sensor_type == SENSOR_TYPE_PRESSURE )
-                {
-                       sprintf_P(tmp_buf, PSTR(PRESSURE_LOG_FNAME_FORMAT), nmonth, nyear%100, sensor_id );
-                       sensor_name = PSTR("Air Pressure");
-                }
-                else if( sensor_type == SENSOR_TYPE_HUMIDITY )
-                {
-                       sprintf_P(tmp_buf, PSTR(HUMIDITY_LOG_FNAME_FORMAT), nmonth, nyear%100, sensor_id );
-                       sensor_name = PSTR("Humidity");
-                }
-                else  
-                {
-                     trace(F("EmitSensorLog - requested sensor type not recognized\n"));
+   return true;
+}
+
+#ifdef SYSLOG_COALESCE
+
+// Check new system event against recent events and the rate limit.
+// Returns true if the event should be logged, false if it was counted as a repeat or dropped.
+//
+bool Logging::syslogCoalesce(char evt_type, char *str, size_t len, char flag)
+{
+   unsigned long  now = millis();
+   uint16_t       hash = 5381 + evt_type;
+   byte           slot = 0;
+
+   for( size_t i = 0; i < len; i++ )
+         hash = (hash << 5) + hash + (flag ? pgm_read_byte(str + i) : str[i]);
+
+   if( hash == 0 ) hash = 1;      // zero marks unused slots
+
+   for( byte i = 0; i < SYSLOG_RECENT_SIZE; i++ ){
+
+         SyslogRecent  *pRecent = &syslog_recent[i];
+
+         if( pRecent->hash == hash ){
+
+               if( (now - pRecent->window_start) < SYSLOG_REPEAT_WINDOW ){
+
+                     if( pRecent->repeats != 0xFFFF )
+                           pRecent->repeats++;
                      return false;
-                }
+               }
+
+               slot = i;      // window expired, the event will be logged again
+               break;
+         }
 
-                if( lfile.open(tmp_buf, O_READ) )  // logs for each zone are stored in a separate file, with the file name based on the year and sensor ID. Try to open it.
-                {
+// replace the oldest slot if the event is not found
+         if( (pRecent->hash == 0) || ((syslog_recent[slot].hash != 0) && ((now - pRecent->window_start) > (now - syslog_recent[slot].window_start))) )
+               slot = i;
+   }
 
-// OK, we opened the data file.
-                
-                    long int  sensor_sum = 0;
-                    long int  sensor_c = 0;
-                    int          sensor_stamp = -1;
-                    int          sensor_stamp_h, sensor_stamp_d, sensor_stamp_m, sensor_stamp_y;                    
+// rate limiter, refill tokens first. The refill time advances by whole intervals only, so partial intervals are not lost.
+   unsigned long  refill = (now - syslog_tokens_time) / SYSLOG_RATE_INTERVAL;
 
-                    sensor_stamp_h = -1, sensor_stamp_d = sensor_stamp_m = sensor_stamp_y = -1;
+   if( (syslog_tokens + refill) >= SYSLOG_RATE_BURST ){
 
-                    lfile.fgets(tmp_buf, MAX_LOG_RECORD_SIZE);  // skip first line in the file - column headers
+         syslog_tokens = SYSLOG_RATE_BURST;
+         syslog_tokens_time = now;      // bucket is full
+   }
+   else if( refill > 0 ){
 
-// OK, we opened required watering log file. Iterate over records, filtering out necessary dates range
-                  
-                     while( lfile.available() ){
+         syslog_tokens += refill;
+         syslog_tokens_time += refill*SYSLOG_RATE_INTERVAL;
+   }
 
-                            int  nday = 0, nhour = 0, nminute = 0;
-                            int  sensor_reading = 0;
+   if( evt_type != SYSEVENT_ERROR ){     // errors are never dropped by the rate limiter
 
-                            int bytes = lfile.fgets(tmp_buf, MAX_LOG_RECORD_SIZE);
-                            if (bytes <= 0)
-                                       break;
+         if( syslog_tokens == 0 ){
 
-// Parse the string into fields. First field (up to two digits) is the day of the month
+               if( syslog_dropped != 0xFFFF )
+                     syslog_dropped++;
+               return false;
+         }
+         syslog_tokens--;
+   }
 
-                            sscanf_P( tmp_buf, PSTR("%u,%u:%u,%d"),
-                                                            &nday, &nhour, &nminute, &sensor_reading);
+// new event, remember it. Repeats summary for the event in the slot is written first.
+   SyslogRecent  *pRecent = &syslog_recent[slot];
 
-                            if( (nmonth > nmend) || ((nmonth == nmend) && (nday > ndayend)) )    // check for the end date
-                                         break;
+   syslogWriteRepeats(pRecent);
+   byte          text_len = min(len, (size_t)(SYSLOG_RECENT_TEXT - 1));
 
-                            if( (nmonth > nmstart) || ((nmonth == nmstart) && (nday >= ndaystart) )  ){        // the record is within required range. nmonth is the month, nday is the day of the month, xzone is the zone we are currently emitting
+   if( flag )
+         strncpy_P(pRecent->text, str, text_len);
+   else
+         strncpy(pRecent->text, str, text_len);
+   pRecent->text[text_len] = 0;
 
-// we have something to output.
+   pRecent->hash = hash;   pRecent->evt_type = evt_type;   pRecent->repeats = 0;   pRecent->window_start = now;
 
-                                    if( bHeader ){
-                                      
-                                         fprintf_P(stream_file, PSTR("{\n\t\t\t \"name\": \"%S readings, Sensor: %d\", \n\t\t\t\t \"data\": [\n"), sensor_name, sensor_id);   // JSON series header
-                                         bHeader = false;
-                                         bFirstRow = true;
-                                    }
-
-                                    if( summary_type == LOG_SUMMARY_HOUR )
-                                    {
-                                           if( sensor_stamp == -1 )    // this is the very first record, start generating summary
-                                           {
-                                                 sensor_sum = sensor_reading;
-                                                 sensor_c      = 1;
-                                                 sensor_stamp = nhour;
-                                                 sensor_stamp_d = nday;  sensor_stamp_m = nmonth; sensor_stamp_y = nyear;
-                                           }
-                                           else if( (sensor_stamp == nhour) && (sensor_stamp_d == nday) && (sensor_stamp_m == nmonth) && (sensor_stamp_y == nyear) )   // continue accumulation current sum
-                                           {                                             
-                                                 sensor_sum += sensor_reading;
-                                                 sensor_c++;
-                                           }
-                                           else   // close previous sum and start a new one
-                                           {
-                                                int sensor_average = int(sensor_sum/sensor_c);
-
-                                                tmElements_t tm;   tm.Day = sensor_stamp_d;  tm.Month = sensor_stamp_m; tm.Year = sensor_stamp_y - 1970;  tm.Hour = sensor_stamp;  tm.Minute = 0;  tm.Second = 0;
-                                                fprintf_P(stream_file, PSTR("%s \n\t\t\t\t\t [ %lu000, %d ]"),
-                                                                                              bFirstRow ? "":",",
-                                                                                              makeTime(tm), sensor_average );   // note: month should be in JavaScript format (starting from 0)
-                                                bFirstRow = false;
-   
-                                                 sensor_sum = sensor_reading;   // start new sum
-                                                 sensor_c      = 1;
-                                                 sensor_stamp = nhour;
-                                                 sensor_stamp_d = nday;  sensor_stamp_m = nmonth; sensor_stamp_y = nyear;
-                                           }
-                                    }
-                                    else if( summary_type == LOG_SUMMARY_DAY )
-                                    {
-                                           if( sensor_stamp == -1 )    // this is the very first record, start generating summary
-                                           {
-                                                 sensor_sum = sensor_reading;
-                                                 sensor_c      = 1;
-                                                 sensor_stamp = nday;
-                                                 sensor_stamp_m = nmonth; sensor_stamp_y = nyear;
-                                           }
-                                           else if( (sensor_stamp == nday) && (sensor_stamp_m == nmonth) && (sensor_stamp_y == nyear) )   // continue accumulation current sum
-                                           {                                             
-                                                 sensor_sum += sensor_reading;
-                                                 sensor_c++;
-                                           }
-                                           else   // close previous sum and start a new one
-                                           {
-                                                int sensor_average = (int)(sensor_sum/sensor_c);
-                                                
-                                                tmElements_t tm;   tm.Day = sensor_stamp;  tm.Month = sensor_stamp_m; tm.Year = sensor_stamp_y - 1970;  tm.Hour = 0;  tm.Minute = 0;  tm.Second = 0;
-
-                                                fprintf_P(stream_file, PSTR("%s \n\t\t\t\t\t [ %lu000, %d ]"),
-                                                                                              bFirstRow ? "":",",
-                                                                                              makeTime(tm), sensor_average );   // note: month should be in JavaScript format (starting from 0)
-
-                                                bFirstRow = false;
-   
-                                                 sensor_sum = sensor_reading;   // start new sum
-                                                 sensor_c      = 1;
-                                                 sensor_stamp = nday;
-                                                 sensor_stamp_m = nmonth; sensor_stamp_y = nyear;
-                                           }
-                                    }
-                                    else if( summary_type == LOG_SUMMARY_MONTH )
-                                    {
-                                           if( sensor_stamp == -1 )    // this is the very first record, start generating summary
-                                           {
-                                                 sensor_sum = sensor_reading;
-                                                 sensor_c      = 1;
-                                                 sensor_stamp = nmonth;
-                                                 sensor_stamp_y = nyear;
-                                           }
-                                           else if( (sensor_stamp == nmonth) && (sensor_stamp_y == nyear) )   // continue accumulation current sum
-                                           {                                             
-                                                 sensor_sum += sensor_reading;
-                                                 sensor_c++;
-                                           }
-                                           else   // close previous sum and start a new one
-                                           {
-                                                int sensor_average = int(sensor_sum/sensor_c);
-
-                                                tmElements_t tm;   tm.Day = 0;  tm.Month = sensor_stamp; tm.Year = sensor_stamp_y - 1970;  tm.Hour = 0;  tm.Minute = 0;  tm.Second = 0;
-                                                fprintf_P(stream_file, PSTR("%s \n\t\t\t\t\t [ %lu000, %d ]"),
-                                                                                              bFirstRow ? "":",",
-                                                                                              makeTime(tm), sensor_average );  
-                                                bFirstRow = false;
-   
-                                                 sensor_sum = sensor_reading;   // start new sum
-                                                 sensor_c      = 1;
-                                                 sensor_stamp = nmonth;
-                                                 sensor_stamp_y = nyear;
-                                           }
-                                    }
-                                    else  
-                                    {  // no summarization, just output readings as-is
-
-                                                tmElements_t tm;   tm.Day = nday;  tm.Month = nmonth; tm.Year = nyear - 1970;  tm.Hour = nhour;  tm.Minute = nminute;  tm.Second = 0;
-                                                fprintf_P(stream_file, PSTR("%s \n\t\t\t\t\t [ %lu000, %d ]"),
-                                                                                              bFirstRow ? "":",",
-                                                                                              makeTime(tm), sensor_reading );  
-                                    
-                                                bFirstRow = false;
-                                    }
-                            }  
-                     }   // while
-                     lfile.close();
-                }  // file open
-            }  //for( nmonth=nmstart; nmonth<=nmend; nmonth++ )
-        }  //for( nyear=nyearstart; nyear<=nyearend; nyear++ )
-
-        if( !bHeader )   // header flag was reset, it means we output at least one line
-        {
-               fprintf_P(stream_file, PSTR("\n\t\t\t\t ] \n \t }]\n"));
+   return true;
+}
+
+// Write summary record for suppressed repeats of the recent event, if any
+//
+void Logging::syslogWriteRepeats(SyslogRecent *pRecent)
+{
+   char  tmp_buf[SYSLOG_RECENT_TEXT + 24];
+
+   if( (pRecent->hash == 0) || (pRecent->repeats == 0) )
+         return;
+
+   sprintf_P(tmp_buf, PSTR("Repeated %u times: %s"), pRecent->repeats, pRecent->text);
+   queueLogRecord(LOG_TYPE_SYSTEM, pRecent->evt_type, nntpTimeServer.LocalNow(), tmp_buf, strlen(tmp_buf), false);
+
+   pRecent->repeats = 0;
+}
+
+// Write summary records for suppressed repeats of the events whose window expired (or all events if bForce is set),
+// and the number of events dropped by the rate limiter.
+//
+void Logging::syslogFlushRepeats(bool bForce)
+{
+   unsigned long  now = millis();
+   char           tmp_buf[48];
+
+   for( byte i = 0; i < SYSLOG_RECENT_SIZE; i++ ){
+
+         SyslogRecent  *pRecent = &syslog_recent[i];
+
+         if( (pRecent->hash == 0) || (!bForce && ((now - pRecent->window_start) < SYSLOG_REPEAT_WINDOW)) )
+               continue;
+
+         syslogWriteRepeats(pRecent);
+         pRecent->hash = 0;
+   }
+
+   if( (syslog_dropped != 0) && (bForce || (syslog_tokens > 0) || ((now - syslog_tokens_time) >= SYSLOG_RATE_INTERVAL)) ){
+
+         sprintf_P(tmp_buf, PSTR("Rate limit exceeded, %u events dropped"), syslog_dropped);
+         queueLogRecord(LOG_TYPE_SYSTEM, SYSEVENT_WARNING, nntpTimeServer.LocalNow(), tmp_buf, strlen(tmp_buf), false);
+         syslog_dropped = 0;
+   }
+}
+
+#endif  // SYSLOG_COALESCE
+
+// Open the system log file for the record time and write the record prefix (see log_format2.1.txt).
+// Returns the log file handle, the caller writes the record string and calls endSyslogRecord(). Returns NULL on failure.
+//
+Logging::LogHandle * Logging::beginSyslogRecord(time_t t, char evt_type)
+{
+// temp buffer for log strings processing
+   char tmp_buf[20];
+
+   sprintf_P(tmp_buf, PSTR(SYSTEM_LOG_FNAME_FORMAT), month(t), year(t) );
+
+   LogHandle  *pHandle = getLogFile(tmp_buf, NULL);
+
+   if( pHandle == NULL ){
+
+            trace(F("Cannot open system log file (%s)\n"), tmp_buf);
+
+            logger_ready = false;      // something is wrong with the log file, mark logger as "not ready"
+            return NULL;    // failed to open/create log file
+   }
+
+   if( day(t) != pHandle->last_day )      // first record of the day, update day index
+         updateSyslogIndex(pHandle, t);
+
+   sprintf_P(tmp_buf, PSTR("%u,%u:%u:%u,sys,%u,"), day(t), hour(t), minute(t), second(t), evt_type );
+
+   pHandle->file.print(tmp_buf);
+
+   return pHandle;
+}
+
+// Terminate system log record started with beginSyslogRecord()
+//
+void Logging::endSyslogRecord(LogHandle *pHandle)
+{
+   pHandle->file.write('\n');
+   pHandle->data_end = pHandle->file.fileSize();
+}
+
+// Write queued system log record. Record string is len bytes in the queue starting at pos.
+//
+bool Logging::writeSyslogRecord(time_t t, char evt_type, uint16_t pos, byte len)
+{
+   LogHandle  *pHandle = beginSyslogRecord(t, evt_type);
+
+   if( pHandle == NULL )
+         return false;
+
+// Output the string directly from the queue - one write, or two if the string wraps around the end of the queue.
+   byte  first_len = min(len, LOG_QUEUE_SIZE - pos);
+
+   pHandle->file.write(log_queue + pos, first_len);
+   if( first_len < len )
+      pHandle->file.write(log_queue, len - first_len);
+
+   endSyslogRecord(pHandle);
+   return true;
+}
+
+// Write system log record that does not fit the write-behind queue. Records queued before it are written first, to keep
+// the log in order.
+//
+bool Logging::writeSyslogDirect(time_t t, char evt_type, char *str, char flag)
+{
+   drainLogQueue();
+
+   LogHandle  *pHandle = beginSyslogRecord(t, evt_type);
+
+   if( pHandle == NULL )
+         return false;
+
+   if( flag )
+         pHandle->file.print((const __FlashStringHelper *)str);
+   else
+         pHandle->file.print(str);
+
+   endSyslogRecord(pHandle);
+   return true;
+}
+
+// Build system log day index from the log file data.
+// Returns false if the log file cannot be read or the index cannot be written.
+//
+static bool buildSyslogIndex(const char *log_fname, const char *index_fname)
+{
+        TimedSdFile   lfile, ifile;
+        SyslogIndex   index;
+        char          buf[MAX_LOG_RECORD_SIZE];
+        bool          bLineStart = true;
+
+        if( !lfile.open(log_fname, O_READ) )
+              return false;
+
+        memset(&index, 0, sizeof(index));
+
+        while( true ){
+
+              uint32_t  pos = lfile.curPosition();
+              int16_t   len = lfile.fgets(buf, sizeof(buf));
+
+              if( len <= 0 )
+                    break;
+
+              if( bLineStart ){
+
+                    unsigned int  nday = atoi(buf);
+
+                    if( (nday >= 1) && (nday <= 31) && (index.day_offset[nday-1] == 0) )     // note: if the clock went back, keep the first offset
+                          index.day_offset[nday-1] = pos + 1;
+              }
+              bLineStart = (buf[len-1] == '\n');      // long lines are read in several chunks
         }
+        lfile.close();
 
-    return true; 
+        if( !ifile.open(index_fname, O_WRITE | O_CREAT | O_TRUNC) )
+              return false;
+
+        bool  bOk = (ifile.write(&index, sizeof(index)) == sizeof(index));
+
+        ifile.close();
+        return bOk;
+}
+
+// Update system log day index for the first record of the day. Index file is created (from the log data) if it does not exist yet.
+//
+// Returns true if successful and false if failure.
+//
+bool Logging::updateSyslogIndex(LogHandle *pHandle, time_t t)
+{
+        char      fname[MAX_LOG_FNAME_SIZE];
+        TimedSdFile    ifile;
+        uint32_t  offset = 0;
+        uint32_t  index_pos = (day(t) - 1)*sizeof(uint32_t);
+
+        sprintf_P(fname, PSTR(SYSTEM_LOG_INDEX_FNAME_FORMAT), month(t), year(t) );
+
+        if( !sd.exists(fname) ){       // index is missing (e.g. log file created by an older firmware), build it
+
+              pHandle->file.sync();      // make sure the log data is on the card
+              if( !buildSyslogIndex(pHandle->fname, fname) )
+                    return false;
+        }
+
+        if( !ifile.open(fname, O_RDWR) ){
+
+              trace(F("Cannot open system log index (%s)\n"), fname);
+              return false;
+        }
+
+        if( ifile.seekSet(index_pos) && (ifile.read(&offset, sizeof(offset)) == sizeof(offset)) && (offset == 0) ){
+
+              offset = pHandle->data_end + 1;      // note: if the clock went back, keep the original offset
+              ifile.seekSet(index_pos);
+              ifile.write(&offset, sizeof(offset));
+        }
+        ifile.close();
+
+        pHandle->last_day = day(t);
+        return true;
+}
+
+// Find the offset of the first system log record on or after the given day of the month, using the day index.
+// Returns false if there are no such records.
+//
+bool Logging::findSyslogDay(unsigned int nyear, unsigned int nmonth, byte nday, uint32_t *pOffset)
+{
+        char      log_fname[MAX_LOG_FNAME_SIZE], fname[MAX_LOG_FNAME_SIZE];
+        TimedSdFile    ifile;
+        uint32_t  offset;
+
+        sprintf_P(log_fname, PSTR(SYSTEM_LOG_FNAME_FORMAT), nmonth, nyear );
+        sprintf_P(fname, PSTR(SYSTEM_LOG_INDEX_FNAME_FORMAT), nmonth, nyear );
+
+        if( !sd.exists(fname) && !buildSyslogIndex(log_fname, fname) ){
+
+              *pOffset = 0;       // no index available, scan the whole file
+              return true;
+        }
+
+        if( !ifile.open(fname, O_READ) || !ifile.seekSet((nday - 1)*sizeof(uint32_t)) ){
+
+              *pOffset = 0;
+              return true;
+        }
+
+        for( ; nday <= 31; nday++ ){
+
+              if( ifile.read(&offset, sizeof(offset)) != sizeof(offset) )
+                    break;
+
+              if( offset != 0 ){
+
+                    ifile.close();
+                    *pOffset = offset - 1;
+                    return true;
+              }
+        }
+        ifile.close();
+
+        return false;
+}
+
+// Check if the file name (8.3, as returned by the file system) is a system log MM-YYYY.log (not its day index MM-YYYY.idx).
+// Month and year of the log are returned.
+//
+static bool isSyslogFileName(const char *fname, unsigned int *pMonth, unsigned int *pYear)
+{
+        if( (strlen(fname) != 11) || (fname[2] != '-') || (strcasecmp_P(fname + 7, PSTR(".log")) != 0) )
+              return false;
+
+        return (sscanf_P(fname, PSTR("%2u-%4u."), pMonth, pYear) == 2) && (*pMonth >= 1) && (*pMonth <= 12);
+}
+
+// Month key (year*12 + month - 1) of the oldest system log file, -1 if there are no system logs
+//
+static long oldestSyslogKey()
+{
+        TimedSdFile   dir, entry;
+        char          fname[13];
+        unsigned int  nmonth, nyear;
+        long          oldest_key = -1;
+
+        if( !dir.open(SYSTEM_LOG_DIR, O_READ) )
+              return -1;
+
+        while( entry.openNext(&dir, O_READ) ){
+
+              entry.getFilename(fname);
+              entry.close();
+
+              if( isSyslogFileName(fname, &nmonth, &nyear) ){
+
+                    long  key = (long)nyear*12 + nmonth - 1;
+
+                    if( (oldest_key < 0) || (key < oldest_key) )
+                          oldest_key = key;
+              }
+        }
+        dir.close();
+
+        return oldest_key;
+}
+
+// Emit system log events between sdate and edate (oldest first), filtered by severity (events of the given type or more severe,
+// 0 - all events) and by substring (NULL or empty string - no filter).
+//
+// Query starts from the cursor (yyyymm of the log file and the file offset, 0 - start from sdate using the day index).
+// Up to n events are returned, followed by the cursor of the next page (if there are more events).
+//
+bool Logging::QuerySyslog(FILE* stream_file, time_t sdate, time_t edate, char severity, const char *text, uint32_t cursor_month, uint32_t cursor_offset, int n)
+{
+        char      fname[MAX_LOG_FNAME_SIZE];
+        char      line[SYSLOG_QUERY_LINE_SIZE];
+        int       count = 0;
+        bool      bDone = false;
+
+        n = max(1, min(n, SYSLOG_QUERY_MAX));
+
+        if( edate == 0 )
+              edate = nntpTimeServer.LocalNow();
+
+        unsigned int  nyear = year(sdate), nmonth = month(sdate);
+        uint32_t      offset = 0;
+        bool          bUseIndex = true;
+
+        if( cursor_month != 0 ){      // continuation of the previous query
+
+              nyear = cursor_month / 100;   nmonth = cursor_month % 100;
+              offset = cursor_offset;
+              bUseIndex = false;
+
+              if( (nmonth < 1) || (nmonth > 12) )
+                    return false;
+        }
+        else {
+
+              long  oldest_key = oldestSyslogKey();
+
+              if( ((long)nyear*12 + nmonth - 1) < oldest_key ){      // no logs before the oldest file (e.g. sdate is 0), start from there
+
+                    nyear = oldest_key / 12;   nmonth = oldest_key % 12 + 1;
+                    bUseIndex = false;
+              }
+        }
+
+        long  last_key = (long)year(edate)*12 + month(edate) - 1;
+
+        Sync();     // make sure recently logged records are on the card
+
+        fprintf_P(stream_file, PSTR("\t\"events\": ["));
+
+        while( !bDone && (((long)nyear*12 + nmonth - 1) <= last_key) ){
+
+              TimedSdFile  lfile;
+
+              sprintf_P(fname, PSTR(SYSTEM_LOG_FNAME_FORMAT), nmonth, nyear );
+
+              if( bUseIndex && (nyear == year(sdate)) && (nmonth == month(sdate)) && !findSyslogDay(nyear, nmonth, day(sdate), &offset) )
+                    offset = 0xFFFFFFFF;     // no records on or after the start date in this month
+
+              if( (offset != 0xFFFFFFFF) && lfile.open(fname, O_READ) && lfile.seekSet(offset) ){
+
+                    while( true ){
+
+                          uint32_t  line_start = lfile.curPosition();
+                          int16_t   len = lfile.fgets(line, sizeof(line));
+                          byte      ntype, text_pos;
+                          time_t    t;
+
+                          if( len <= 0 )
+                                break;
+
+                          bool  bEol = (line[len-1] == '\n');
+                          bool  bMatch = false;
+
+                          if( parseSyslogRecord(line, nyear, nmonth, &t, &ntype, &text_pos) && (text_pos < len) ){
+
+                                if( t > edate ){
+
+                                      bDone = true;
+                                      break;
+                                }
+
+                                bMatch = (t >= sdate) && ((severity == 0) || ((ntype != 0) && (ntype <= severity))) &&
+                                         ((text == NULL) || (text[0] == 0) || (strstr(line + text_pos, text) != NULL));   // note: substring is matched against the first part of long lines
+                          }
+
+                          if( bMatch ){
+
+                                if( count == n ){      // page is full, next page starts from this record
+
+                                      fprintf_P(stream_file, PSTR("\n\t],\n\t\"next\": \"%4.4u%2.2u.%lu\"\n"), nyear, nmonth, line_start);
+                                      lfile.close();
+                                      return true;
+                                }
+
+                                fprintf_P(stream_file, PSTR("%s \n\t\t { \"date\":%lu, \"type\":%u, \"text\":\""), count ? ",":"", t, ntype );
+
+                                for( char *p = line + text_pos; (*p != 0) && (*p != '\r') && (*p != '\n'); p++ )
+                                      emitJSONChar(stream_file, *p);
+                          }
+
+// the rest of a long line
+                          while( !bEol ){
+
+                                int  c = lfile.read();
+
+                                if( c < 0 )
+                                      break;
+
+                                bEol = (c == '\n');
+                                if( bMatch && !bEol && (c != '\r') )
+                                      emitJSONChar(stream_file, c);
+                          }
+
+                          if( bMatch ){
+
+                                fprintf_P(stream_file, PSTR("\"}"));
+                                count++;
+                          }
+                    }
+              }
+              lfile.close();
+
+              offset = 0;   bUseIndex = false;      // following months are scanned from the beginning
+              if( ++nmonth > 12 ){
+
+                    nmonth = 1;   nyear++;
+              }
+        }
+
+        fprintf_P(stream_file, PSTR("\n\t]\n"));
+
+        return true;
+}
+
+
+// Record watering event
+//
+// Note: watering log file is kept open in the log files cache, records are placed into the write-behind queue
+
+#define MAX_WATERING_LOG_RECORD_SIZE    80
+
+bool Logging::LogZoneEvent(time_t start, int zone, int duration, int schedule, int sadj, int wunderground)
+{
+      ZoneEventRecord  rec;
+
+      rec.start = start;  rec.duration = duration;  rec.schedule = schedule;  rec.sadj = sadj;  rec.wunderground = wunderground;
+
+      return queueLogRecord(LOG_TYPE_WATERING, zone, nntpTimeServer.LocalNow(), &rec, sizeof(rec), false);
 }
 
+// Write queued watering event to the zone watering log
+//
+bool Logging::writeZoneEvent(time_t t, int zone, const ZoneEventRecord *pRec)
+{
+      bool   bCreated;
+// temp buffer for log strings processing
+      char tmp_buf[MAX_WATERING_LOG_RECORD_SIZE];
+      time_t start = pRec->start;
+
+      sprintf_P(tmp_buf, PSTR(WATERING_LOG_FNAME_FORMAT), year(t), zone );
+
+      LogHandle *pHandle = getLogFile(tmp_buf, &bCreated, O_RDWR, WATERING_LOG_PREALLOC_SIZE);   // note: no O_APPEND, file could be preallocated
+
+      if( pHandle == NULL ){
+
+               trace(F("Cannot open watering log file (%s)\n"), tmp_buf);    // file create failed, return an error.
+               return false;    // failed to open/create file
+      }
+
+      if( bCreated ){    // log file for this year did not exist yet, add column headers.
+
+               strcpy_P(tmp_buf, PSTR("Month,Day,Time,Run time(min),ScheduleID,Adjustment,WUAdjustment\r\n"));
+               appendLogData(pHandle, tmp_buf, strlen(tmp_buf));
+      }
+
+      uint32_t  rec_offset = pHandle->data_end;       // record will be written at the logical end of the file
+
+      sprintf_P(tmp_buf, PSTR("%u,%u,%u:%u,%u,%u,%i,%i\r\n"), month(start), day(start), hour(start), minute(start), pRec->duration, pRec->schedule, pRec->sadj, pRec->wunderground);
 
+      if( !appendLogData(pHandle, tmp_buf, strlen(tmp_buf)) ){
+
+               trace(F("Cannot write watering log file (%s)\n"), pHandle->fname);
+               return false;
+      }
+
+      updateWateringSummary(year(t), zone, start, pRec->duration, rec_offset);
+
+      return true;
+}
+
+// Sensors logging - record sensor reading. 
+// Covers all types of basic pressure sensors that provide momentarily (immediate) readings.
+//
+// sensor_type       -  could be SENSOR_TYPE_TEMPERATURE or any other valid defines
+// sensor_id           -  numeric ID of the sensor, minimum 0, maximum 999
+// sensor_reading  -  actual sensor reading
+//
+// Returns true if successful and false if failure.
+//
+bool Logging::LogSensorReading(char sensor_type, int sensor_id, int sensor_reading)
+{
+      byte  log_type = sensorLogType(sensor_type);
+
+      if( log_type == 0 )
+               return false;    // sensor_type not recognized
+
+      return queueLogRecord(log_type, sensor_id, nntpTimeServer.LocalNow(), &sensor_reading, sizeof(sensor_reading), false);
+}
+
+// Write queued sensor reading to the sensor log
+//
+bool Logging::writeSensorReading(char sensor_type, int sensor_id, time_t t, int sensor_reading)
+{
+#ifdef SENSOR_STORE
+      if( storeSensorReading(sensor_type, sensor_id, t, sensor_reading) ){
+
+               updateRollups(sensor_type, sensor_id, t, sensor_reading);
+               return true;
+      }
+
+      if( !store_unavailable )
+               return false;    // store write failed
+#endif  // SENSOR_STORE
+
+// monthly sensor log
+      bool   bCreated;
+
+// temp buffer for log strings processing
+      char tmp_buf[MAX_LOG_FNAME_SIZE];
+
+      if( !sensorLogFileName(tmp_buf, sensor_type, sensor_id, month(t), year(t)) )
+               return false;    // sensor_type not recognized
+
+//    trace(F("LogSensorReading - about to open file: %s\n"), tmp_buf);
+
+      LogHandle *pHandle = getLogFile(tmp_buf, &bCreated, O_RDWR, SENSOR_LOG_PREALLOC_SIZE);    // note: no O_APPEND, binary logs update day index in the file header
+
+      if( pHandle == NULL ){
+
+               trace(F("Cannot open sensor  log file (%s)\n"), tmp_buf);    // file create failed, return an error.
+               return false;    // failed to open/create file
+      }
+
+      if( bCreated ){   // log file for this month did not exist yet, add file header.
+
+#ifdef SENSOR_LOG_BINARY
+         SensorLogHeader  hdr;
+
+         memcpy_P(hdr.signature, PSTR(SENSOR_LOG_SIGNATURE), sizeof(hdr.signature));
+         hdr.version = SENSOR_LOG_VERSION;
+         hdr.sensor_type = sensor_type;
+         hdr.record_size = sizeof(SensorLogRecord);
+         memset(hdr.day_index, 0xFF, sizeof(hdr.day_index));     // SENSOR_LOG_NO_RECORDS for all days
+
+         appendLogData(pHandle, &hdr, sizeof(hdr));
+         pHandle->format = LOG_FORMAT_BINARY;
+#else
+         char  col_buf[MAX_LOG_RECORD_SIZE];
+
+         sprintf_P(col_buf, PSTR("Day,Time,%S\r\n"), sensorColumnName(sensor_type));
+         appendLogData(pHandle, col_buf, strlen(col_buf));
+#endif  // SENSOR_LOG_BINARY
+         
+//         trace(F("creating new log file for sensor:%S"), sensorColumnName(sensor_type));
+      }
+
+      if( pHandle->format == LOG_FORMAT_BINARY ){
+
+         if( !appendBinarySensorRecord(pHandle, t, sensor_reading) ){
+
+               trace(F("Cannot write sensor log file (%s)\n"), pHandle->fname);
+               return false;
+         }
+      }
+      else {
+
+         sprintf_P(tmp_buf, PSTR("%u,%u:%u,%d\r\n"), day(t), hour(t), minute(t), sensor_reading);
+
+         if( !appendLogData(pHandle, tmp_buf, strlen(tmp_buf)) ){
+
+               trace(F("Cannot write sensor log file (%s)\n"), pHandle->fname);
+               return false;
+         }
+      }
+
+      updateRollups(sensor_type, sensor_id, t, sensor_reading);
+
+      return true;    // standard exit-success
+}
+
+#ifdef SENSOR_STORE
+//
+// Sensor time-series store (see SENSOR_STORE in sdlog.h and log_format2.1.txt)
+//
+
+// File position of the store page
+//
+static uint32_t storePagePos(byte slot, uint16_t page)
+{
+        return (1UL + (uint32_t)slot*SENSOR_STORE_PAGES + page) * SENSOR_STORE_PAGE_SIZE;
+}
+
+// Read store page header. Leaves file position at the page payload.
+//
+static bool storeReadPage(TimedSdFile &lfile, byte slot, uint16_t page, SensorStorePage *pPage)
+{
+        return lfile.seekSet(storePagePos(slot, page)) && (lfile.read(pPage, sizeof(SensorStorePage)) == sizeof(SensorStorePage));
+}
+
+// Read and verify store directory
+//
+static bool storeReadHeader(TimedSdFile &lfile, SensorStoreHeader *pHdr)
+{
+        return lfile.seekSet(0) && (lfile.read(pHdr, sizeof(SensorStoreHeader)) == sizeof(SensorStoreHeader)) &&
+               (strncmp_P(pHdr->signature, PSTR(SENSOR_STORE_SIGNATURE), sizeof(pHdr->signature)) == 0) &&
+               (pHdr->page_size == SENSOR_STORE_PAGE_SIZE) && (pHdr->pages == SENSOR_STORE_PAGES) && (pHdr->nseries == SENSOR_STORE_SERIES);
+}
+
+// Encode value as zigzag varint (up to 5 bytes). Returns the number of bytes.
+//
+static byte storeEncode(byte *p, long v)
+{
+        uint32_t  zz = ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+        byte      len = 0;
+
+        while( zz >= 0x80 ){
+
+              p[len++] = (zz & 0x7F) | 0x80;
+              zz >>= 7;
+        }
+        p[len++] = zz;
+
+        return len;
+}
+
+// Decode zigzag varint from the file
+//
+static bool storeDecode(TimedSdFile &lfile, long *pv)
+{
+        uint32_t  zz = 0;
+
+        for( byte shift = 0; shift < 35; shift += 7 ){
+
+              int  c = lfile.read();
+
+              if( c < 0 )
+                    return false;
+
+              zz |= (uint32_t)(c & 0x7F) << shift;
+
+              if( !(c & 0x80) ){
+
+                    *pv = (long)(zz >> 1) ^ -(long)(zz & 1);
+                    return true;
+              }
+        }
+        return false;
+}
+
+// Append sensor reading to the series in the store. The series is added to the store directory on the first reading.
+//
+// Returns true if successful and false if failure.
+//
+bool Logging::storeSensorReading(char sensor_type, int sensor_id, time_t t, int sensor_reading)
+{
+        char               fname[MAX_LOG_FNAME_SIZE];
+        bool               bCreated;
+        SensorStoreHeader  hdr;
+        SensorStorePage    page;
+        byte               slot = SENSOR_STORE_NO_SLOT;
+
+        if( store_unavailable )
+               return false;
+
+        strcpy_P(fname, PSTR(SENSOR_STORE_FNAME));
+
+        LogHandle *pHandle = getLogFile(fname, &bCreated, O_RDWR, SENSOR_STORE_SIZE);
+
+        if( pHandle == NULL ){
+
+               trace(F("Cannot open sensor store (%s)\n"), fname);
+               return false;
+        }
+
+        if( pHandle->file.fileSize() < SENSOR_STORE_SIZE ){     // preallocation failed (no contiguous free space), or the file is truncated
+
+               trace(F("Sensor store %s is not available, using monthly sensor logs\n"), fname);
+               closeLogFile(fname);
+               if( bCreated )
+                      sd.remove(fname);
+               store_unavailable = true;
+               return false;
+        }
+
+        TimedSdFile  *lfile = &pHandle->file;
+
+        if( bCreated ){    // new store, write empty directory
+
+               memset(&hdr, 0, sizeof(hdr));
+               memcpy_P(hdr.signature, PSTR(SENSOR_STORE_SIGNATURE), sizeof(hdr.signature));
+               hdr.version = SENSOR_STORE_VERSION;
+               hdr.page_size = SENSOR_STORE_PAGE_SIZE;
+               hdr.pages = SENSOR_STORE_PAGES;
+               hdr.nseries = SENSOR_STORE_SERIES;
+
+               if( !lfile->seekSet(0) || (lfile->write(&hdr, sizeof(hdr)) != sizeof(hdr)) )
+                      return false;
+        }
+        else if( !storeReadHeader(*lfile, &hdr) ){
+
+               trace(F("Sensor store %s is corrupted or has different layout\n"), fname);
+               return false;
+        }
+
+        pHandle->bDirty = true;     // all store updates are in place
+
+        for( byte i = 0; i < SENSOR_STORE_SERIES; i++ ){
+
+               if( (hdr.series[i].sensor_type == sensor_type) && (hdr.series[i].sensor_id == sensor_id) ){
+
+                      slot = i;
+                      break;
+               }
+               if( (hdr.series[i].sensor_type == 0) && (slot == SENSOR_STORE_NO_SLOT) )
+                      slot = i;
+        }
+
+        if( slot == SENSOR_STORE_NO_SLOT ){
+
+               trace(F("Sensor store is full, reading dropped\n"));
+               return false;
+        }
+
+        SensorStoreSeries  *pSeries = &hdr.series[slot];
+
+        if( pSeries->sensor_type == 0 ){      // new series
+
+               pSeries->sensor_type = sensor_type;   pSeries->sensor_id = sensor_id;
+               pSeries->head = pSeries->pages = 0;
+        }
+        else if( pSeries->pages != 0 ){
+
+// append to the current page if there is space
+               if( !storeReadPage(*lfile, slot, pSeries->head, &page) )
+                      return false;
+
+               byte   enc[10];
+               long   delta = (long)(t - page.t_last);
+               byte   len = storeEncode(enc, delta - page.last_delta);
+
+               len += storeEncode(enc + len, (long)sensor_reading - page.v_last);
+
+               if( (page.count != 0) && ((page.used + len) <= SENSOR_STORE_PAYLOAD) ){
+
+                      uint32_t  pos = storePagePos(slot, pSeries->head);
+
+                      if( !lfile->seekSet(pos + sizeof(page) + page.used) || (lfile->write(enc, len) != len) )
+                             return false;
+
+                      page.used += len;   page.count++;
+                      page.t_last = t;    page.v_last = sensor_reading;   page.last_delta = delta;
+
+                      return lfile->seekSet(pos) && (lfile->write(&page, sizeof(page)) == sizeof(page));
+               }
+
+// page is full, move to the next page (reusing the oldest page when the ring is full)
+               pSeries->head = (pSeries->head + 1) % SENSOR_STORE_PAGES;
+        }
+
+        if( pSeries->pages < SENSOR_STORE_PAGES )
+               pSeries->pages++;
+
+        page.t_first = page.t_last = t;
+        page.v_first = page.v_last = sensor_reading;
+        page.last_delta = 0;   page.count = 1;   page.used = 0;
+
+        if( !lfile->seekSet(storePagePos(slot, pSeries->head)) || (lfile->write(&page, sizeof(page)) != sizeof(page)) )
+               return false;
+
+        uint32_t  dir_pos = offsetof(SensorStoreHeader, series) + slot*sizeof(SensorStoreSeries);
+
+        return lfile->seekSet(dir_pos) && (lfile->write(pSeries, sizeof(SensorStoreSeries)) == sizeof(SensorStoreSeries));
+}
+#endif  // SENSOR_STORE
+
+// Water flow logging - record water flow for the period of time that ended now.
+//
+// sensor_id       -  numeric ID of the sensor, minimum 0, maximum 999
+// flow            -  water flow during the period, in 0.01 gallon units
+// duration        -  period duration in seconds
+//
+// Note: records are expected only for periods when water flow was detected (see log_format2.1.txt).
+//
+// Returns true if successful and false if failure.
+//
+
+#define MAX_WFLOW_LOG_RECORD_SIZE       40
+
+bool Logging::LogWaterFlow(int sensor_id, unsigned int flow, unsigned int duration)
+{
+      WaterFlowRecord  rec;
+
+      rec.flow = flow;  rec.duration = duration;
+
+      return queueLogRecord(LOG_TYPE_WATERFLOW, sensor_id, nntpTimeServer.LocalNow(), &rec, sizeof(rec), false);
+}
+
+// Write queued water flow record to the water flow log
+//
+bool Logging::writeWaterFlow(int sensor_id, time_t t, const WaterFlowRecord *pRec)
+{
+      bool   bCreated;
+// temp buffer for log strings processing - file name, column headers and the record
+      char tmp_buf[MAX_WFLOW_LOG_RECORD_SIZE];
+
+      sprintf_P(tmp_buf, PSTR(WFLOW_LOG_FNAME_FORMAT), month(t), year(t)%100, sensor_id );
+
+      LogHandle *pHandle = getLogFile(tmp_buf, &bCreated, O_RDWR, SENSOR_LOG_PREALLOC_SIZE);   // note: no O_APPEND, file could be preallocated
+
+      if( pHandle == NULL ){
+
+               trace(F("Cannot open water flow log file (%s)\n"), tmp_buf);    // file create failed, return an error.
+               return false;    // failed to open/create file
+      }
+
+      if( bCreated ){    // log file for this month did not exist yet, add column headers.
+
+               strcpy_P(tmp_buf, PSTR("Day,Time,WaterFlow,Duration(sec)\r\n"));
+               appendLogData(pHandle, tmp_buf, strlen(tmp_buf));
+      }
+
+      sprintf_P(tmp_buf, PSTR("%u,%u:%u,%u.%2.2u,%u\r\n"), day(t), hour(t), minute(t), pRec->flow/100, pRec->flow%100, pRec->duration);
+
+      if( !appendLogData(pHandle, tmp_buf, strlen(tmp_buf)) ){
+
+               trace(F("Cannot write water flow log file (%s)\n"), pHandle->fname);
+               return false;
+      }
+
+      return true;
+}
+
+// Emit water flow log as JSON - series of [time, flow, duration] points, flow is in gallons.
+//
+bool Logging::EmitWaterFlowLog(FILE* stream_file, time_t start, time_t end, int sensor_id)
+{
+        LogCursor  cursor;
+        LogRecord  rec;
+        char       bFirstRow = true;
+
+        Sync();     // make sure recently logged records are on the card
+
+        if (start == 0)
+                start = nntpTimeServer.LocalNow();
+
+        end = max(start,end) + 24*3600;  // add 1 day to end time.
+
+        fprintf_P(stream_file, PSTR("\"series\": ["));   // JSON opening header
+
+        cursor.begin(LOG_TYPE_WATERFLOW, sensor_id, previousMidnight(start), end);    // water flow logs are stored in separate files, one file per month
+
+        while( cursor.next(&rec) ){
+
+                if( bFirstRow )
+                       fprintf_P(stream_file, PSTR("{\n\t\t\t \"name\": \"Water flow, Sensor: %d\", \n\t\t\t\t \"data\": [\n"), sensor_id);   // JSON series header
+
+                fprintf_P(stream_file, PSTR("%s \n\t\t\t\t\t [ %lu000, %u.%2.2u, %u ]"), bFirstRow ? "":",", rec.t, (unsigned int)rec.value[0]/100, (unsigned int)rec.value[0]%100, rec.value[1]);
+                bFirstRow = false;
+        }
+
+        if( !bFirstRow )   // first row flag was reset, it means we output at least one line
+               fprintf_P(stream_file, PSTR("\n\t\t\t\t ] \n \t }]\n"));
+        else
+               fprintf_P(stream_file, PSTR("]\n"));
+
+        return true;
+}
+
+// Append sensor reading to the binary sensor log.
+// If this is the first record for the day, day index in the file header is updated as well.
+//
+// Returns true if successful and false if failure.
+//
+bool Logging::appendBinarySensorRecord(LogHandle *pHandle, time_t t, int sensor_reading)
+{
+      TimedSdFile      *lfile = &pHandle->file;
+      SensorLogRecord  rec;
+      uint32_t         fsize = pHandle->data_end;      // note: preallocated file could be larger than the data
+
+      rec.day = day(t);  rec.hour = hour(t);  rec.minute = minute(t);  rec.reading = sensor_reading;
+
+      if( (pHandle->last_day == 0) && (fsize >= sizeof(SensorLogHeader) + sizeof(SensorLogRecord)) ){    // day of the last record is not known yet, read it from the file
+
+            SensorLogRecord  last_rec;
+
+            if( lfile->seekSet(fsize - sizeof(SensorLogRecord)) && (lfile->read(&last_rec, sizeof(last_rec)) == sizeof(last_rec)) )
+                    pHandle->last_day = last_rec.day;
+      }
+
+      if( rec.day != pHandle->last_day ){     // first record of the day, update day index
+
+            uint16_t  rec_index = SENSOR_LOG_NO_RECORDS;
+            uint32_t  index_pos = offsetof(SensorLogHeader, day_index) + rec.day*sizeof(uint16_t);
+
+            if( !lfile->seekSet(index_pos) || (lfile->read(&rec_index, sizeof(rec_index)) != sizeof(rec_index)) )
+                    return false;
+
+            if( rec_index == SENSOR_LOG_NO_RECORDS ){      // note: if the clock went back, keep the original index
+
+                    rec_index = (fsize - sizeof(SensorLogHeader))/sizeof(SensorLogRecord);
+
+                    if( !lfile->seekSet(index_pos) || (lfile->write(&rec_index, sizeof(rec_index)) != sizeof(rec_index)) )
+                             return false;
+
+                    pHandle->bDirty = true;
+            }
+            pHandle->last_day = rec.day;
+      }
+
+      return appendLogData(pHandle, &rec, sizeof(rec));
+}
+
+// Read next sensor log record, either binary (directly from the file) or text (through the line reader).
+// Returns true if successful and false at the end of file.
+//
+static bool readSensorRecord(TimedSdFile &lfile, LogLineReader *pReader, byte format, SensorLogRecord *pRec)
+{
+      if( format == LOG_FORMAT_BINARY )
+            return (lfile.read(pRec, sizeof(SensorLogRecord)) == sizeof(SensorLogRecord)) && (pRec->day != 0);     // zero day - end of data in a preallocated file
+
+      char          *line = pReader->nextLine();
+      unsigned int  nday = 0, nhour = 0, nminute = 0;
+      int           sensor_reading = 0;
+
+      if( line == NULL )
+            return false;
+
+// Parse the string into fields. First field (up to two digits) is the day of the month
+
+      sscanf_P( line, PSTR("%u,%u:%u,%d"), &nday, &nhour, &nminute, &sensor_reading);
+
+      pRec->day = nday;  pRec->hour = nhour;  pRec->minute = nminute;  pRec->reading = sensor_reading;
+      return true;
+}
+
+// Check if the file is a binary sensor log (by file signature). Leaves file position at the beginning of the file.
+//
+bool Logging::IsBinarySensorLog(TimedSdFile &lfile)
+{
+      return isBinarySensorLog(lfile);
+}
+
+static bool isBinarySensorLog(TimedSdFile &lfile)
+{
+      char  signature[sizeof(((SensorLogHeader *)0)->signature)];
+      bool  bBinary = false;
+
+      if( lfile.fileSize() >= sizeof(SensorLogHeader) ){
+
+            lfile.seekSet(0);
+            bBinary = (lfile.read(signature, sizeof(signature)) == sizeof(signature)) && (strncmp_P(signature, PSTR(SENSOR_LOG_SIGNATURE), sizeof(signature)) == 0);
+      }
+      lfile.seekSet(0);
+
+      return bBinary;
+}
+
+// Export binary sensor log in CSV format (as described in log_format2.1.txt)
+//
+bool Logging::ExportSensorLog(FILE* stream_file, TimedSdFile &lfile)
+{
+      SensorLogHeader  hdr;
+      SensorLogRecord  rec;
+
+      lfile.seekSet(0);
+      if( (lfile.read(&hdr, sizeof(hdr)) != sizeof(hdr)) || (hdr.record_size != sizeof(SensorLogRecord)) )
+            return false;
+
+      fprintf_P(stream_file, PSTR("Day,Time,%S\r\n"), sensorColumnName(hdr.sensor_type));
+
+      while( readSensorRecord(lfile, NULL, LOG_FORMAT_BINARY, &rec) )
+            fprintf_P(stream_file, PSTR("%u,%u:%u,%d\r\n"), rec.day, rec.hour, rec.minute, rec.reading);
+
+      return true;
+}
+
+// Size of the log data in the file. Preallocated log files could be larger than the data they hold.
+//
+uint32_t Logging::LogDataSize(TimedSdFile &lfile)
+{
+      uint32_t  data_size;
+
+      if( isBinarySensorLog(lfile) )
+            data_size = findDataEnd(lfile, sizeof(SensorLogHeader), sizeof(SensorLogRecord));
+      else
+            data_size = findDataEnd(lfile, 0, 1);
+
+      lfile.seekSet(0);
+      return data_size;
+}
+
+// Find logical end of data in the log file.
+// Free space of preallocated log files is filled with zeros, and data end is the first unit (byte for text logs, record for binary logs)
+// starting with zero. Data is written sequentially, so binary search is used. For regular files data end is the file size.
+//
+static uint32_t findDataEnd(TimedSdFile &lfile, uint32_t base, uint16_t unit)
+{
+      uint32_t  fsize = lfile.fileSize();
+
+      if( fsize <= base ) return fsize;
+
+      uint32_t  lo = 0, hi = (fsize - base)/unit;     // data end is in the [lo, hi] range, in units
+
+      while( lo < hi ){
+
+            uint32_t  mid = lo + (hi - lo)/2;
+            byte      b = 0;
+
+            if( !lfile.seekSet(base + mid*unit) || (lfile.read(&b, 1) != 1) )
+                  b = 0;
+
+            if( b != 0 )    lo = mid + 1;
+            else            hi = mid;
+      }
+
+      return base + lo*unit;
+}
+
+#ifdef LOG_PREALLOCATE
+// Create log file as one contiguous extent of the given size, filled with zeros.
+// Returns true if successful, file is left open for read/write.
+//
+static bool createPreallocatedFile(TimedSdFile &lfile, const char *fname, uint32_t size)
+{
+      uint32_t  first_block, last_block;
+
+      if( !lfile.createContiguous(sd.vwd(), fname, size) )
+            return false;
+
+      if( lfile.contiguousRange(&first_block, &last_block) ){
+
+            uint8_t  *pBlock = (uint8_t *)sd.vol()->cacheClear();     // borrow file system cache buffer to write zero blocks
+
+            if( pBlock != NULL ){
+
+                  memset(pBlock, 0, 512);
+
+                  if( sd.card()->writeStart(first_block, last_block - first_block + 1) ){
+
+                        uint32_t  b;
+
+                        for( b = first_block; b <= last_block; b++ )
+                              if( !sd.card()->writeData(pBlock) ) break;
+
+                        if( sd.card()->writeStop() && (b > last_block) )
+                              return true;
+                  }
+            }
+      }
+
+      trace(F("Cannot preallocate log file (%s)\n"), fname);
+      lfile.remove();
+      return false;
+}
+#endif  // LOG_PREALLOCATE
+
+// Sensor log column name (PROGMEM string)
+//
+static char * sensorColumnName(char sensor_type)
+{
+      switch (sensor_type){
+
+           case  SENSOR_TYPE_TEMPERATURE:   return PSTR("Temperature(F)");
+           case  SENSOR_TYPE_PRESSURE:      return PSTR("AirPressure");
+           case  SENSOR_TYPE_HUMIDITY:      return PSTR("Humidity");
+           default:                         return PSTR("Reading");
+      }
+}
+
+
+//
+// Watering history
+//
+// Graph and table queries are served using per-year watering summary file. For each zone and month the summary keeps hour-of-day
+// and weekday bins (sum of run times and number of runs), and offset of the first record for the month in the zone watering log.
+// Months fully covered by the query are served from the summary bins, partial months are read from the watering log
+// starting from the month offset. Summary is updated incrementally by LogZoneEvent().
+//
+
+// parsed watering log record
+struct WateringRecord
+{
+        unsigned int  nmonth, nday, nhour, nminute;
+        int           nduration, nschedule, nsadj, nwunderground;
+};
+
+// Parse watering log record
+//
+static void parseWateringRecord(const char *line, WateringRecord *pRec)
+{
+        memset(pRec, 0, sizeof(WateringRecord));
+
+// Parse the string into fields. First field (up to two digits) is the month
+
+        sscanf_P( line, PSTR("%u,%u,%u:%u,%i,%i,%i,%i"),
+                                        &pRec->nmonth, &pRec->nday, &pRec->nhour, &pRec->nminute, &pRec->nduration, &pRec->nschedule, &pRec->nsadj, &pRec->nwunderground);
+}
+
+// Read and parse next watering log record.
+// Returns false at the end of file.
+//
+static bool readWateringRecord(LogLineReader &reader, WateringRecord *pRec, uint32_t *pOffset = NULL)
+{
+        char  *line = reader.nextLine(pOffset);
+
+        if( line == NULL )
+                return false;
+
+        parseWateringRecord(line, pRec);
+        return true;
+}
+
+// Watering record timestamp
+//
+static time_t wateringRecordTime(const WateringRecord *pRec, unsigned int nyear)
+{
+        tmElements_t tm;   tm.Day = pRec->nday;  tm.Month = pRec->nmonth; tm.Year = nyear - 1970;  tm.Hour = pRec->nhour;  tm.Minute = pRec->nminute;  tm.Second = 0;
+
+        return makeTime(tm);
+}
+
+// Add watering run to the month summary bins
+//
+static void addWateringRun(WateringMonthSummary *pSum, time_t t, int duration)
+{
+        byte  nhour = hour(t), dow = weekday(t) - 1;
+
+        pSum->hour[nhour].sum += duration;
+        pSum->hour[nhour].count++;
+        pSum->weekday[dow].sum += duration;
+        pSum->weekday[dow].count++;
+}
+
+// Watering summary block position in the summary file
+//
+static uint32_t wateringSummaryPos(int zone, unsigned int nmonth)
+{
+        return (uint32_t)((zone-1)*12 + (nmonth-1)) * sizeof(WateringMonthSummary);
+}
+
+bool Logging::readWateringSummary(LogHandle *pSumHandle, int zone, unsigned int nmonth, WateringMonthSummary *pSum)
+{
+        return pSumHandle->file.seekSet(wateringSummaryPos(zone, nmonth)) && (pSumHandle->file.read(pSum, sizeof(WateringMonthSummary)) == sizeof(WateringMonthSummary));
+}
+
+bool Logging::writeWateringSummary(LogHandle *pSumHandle, int zone, unsigned int nmonth, WateringMonthSummary *pSum)
+{
+        pSumHandle->bDirty = true;
+
+        return pSumHandle->file.seekSet(wateringSummaryPos(zone, nmonth)) && (pSumHandle->file.write(pSum, sizeof(WateringMonthSummary)) == sizeof(WateringMonthSummary));
+}
+
+// Get watering summary file for the year from the log files cache.
+// If summary file does not exist yet it is created and built from the watering logs (if there are any watering logs for this year).
+// *pBuilt is set to true if the summary was built.
+//
+// Returns NULL if summary is not available.
+//
+Logging::LogHandle * Logging::getWateringSummary(unsigned int nyear, bool *pBuilt)
+{
+        char        fname[MAX_LOG_FNAME_SIZE];
+        bool        bCreated;
+        LogHandle   *pHandle;
+
+        if( pBuilt ) *pBuilt = false;
+
+        sprintf_P(fname, PSTR(WATERING_SUMMARY_FNAME_FORMAT), nyear);
+
+        if( (findLogFile(fname) == NULL) && !sd.exists(fname) ){     // summary does not exist, check if there are watering logs for this year
+
+              bool  bLogs = false;
+
+              for( int xzone = 1; (xzone <= NUM_ZONES) && !bLogs; xzone++ ){
+
+                    TimedSdFile  lfile;
+
+                    sprintf_P(fname, PSTR(WATERING_LOG_FNAME_FORMAT), nyear, xzone );
+                    bLogs = lfile.open(fname, O_READ);
+                    lfile.close();
+              }
+              if( !bLogs ) return NULL;
+
+              sprintf_P(fname, PSTR(WATERING_SUMMARY_FNAME_FORMAT), nyear);
+        }
+
+        pHandle = getLogFile(fname, &bCreated, O_RDWR);
+
+        if( (pHandle != NULL) && bCreated ){
+
+              if( !buildWateringSummary(pHandle, nyear) ){
+
+                    trace(F("Cannot build watering summary (%s)\n"), fname);
+
+                    pHandle->file.remove();         // make sure incomplete summary is rebuilt next time
+                    pHandle->fname[0] = 0;
+                    return NULL;
+              }
+              if( pBuilt ) *pBuilt = true;
+        }
+
+        return pHandle;
+}
+
+// Build watering summary for the year from the zones watering logs.
+//
+bool Logging::buildWateringSummary(LogHandle *pSumHandle, unsigned int nyear)
+{
+        WateringMonthSummary  sum;
+        char                  fname[MAX_LOG_FNAME_SIZE];
+
+        syncLogFiles(true);      // watering logs could be in the cache
+
+        memset(&sum, 0, sizeof(sum));
+
+        for( int xzone = 1; xzone <= NUM_ZONES; xzone++ ){     // zero-fill summary for all zones and months
+
+              for( unsigned int nmonth = 1; nmonth <= 12; nmonth++ ){
+
+                    if( pSumHandle->file.write(&sum, sizeof(sum)) != sizeof(sum) )
+                          return false;
+              }
+        }
+
+        for( int xzone = 1; xzone <= NUM_ZONES; xzone++ ){
+
+              TimedSdFile     lfile;
+              LogLineReader   reader;
+              WateringRecord  rec;
+              unsigned int    curr_month = 0;
+              uint32_t        rec_offset;
+
+              sprintf_P(fname, PSTR(WATERING_LOG_FNAME_FORMAT), nyear, xzone );
+              if( !lfile.open(fname, O_READ) )
+                    continue;
+
+              reader.begin(&lfile);
+              reader.nextLine();       // skip first line in the file - column headers
+
+              while( true ){
+
+                    if( !readWateringRecord(reader, &rec, &rec_offset) )
+                          break;
+
+                    if( (rec.nmonth < 1) || (rec.nmonth > 12) || (rec.nhour > 23) )      // basic protection to ensure corrupted data will not crash the system
+                          continue;
+
+                    if( rec.nmonth != curr_month ){
+
+                          if( (curr_month != 0) && !writeWateringSummary(pSumHandle, xzone, curr_month, &sum) )
+                                 return false;
+
+                          memset(&sum, 0, sizeof(sum));
+                          sum.first_offset = rec_offset;
+                          curr_month = rec.nmonth;
+                    }
+                    addWateringRun(&sum, wateringRecordTime(&rec, nyear), rec.nduration);
+              }
+              lfile.close();
+
+              if( (curr_month != 0) && !writeWateringSummary(pSumHandle, xzone, curr_month, &sum) )
+                    return false;
+        }
+
+        return true;
+}
+
+// Update watering summary with the new watering log record (written at rec_offset in the zone watering log)
+//
+void Logging::updateWateringSummary(unsigned int nyear, int zone, time_t start, int duration, uint32_t rec_offset)
+{
+        WateringMonthSummary  sum;
+        bool                  bBuilt;
+
+        if( (zone < 1) || (zone > NUM_ZONES) ) return;
+
+        LogHandle *pSumHandle = getWateringSummary(nyear, &bBuilt);
+
+        if( (pSumHandle == NULL) || bBuilt )     // summary was just built from the logs, it already includes this record
+              return;
+
+        if( !readWateringSummary(pSumHandle, zone, month(start), &sum) ){
+
+              trace(F("Cannot read watering summary\n"));
+              return;
+        }
+
+        if( sum.first_offset == 0 )   // first record for the month
+              sum.first_offset = rec_offset;
+
+        addWateringRun(&sum, start, duration);
+
+        writeWateringSummary(pSumHandle, zone, month(start), &sum);
+}
+
+// Number of graph bins for the grouping. For NONE grouping the range is split into equal intervals of *pBinScale seconds.
+//
+static byte groupingBins(Logging::GROUPING grouping, time_t start, time_t end, time_t *pBinScale)
+{
+        *pBinScale = 1;
+
+        switch (grouping)
+        {
+        case Logging::HOURLY:   return 24;
+        case Logging::DAILY:    return 7;
+        case Logging::MONTHLY:  return 12;
+        default:
+                *pBinScale = (end-start)/10;
+                return 10;
+        }
+}
+
+// Graph bin of the watering record
+//
+static int wateringBin(time_t t, time_t start, Logging::GROUPING grouping, time_t bin_scale, int bins)
+{
+        int     bin;
+
+        switch (grouping)
+        {
+             case Logging::HOURLY:   bin = hour(t);                    break;
+             case Logging::DAILY:    bin = weekday(t) - 1;             break;
+             case Logging::MONTHLY:  bin = month(t) - 1;               break;
+             default:                bin = (t - start)/bin_scale;      break;
+        }
+
+        return min(bin, bins - 1);
+}
+
+// Emit zone graph series - average run time for each bin
+//
+static void emitZoneBins(FILE* stream_file, long int bin_data[], uint16_t bin_counter[], int bins, Logging::GROUPING grouping, time_t start, time_t bin_scale)
+{
+        for (int i=0; i<bins; i++){
+
+                  long int  bin_value = bin_counter[i] ? bin_data[i]/(long int)bin_counter[i] : 0;
+
+                  if( grouping == Logging::NONE )
+                           fprintf_P(stream_file, PSTR("%s[%lu000, %ld]"), (i==0)?"":",", start + i*bin_scale, bin_value);
+                  else
+                           fprintf_P(stream_file, PSTR("%s[%i, %ld]"), (i==0)?"":",", (grouping == Logging::MONTHLY) ? i+1 : i, bin_value);   // note: monthly bins are numbered from 1
+        }
+}
+
+bool Logging::GraphZone(FILE* stream_file, time_t start, time_t end, GROUPING grouping)
+{
+        grouping = max(NONE, min(grouping, MONTHLY));
+        char       bins;
+        time_t     bin_scale;
+
+        Sync();     // make sure recently logged records are on the card
+
+        if (start == 0)
+                start = nntpTimeServer.LocalNow();
+
+        start = previousMidnight(start);
+        end = max(start,end) + 24*3600;  // add 1 day to end time.
+
+        bins = groupingBins(grouping, start, end, &bin_scale);
+
+        long int   bin_data[24];
+        uint16_t   bin_counter[24];
+
+        int curr_zone = 255;
+
+        for( int xzone = 1; xzone <= NUM_ZONES; xzone++ ){  // iterate over zones
+
+                    if( getZoneBins( xzone, start, end, bin_data, bin_counter, bins, grouping, bin_scale) > 0 ){  // some data available
+                    
+                                    if( curr_zone != 255 ) 
+                                              fprintf_P(stream_file, PSTR("], "));   // if this is not the first zone, add comma to the previous one
+                                         
+                                    fprintf_P(stream_file, PSTR("\n\t \"%d\": ["), xzone);   // JSON zone header
+                                    curr_zone = xzone;
+
+                                    emitZoneBins(stream_file, bin_data, bin_counter, bins, grouping, start, bin_scale);
+                    }  // if(getZoneBins>0)
+                    
+        }   // for( int xzone = 1; xzone <= xmaxzone; xzone++ )
+
+        if( curr_zone != 255)
+                     fprintf_P(stream_file, PSTR("\n\t\t\t\t\t ] \n"));    // close the last zone if we emitted
+
+        return true;
+}
+
+// Calculate watering bins for the zone - sum of run times and number of runs in each bin.
+// Months fully covered by the query are taken from the watering summary, partial months are read from the watering log.
+//
+// Returns number of runs found.
+//
+int Logging::getZoneBins( int zone, time_t start, time_t end, long int bin_data[], uint16_t bin_counter[], int bins, GROUPING grouping, time_t bin_scale)
+{
+        int    r_counter = 0;
+
+        memset( bin_counter, 0, bins*sizeof(uint16_t) );
+        memset( bin_data, 0, bins*sizeof(long int) );
+
+        for( unsigned int nyear = year(start); nyear <= year(end-1); nyear++ ){
+
+              LogHandle *pSumHandle = getWateringSummary(nyear, NULL);
+              if( pSumHandle == NULL )
+                    continue;    // no watering logs for this year
+
+              unsigned int  nmstart = (nyear == year(start)) ? month(start) : 1;
+              unsigned int  nmend = (nyear == year(end-1)) ? month(end-1) : 12;
+
+              for( unsigned int nmonth = nmstart; nmonth <= nmend; nmonth++ ){
+
+                    WateringMonthSummary  sum;
+
+                    if( !readWateringSummary(pSumHandle, zone, nmonth, &sum) || (sum.first_offset == 0) )
+                           continue;     // no records for this month
+
+                    time_t  month_start = monthStart(nyear, nmonth);
+                    time_t  month_end = (nmonth == 12) ? monthStart(nyear+1, 1) : monthStart(nyear, nmonth+1);
+
+                    if( (grouping != NONE) && (month_start >= start) && (month_end <= end) ){    // the whole month is in the range, use summary bins
+
+                          for( byte i = 0; i < 24; i++ ){
+
+                                 if( grouping == HOURLY ){
+
+                                        bin_data[i] += sum.hour[i].sum;
+                                        bin_counter[i] += sum.hour[i].count;
+                                 }
+                                 else if( grouping == MONTHLY ){
+
+                                        bin_data[nmonth-1] += sum.hour[i].sum;
+                                        bin_counter[nmonth-1] += sum.hour[i].count;
+                                 }
+                                 else if( i < 7 ){
+
+                                        bin_data[i] += sum.weekday[i].sum;
+                                        bin_counter[i] += sum.weekday[i].count;
+                                 }
+                                 r_counter += sum.hour[i].count;
+                          }
+                          continue;
+                    }
+
+// partial month - read month records from the watering log, starting from the month offset
+
+                    LogCursor  cursor;
+                    LogRecord  rec;
+
+                    cursor.begin(LOG_TYPE_WATERING, zone, max(start, month_start), min(end, month_end), sum.first_offset);
+
+                    while( cursor.next(&rec) ){
+
+                          int     bin = wateringBin(rec.t, start, grouping, bin_scale, bins);
+
+                          bin_data[bin] += (long int)rec.value[0];
+                          bin_counter[bin]++;
+                          r_counter++;
+                    }
+              }
+        }
+  
+        return r_counter;
+}
+
+// Find the first month with watering records for the zone within the query range, using watering summaries.
+// On success *pStart is moved forward to the start of that month (if necessary) and *pOffset is set to the offset of the first
+// record of the month in the watering log.
+//
+// Returns false if there are no records for the zone in the range.
+//
+bool Logging::findWateringStart(int zone, time_t *pStart, time_t end, uint32_t *pOffset)
+{
+        for( unsigned int nyear = year(*pStart); nyear <= year(end-1); nyear++ ){
+
+              LogHandle *pSumHandle = getWateringSummary(nyear, NULL);
+              if( pSumHandle == NULL )
+                    continue;    // no watering logs for this year
+
+              unsigned int  nmstart = (nyear == year(*pStart)) ? month(*pStart) : 1;
+              unsigned int  nmend = (nyear == year(end-1)) ? month(end-1) : 12;
+
+              for( unsigned int nmonth = nmstart; nmonth <= nmend; nmonth++ ){
+
+                    WateringMonthSummary  sum;
+
+                    if( readWateringSummary(pSumHandle, zone, nmonth, &sum) && (sum.first_offset != 0) ){
+
+                          *pStart = max(*pStart, monthStart(nyear, nmonth));
+                          *pOffset = sum.first_offset;
+                          return true;
+                    }
+              }
+        }
+
+        return false;
+}
+
+bool Logging::TableZone(FILE* stream_file, time_t start, time_t end)
+{
+        Sync();     // make sure recently logged records are on the card
+
+        if (start == 0)
+                start = nntpTimeServer.LocalNow();
+
+        start = previousMidnight(start);
+        end = max(start,end) + 24*3600;  // add 1 day to end time.
+
+        int curr_zone = 255;
+        for( int xzone = 1; xzone <= NUM_ZONES; xzone++ ){  // iterate over zones
+
+                time_t     zstart = start;
+                uint32_t   start_offset = 0;
+
+                if( !findWateringStart(xzone, &zstart, end, &start_offset) )
+                      continue;     // no records in the range for this zone
+
+// Iterate over zone records in the dates range. Logs for each zone are stored in separate files, one file per year.
+
+                LogCursor  cursor;
+                LogRecord  rec;
+                char       bFirstRow = true;
+
+                cursor.begin(LOG_TYPE_WATERING, xzone, zstart, end, start_offset);
+
+                while( cursor.next(&rec) ){
+
+// we have something to output.
+
+                        if( curr_zone != xzone ){
+                          
+                             if( curr_zone != 255 ) 
+                                       fprintf_P(stream_file, PSTR("\n\t\t\t\t\t]\n\t\t\t\t},\n"));   // if this is not the first zone, close previous one
+                             
+                             fprintf_P(stream_file, PSTR("\n\t\t\t\t { \n\t\t\t\t \"zone\": %i,\n\t\t\t\t \"entries\": ["), xzone);   // JSON zone header
+                             curr_zone = xzone;
+                             bFirstRow = true;
+                        }
+
+                        fprintf_P(stream_file, PSTR("%s \n\t\t\t\t\t { \"date\":%lu, \"duration\":%i, \"schedule\":%i, \"seasonal\":%i, \"wunderground\":%i}"),
+                                                           bFirstRow ? "":",",
+                                                           rec.t, rec.value[0], rec.value[1], rec.value[2], rec.value[3] );
+
+                        bFirstRow = false;
+                }
+        }   // for( int xzone = 1; xzone <= xmaxzone; xzone++ )
+
+        if( curr_zone != 255)
+                     fprintf_P(stream_file, PSTR("\n\t\t\t\t\t ] \n\t\t\t\t } \n"));    // close the last zone if we emitted
+
+        return true;
+}
+
+// Graph series and table rows for the same range, computed in one pass over the watering logs.
+// For each zone with records in the range the zone object carries table entries followed by the zone graph series,
+// so records are streamed out while the graph bins are accumulated.
+//
+bool Logging::WateringHistory(FILE* stream_file, time_t start, time_t end, GROUPING grouping)
+{
+        grouping = max(NONE, min(grouping, MONTHLY));
+        char       bins;
+        time_t     bin_scale;
+
+        Sync();     // make sure recently logged records are on the card
+
+        if (start == 0)
+                start = nntpTimeServer.LocalNow();
+
+        start = previousMidnight(start);
+        end = max(start,end) + 24*3600;  // add 1 day to end time.
+
+        bins = groupingBins(grouping, start, end, &bin_scale);
+
+        long int   bin_data[24];
+        uint16_t   bin_counter[24];
+
+        bool bFirstZone = true;
+        for( int xzone = 1; xzone <= NUM_ZONES; xzone++ ){  // iterate over zones
+
+                time_t     zstart = start;
+                uint32_t   start_offset = 0;
+
+                if( !findWateringStart(xzone, &zstart, end, &start_offset) )
+                      continue;     // no records in the range for this zone
+
+                LogCursor  cursor;
+                LogRecord  rec;
+                bool       bFirstRow = true;
+
+                memset( bin_counter, 0, bins*sizeof(uint16_t) );
+                memset( bin_data, 0, bins*sizeof(long int) );
+
+                cursor.begin(LOG_TYPE_WATERING, xzone, zstart, end, start_offset);
+
+                while( cursor.next(&rec) ){
+
+                        if( bFirstRow ){
+
+                             fprintf_P(stream_file, PSTR("%s\n\t\t{ \"zone\": %i,\n\t\t  \"entries\": ["), bFirstZone ? "":",", xzone);   // JSON zone header
+                             bFirstZone = false;
+                        }
+
+                        fprintf_P(stream_file, PSTR("%s\n\t\t\t{ \"date\":%lu, \"duration\":%i, \"schedule\":%i, \"seasonal\":%i, \"wunderground\":%i}"),
+                                                           bFirstRow ? "":",",
+                                                           rec.t, rec.value[0], rec.value[1], rec.value[2], rec.value[3] );
+                        bFirstRow = false;
+
+                        int  bin = wateringBin(rec.t, start, grouping, bin_scale, bins);
+
+                        bin_data[bin] += (long int)rec.value[0];
+                        bin_counter[bin]++;
+                }
+
+                if( !bFirstRow ){       // close the zone entries, and emit the zone graph
+
+                        fprintf_P(stream_file, PSTR("\n\t\t  ],\n\t\t  \"graph\": ["));
+                        emitZoneBins(stream_file, bin_data, bin_counter, bins, grouping, start, bin_scale);
+                        fprintf_P(stream_file, PSTR("] }"));
+                }
+        }   // for( int xzone = 1; xzone <= NUM_ZONES; xzone++ )
+
+        return true;
+}
+
+//
+// Tail queries - newest records first
+//
+// Log files are read backwards from the end of data, in small chunks. SdFat reads whole blocks through its block cache,
+// so the newest records cost a couple of block reads regardless of the file size.
+//
+
+// reverse line scanner state
+struct ReverseLineScan
+{
+        TimedSdFile *pFile;
+        uint32_t    chunk_start;                 // file position of the chunk
+        uint32_t    line_end;                    // end of the line found last (start of the next line)
+        byte        idx;                         // scan position in the chunk
+        char        chunk[LOG_TAIL_CHUNK_SIZE];
+};
+
+static void reverseScanBegin(ReverseLineScan *pScan, TimedSdFile *pFile, uint32_t data_end)
+{
+        pScan->pFile = pFile;
+        pScan->chunk_start = pScan->line_end = data_end;
+        pScan->idx = 0;
+}
+
+// Find the previous line. Returns false when the beginning of the file is reached.
+// Note: line end includes the line terminator. File position is not preserved between calls.
+//
+static bool reverseScanPrev(ReverseLineScan *pScan, uint32_t *pLineStart, uint32_t *pLineEnd)
+{
+        while( true ){
+
+              while( pScan->idx > 0 ){
+
+                    pScan->idx--;
+
+                    uint32_t  pos = pScan->chunk_start + pScan->idx;
+
+                    if( (pScan->chunk[pScan->idx] == '\n') && ((pos + 1) < pScan->line_end) ){     // previous line starts after this line terminator
+
+                          *pLineStart = pos + 1;   *pLineEnd = pScan->line_end;
+                          pScan->line_end = pos + 1;
+                          return true;
+                    }
+              }
+
+              if( pScan->chunk_start == 0 ){      // beginning of the file - the first line
+
+                    if( pScan->line_end == 0 )
+                          return false;
+
+                    *pLineStart = 0;   *pLineEnd = pScan->line_end;
+                    pScan->line_end = 0;
+                    return true;
+              }
+
+// load the previous chunk
+              byte  n = (pScan->chunk_start > LOG_TAIL_CHUNK_SIZE) ? LOG_TAIL_CHUNK_SIZE : pScan->chunk_start;
+
+              pScan->chunk_start -= n;
+
+              if( !pScan->pFile->seekSet(pScan->chunk_start) || (pScan->pFile->read(pScan->chunk, n) != n) )
+                    return false;
+
+              pScan->idx = n;
+        }
+}
+
+// Emit the newest watering records (up to n), newest first, optionally filtered by zone (0 - all zones).
+// Zone logs are scanned backwards, scan stops as soon as records become older than the oldest record selected so far.
+//
+bool Logging::TailWatering(FILE* stream_file, int zone, int n)
+{
+        // selected record
+        struct TailEntry
+        {
+                time_t    t;
+                byte      zone;
+                int       duration, schedule, sadj, wunderground;
+        };
+
+        TailEntry       entries[LOG_TAIL_MAX];
+        int             count = 0;
+        char            fname[MAX_LOG_FNAME_SIZE];
+        unsigned int    curr_year = year(nntpTimeServer.LocalNow());
+
+        n = max(1, min(n, LOG_TAIL_MAX));
+
+        Sync();     // make sure recently logged records are on the card
+
+        for( int xzone = 1; xzone <= NUM_ZONES; xzone++ ){
+
+              if( (zone != 0) && (zone != xzone) ) continue;
+
+              bool  bDone = false;
+
+              for( unsigned int nyear = curr_year; !bDone && (nyear > curr_year - LOG_TAIL_YEARS); nyear-- ){
+
+                    TimedSdFile      lfile;
+                    ReverseLineScan  scan;
+                    uint32_t         line_start, line_end;
+
+                    sprintf_P(fname, PSTR(WATERING_LOG_FNAME_FORMAT), nyear, xzone );
+                    if( !lfile.open(fname, O_READ) )
+                          continue;
+
+                    reverseScanBegin(&scan, &lfile, findDataEnd(lfile, 0, 1));
+
+                    while( reverseScanPrev(&scan, &line_start, &line_end) ){
+
+                          WateringRecord  rec;
+                          char            line[MAX_WATERING_LOG_RECORD_SIZE];
+
+                          if( (line_start == 0) || !lfile.seekSet(line_start) )
+                                continue;     // first line in the file - column headers
+
+                          int  len = lfile.read(line, min(line_end - line_start, sizeof(line) - 1));
+
+                          if( len <= 0 )
+                                continue;     // read error
+
+                          line[len] = 0;
+                          parseWateringRecord(line, &rec);
+
+                          if( (rec.nmonth < 1) || (rec.nmonth > 12) || (rec.nday < 1) || (rec.nday > 31) || (rec.nhour > 23) )
+                                continue;     // basic protection to ensure corrupted data will not crash the system
+
+                          time_t  t = wateringRecordTime(&rec, nyear);
+
+                          if( (count == n) && (t <= entries[n-1].t) ){      // the rest of this zone log is older than selected records
+
+                                bDone = true;
+                                break;
+                          }
+
+// insert the record, keeping entries sorted newest first
+                          int  i = (count < n) ? count++ : n-1;
+
+                          while( (i > 0) && (entries[i-1].t < t) ){
+
+                                entries[i] = entries[i-1];
+                                i--;
+                          }
+                          entries[i].t = t;   entries[i].zone = xzone;
+                          entries[i].duration = rec.nduration;   entries[i].schedule = rec.nschedule;   entries[i].sadj = rec.nsadj;   entries[i].wunderground = rec.nwunderground;
+                    }
+                    lfile.close();
+              }
+        }
+
+        fprintf_P(stream_file, PSTR("\t\"entries\": ["));
+
+        for( int i = 0; i < count; i++ )
+              fprintf_P(stream_file, PSTR("%s \n\t\t { \"zone\":%u, \"date\":%lu, \"duration\":%i, \"schedule\":%i, \"seasonal\":%i, \"wunderground\":%i}"),
+                                        i ? ",":"", entries[i].zone, entries[i].t, entries[i].duration, entries[i].schedule, entries[i].sadj, entries[i].wunderground );
+
+        fprintf_P(stream_file, PSTR("\n\t]\n"));
+
+        return true;
+}
+
+// Parse system log record. Record format is "day,hh:mm:ss,source,type,text", older records do not have source and type
+// fields: "day,hh:mm:ss,text" (event type 0 is reported for such records).
+// Returns false if the line is not a valid record.
+//
+static bool parseSyslogRecord(const char *line, unsigned int nyear, unsigned int nmonth, time_t *pTime, byte *pType, byte *pTextPos)
+{
+        byte          commas = 0, time_end = 0, type_pos = 0, text_pos = 0;
+        unsigned int  nday = 0, nhour = 0, nminute = 0, nsecond = 0;
+
+        for( byte i = 0; (line[i] != 0) && (commas < 4); i++ ){
+
+              if( line[i] == ',' ){
+
+                    commas++;
+                    if( commas == 2 )  time_end = i + 1;
+                    if( commas == 3 )  type_pos = i + 1;
+                    if( commas == 4 )  text_pos = i + 1;
+              }
+        }
+
+        if( (commas < 2) || (sscanf_P(line, PSTR("%u,%u:%u:%u"), &nday, &nhour, &nminute, &nsecond) < 3) )
+              return false;
+
+        if( (nday < 1) || (nday > 31) || (nhour > 23) || (nminute > 59) || (nsecond > 59) )
+              return false;
+
+        if( (commas == 4) && isdigit(line[type_pos]) ){
+
+              *pType = atoi(line + type_pos);
+              *pTextPos = text_pos;
+        }
+        else {       // old format, text starts after the time
+
+              *pType = 0;
+              *pTextPos = time_end;
+        }
+
+        tmElements_t tm;   tm.Day = nday;  tm.Month = nmonth; tm.Year = nyear - 1970;  tm.Hour = nhour;  tm.Minute = nminute;  tm.Second = nsecond;
+        *pTime = makeTime(tm);
+
+        return true;
+}
+
+// Output one character of a JSON string, escaping special characters
+//
+static void emitJSONChar(FILE* stream_file, int c)
+{
+        if( (c == '"') || (c == '\\') )
+              fputc('\\', stream_file);
+        if( c >= ' ' )
+              fputc(c, stream_file);
+}
+
+// Emit the newest system log events (up to n), newest first, optionally filtered by event type (0 - all events).
+// Monthly system log files are scanned backwards, starting from the current month.
+//
+bool Logging::TailSyslog(FILE* stream_file, char evt_type, int n)
+{
+        char      fname[MAX_LOG_FNAME_SIZE];
+        time_t    t = nntpTimeServer.LocalNow();
+        int       count = 0;
+
+        n = max(1, min(n, LOG_TAIL_MAX));
+
+        Sync();     // make sure recently logged records are on the card
+
+        fprintf_P(stream_file, PSTR("\t\"events\": ["));
+
+        unsigned int  nyear = year(t), nmonth = month(t);
+
+        for( byte m = 0; (m < LOG_TAIL_MONTHS) && (count < n); m++ ){
+
+              TimedSdFile      lfile;
+              ReverseLineScan  scan;
+              uint32_t         line_start, line_end;
+
+              sprintf_P(fname, PSTR(SYSTEM_LOG_FNAME_FORMAT), nmonth, nyear );
+
+              if( lfile.open(fname, O_READ) ){
+
+                    reverseScanBegin(&scan, &lfile, lfile.fileSize());
+
+                    while( (count < n) && reverseScanPrev(&scan, &line_start, &line_end) ){
+
+                          char          prefix[MAX_LOG_RECORD_SIZE];
+                          byte          text_pos, ntype;
+                          int           len;
+                          time_t        t;
+
+                          if( !lfile.seekSet(line_start) )
+                                continue;
+
+                          len = lfile.read(prefix, min(line_end - line_start, sizeof(prefix) - 1));
+                          if( len <= 0 )
+                                continue;     // read error
+
+                          prefix[len] = 0;
+
+                          if( !parseSyslogRecord(prefix, nyear, nmonth, &t, &ntype, &text_pos) )
+                                continue;    // not a valid record
+
+                          if( (evt_type != 0) && (ntype != evt_type) )
+                                continue;
+
+                          fprintf_P(stream_file, PSTR("%s \n\t\t { \"date\":%lu, \"type\":%u, \"text\":\""), count ? ",":"", t, ntype );
+
+// copy event text from the file
+                          lfile.seekSet(line_start + text_pos);
+
+                          for( uint32_t pos = line_start + text_pos; pos < line_end; pos++ ){
+
+                                int  c = lfile.read();
+
+                                if( (c < 0) || (c == '\r') || (c == '\n') )
+                                      break;
+                                emitJSONChar(stream_file, c);
+                          }
+                          fprintf_P(stream_file, PSTR("\"}"));
+                          count++;
+                    }
+                    lfile.close();
+              }
+
+              if( --nmonth == 0 ){
+
+                    nmonth = 12;   nyear--;
+              }
+        }
+
+        fprintf_P(stream_file, PSTR("\n\t]\n"));
+
+        return true;
+}
+
+// Downsampling bucket - minimum and maximum readings within the bucket time interval
+struct MinMaxBucket
+{
+        time_t      start;
+        uint16_t    count;
+        time_t      t_min, t_max;
+        int         v_min, v_max;
+};
+
+static void addMinMaxBucket(MinMaxBucket *pBucket, time_t bucket_start, time_t t, int value)
+{
+        if( pBucket->count == 0 ){
+
+              pBucket->start = bucket_start;
+              pBucket->t_min = pBucket->t_max = t;
+              pBucket->v_min = pBucket->v_max = value;
+        }
+        else if( value < pBucket->v_min ){
+
+              pBucket->t_min = t;   pBucket->v_min = value;
+        }
+        else if( value > pBucket->v_max ){
+
+              pBucket->t_max = t;   pBucket->v_max = value;
+        }
+
+        if( pBucket->count != 0xFFFF )
+              pBucket->count++;
+}
+
+// Emit bucket points (one point if min and max are the same reading) and reset the bucket
+//
+static void flushMinMaxBucket(FILE* stream_file, MinMaxBucket *pBucket, char *pbFirstRow, char *sensor_name, int sensor_id)
+{
+        if( pBucket->count == 0 )
+              return;
+
+        if( pBucket->t_min == pBucket->t_max )
+              emitSensorPoint(stream_file, pbFirstRow, sensor_name, sensor_id, pBucket->t_min, pBucket->v_min);
+        else if( pBucket->t_min < pBucket->t_max ){
+
+              emitSensorPoint(stream_file, pbFirstRow, sensor_name, sensor_id, pBucket->t_min, pBucket->v_min);
+              emitSensorPoint(stream_file, pbFirstRow, sensor_name, sensor_id, pBucket->t_max, pBucket->v_max);
+        }
+        else {
+
+              emitSensorPoint(stream_file, pbFirstRow, sensor_name, sensor_id, pBucket->t_max, pBucket->v_max);
+              emitSensorPoint(stream_file, pbFirstRow, sensor_name, sensor_id, pBucket->t_min, pBucket->v_min);
+        }
+        pBucket->count = 0;
+}
+
+// emit sensor log as JSON
+//
+// Summary queries (hourly/daily/monthly) are served from sensor rollups, raw log files are read only for LOG_SUMMARY_NONE.
+// Raw readings can be downsampled to at most max_points points (0 - all readings): the range is split into max_points/2 equal
+// time buckets, and the minimum and maximum readings of each bucket are emitted in time order. Spikes and dips are preserved,
+// and the response size does not depend on the range length.
+//
+bool Logging::EmitSensorLog(FILE* stream_file, time_t start, time_t end, char sensor_type, int sensor_id, char summary_type, int max_points)
+{
+        char *sensor_name = sensorSeriesName(sensor_type);
+
+        if( sensor_name == NULL )
+        {
+             trace(F("EmitSensorLog - requested sensor type not recognized\n"));
+             return false;
+        }
+
+        Sync();     // make sure recently logged records are on the card
+
+        if (start == 0)
+                start = nntpTimeServer.LocalNow();
+
+        end = max(start,end) + 24*3600;  // add 1 day to end time.
+
+        char bFirstRow = true;
+
+        fprintf_P(stream_file, PSTR("\"series\": ["));   // JSON opening header
+
+        if( (summary_type >= LOG_SUMMARY_HOUR) && (summary_type <= LOG_SUMMARY_MONTH) )
+        {
+             emitSensorRollups(stream_file, start, end, sensor_type, sensor_id, summary_type - LOG_SUMMARY_HOUR, sensor_name, &bFirstRow);
+        }
+        else
+        {
+          LogCursor  cursor;
+          LogRecord  rec;
+
+          cursor.begin(sensorLogType(sensor_type), sensor_id, previousMidnight(start), end);    // sensor logs are stored in separate files, one file per month
+
+          if( max_points >= 2 )      // downsampling - min and max readings of each time bucket
+          {
+                MinMaxBucket  bucket;
+                time_t        range_start = previousMidnight(start);
+                time_t        width = max((end - range_start) / (max_points/2), (time_t)1);
+
+                bucket.count = 0;
+
+                while( cursor.next(&rec) ){
+
+                      time_t  bucket_start = range_start + ((rec.t - range_start) / width) * width;
+
+                      if( bucket.count && (bucket.start != bucket_start) )
+                             flushMinMaxBucket(stream_file, &bucket, &bFirstRow, sensor_name, sensor_id);
+
+                      addMinMaxBucket(&bucket, bucket_start, rec.t, rec.value[0]);
+                }
+                flushMinMaxBucket(stream_file, &bucket, &bFirstRow, sensor_name, sensor_id);
+          }
+          else
+          {
+                while( cursor.next(&rec) )
+                      emitSensorPoint(stream_file, &bFirstRow, sensor_name, sensor_id, rec.t, rec.value[0]);
+          }
+        }
+
+        if( !bFirstRow )   // first row flag was reset, it means we output at least one line
+        {
+               fprintf_P(stream_file, PSTR("\n\t\t\t\t ] \n \t }]\n"));
+        }
+        else
+        {
+               fprintf_P(stream_file, PSTR("]\n"));
+        }
+
+    return true; 
+}
+
+// Emit one data point of the sensor series as JSON. Series header is emitted before the first point.
+//
+static void emitSensorPoint(FILE* stream_file, char *pbFirstRow, char *sensor_name, int sensor_id, time_t t, int value)
+{
+        if( *pbFirstRow )
+               fprintf_P(stream_file, PSTR("{\n\t\t\t \"name\": \"%S readings, Sensor: %d\", \n\t\t\t\t \"data\": [\n"), sensor_name, sensor_id);   // JSON series header
+
+        fprintf_P(stream_file, PSTR("%s \n\t\t\t\t\t [ %lu000, %d ]"), *pbFirstRow ? "":",", t, value);
+        *pbFirstRow = false;
+}
+
+// Sensor series name for JSON output (PROGMEM string), NULL if sensor type is not recognized
+//
+static char * sensorSeriesName(char sensor_type)
+{
+        switch (sensor_type){
+
+           case  SENSOR_TYPE_TEMPERATURE:   return PSTR("Temperature");
+           case  SENSOR_TYPE_PRESSURE:      return PSTR("Air Pressure");
+           case  SENSOR_TYPE_HUMIDITY:      return PSTR("Humidity");
+           default:                         return NULL;
+        }
+}
+
+// Generate sensor log file name for the given month/year.
+// Returns false if sensor type is not recognized.
+//
+static bool sensorLogFileName(char *fname, char sensor_type, int sensor_id, unsigned int nmonth, unsigned int nyear)
+{
+        switch (sensor_type){
+
+           case  SENSOR_TYPE_TEMPERATURE:
+                     sprintf_P(fname, PSTR(TEMPERATURE_LOG_FNAME_FORMAT), nmonth, nyear%100, sensor_id );
+                     return true;
+
+           case  SENSOR_TYPE_PRESSURE:
+                     sprintf_P(fname, PSTR(PRESSURE_LOG_FNAME_FORMAT), nmonth, nyear%100, sensor_id );
+                     return true;
+
+           case  SENSOR_TYPE_HUMIDITY:
+                     sprintf_P(fname, PSTR(HUMIDITY_LOG_FNAME_FORMAT), nmonth, nyear%100, sensor_id );
+                     return true;
+
+           default:
+                     return false;
+        }
+}
+
+
+// Sensor type of the sensor log type, 0 if log type is not a sensor log
+//
+static char logSensorType(byte log_type)
+{
+        switch (log_type){
+
+           case  LOG_TYPE_TEMPERATURE:      return SENSOR_TYPE_TEMPERATURE;
+           case  LOG_TYPE_PRESSURE:         return SENSOR_TYPE_PRESSURE;
+           case  LOG_TYPE_HUMIDITY:         return SENSOR_TYPE_HUMIDITY;
+           default:                         return 0;
+        }
+}
+
+// Sensor log type of the sensor type, 0 if sensor type is not recognized
+//
+static byte sensorLogType(char sensor_type)
+{
+        switch (sensor_type){
+
+           case  SENSOR_TYPE_TEMPERATURE:   return LOG_TYPE_TEMPERATURE;
+           case  SENSOR_TYPE_PRESSURE:      return LOG_TYPE_PRESSURE;
+           case  SENSOR_TYPE_HUMIDITY:      return LOG_TYPE_HUMIDITY;
+           default:                         return 0;
+        }
+}
+
+// Start of the month
+//
+static time_t monthStart(unsigned int nyear, unsigned int nmonth)
+{
+        tmElements_t tm;   tm.Day = 1;  tm.Month = nmonth; tm.Year = nyear - 1970;  tm.Hour = 0;  tm.Minute = 0;  tm.Second = 0;
+
+        return makeTime(tm);
+}
+
+
+//
+// Log cursor
+//
+// Log files are partitioned by time - watering logs by year, sensor logs by month. The cursor walks partitions of the query range
+// in chronological order, builds file names from the partition and opens each file only when the previous one is exhausted.
+// Partitions outside of the range are never opened. Records are assumed to be in chronological order within the file.
+//
+
+//
+// Buffered line reader
+//
+
+void LogLineReader::begin(TimedSdFile *pFile)
+{
+        this->pFile = pFile;
+        buf_offset = pFile->curPosition();
+        head = tail = 0;
+        bEof = false;
+}
+
+// Read more data into the buffer, keeping unread data. A refill never crosses a card block boundary, so it is served from
+// a single block (cached by SdFat) with a single copy.
+// Returns false if there is no more data or no space in the buffer.
+//
+bool LogLineReader::fill()
+{
+        if( bEof )
+              return false;
+
+        if( head > 0 ){      // move unread data to the beginning of the buffer
+
+              memmove(buf, buf + head, tail - head);
+              buf_offset += head;
+              tail -= head;   head = 0;
+        }
+
+        uint32_t  read_pos = buf_offset + tail;
+        uint32_t  read_end = min(read_pos + (LOG_READ_BUFFER_SIZE - tail), (read_pos | 511) + 1);
+
+        if( read_end <= read_pos )
+              return false;      // buffer is full
+
+        int  n = pFile->read(buf + tail, read_end - read_pos);
+
+        if( n <= 0 ){
+
+              bEof = true;
+              return false;
+        }
+
+        tail += n;
+        return true;
+}
+
+char * LogLineReader::nextLine(uint32_t *pOffset)
+{
+        byte  i = head;
+
+// find the end of the line, reading more data as needed
+        while( true ){
+
+              while( (i < tail) && (buf[i] != '\n') && (buf[i] != 0) )
+                    i++;
+
+              if( i < tail )
+                    break;       // line end found
+
+              byte  consumed = head;
+
+              if( !fill() ){
+
+                    i = tail;    // end of file, or the line does not fit into the buffer
+                    break;
+              }
+              i -= consumed;     // fill() moves unread data to the beginning of the buffer
+        }
+
+        if( (head == tail) || (buf[head] == 0) ){      // end of file, or zero byte - end of data in a preallocated file
+
+              bEof = true;   head = tail;
+              return NULL;
+        }
+
+        char  *line = buf + head;
+
+        if( pOffset != NULL )
+              *pOffset = buf_offset + head;
+
+        if( (i < tail) && (buf[i] == 0) ){      // end of data right after the line
+
+              bEof = true;   head = tail = i;
+        }
+        else if( i < tail ){
+
+              buf[i] = 0;
+              head = i + 1;
+        }
+        else {      // last line without terminator, or long line - truncate it and skip the rest
+
+              buf[tail] = 0;
+
+              while( !bEof ){
+
+                    int  c = pFile->read();
+
+                    if( c <= 0 ) bEof = true;
+                    if( (c == '\n') || (c <= 0) ) break;
+              }
+              buf_offset = pFile->curPosition();   head = tail = 0;
+        }
+
+        byte  len = strlen(line);
+
+        if( (len > 0) && (line[len-1] == '\r') )
+              line[len-1] = 0;
+
+        return line;
+}
+
+#ifdef LOG_BENCHMARK
+
+#define LOG_BENCHMARK_FNAME     "/logbench.txt"
+
+// Log scan throughput benchmark.
+// Writes a synthetic year of watering log records (four runs a day), scans it with per-line fgets() and with the buffered
+// line reader (parsing every record in both cases), reports bytes per second for each scan and removes the file.
+//
+bool Logging::BenchmarkScan(FILE* stream_file)
+{
+        TimedSdFile     lfile;
+        LogLineReader   reader;
+        WateringRecord  rec;
+        char            tmp_buf[MAX_WATERING_LOG_RECORD_SIZE];
+        unsigned long   t0, fgets_ms, reader_ms;
+        unsigned int    nrec = 0, fgets_nrec = 0, reader_nrec = 0;
+        uint32_t        size;
+
+        Sync();     // make sure queued records do not interfere with the measurement
+
+        if( !lfile.open(LOG_BENCHMARK_FNAME, O_RDWR | O_CREAT | O_TRUNC) )
+              return false;
+
+        strcpy_P(tmp_buf, PSTR("Month,Day,Time,Run time(min),ScheduleID,Adjustment,WUAdjustment\r\n"));
+        lfile.write(tmp_buf, strlen(tmp_buf));
+
+        tmElements_t tm;   tm.Day = 1;  tm.Month = 1;  tm.Year = 2014 - 1970;  tm.Hour = 0;  tm.Minute = 15;  tm.Second = 0;
+
+        for( time_t t = makeTime(tm); year(t) == 2014; t += 6*3600L, nrec++ ){
+
+              sprintf_P(tmp_buf, PSTR("%u,%u,%u:%u,%u,%u,%i,%i\r\n"), month(t), day(t), hour(t), minute(t), 10 + nrec%20, nrec%4, 100, 95);
+              lfile.write(tmp_buf, strlen(tmp_buf));
+        }
+        lfile.sync();
+        size = lfile.fileSize();
+
+// per-line fgets() scan
+        lfile.seekSet(0);
+        t0 = millis();
+        lfile.fgets(tmp_buf, sizeof(tmp_buf));      // column headers
+
+        while( (lfile.fgets(tmp_buf, sizeof(tmp_buf)) > 0) && (tmp_buf[0] != 0) ){
+
+              parseWateringRecord(tmp_buf, &rec);
+              fgets_nrec++;
+        }
+        fgets_ms = max(millis() - t0, 1UL);
+
+// buffered line reader scan
+        lfile.seekSet(0);
+        t0 = millis();
+        reader.begin(&lfile);
+        reader.nextLine();      // column headers
+
+        while( readWateringRecord(reader, &rec) )
+              reader_nrec++;
+
+        reader_ms = max(millis() - t0, 1UL);
+
+        lfile.close();
+        sd.remove(LOG_BENCHMARK_FNAME);
+
+        fprintf_P(stream_file, PSTR("\t\"bytes\": %lu,\n\t\"records\": %u,\n"), size, nrec);
+        fprintf_P(stream_file, PSTR("\t\"fgets\": { \"records\":%u, \"ms\":%lu, \"bytes_per_sec\":%lu },\n"), fgets_nrec, fgets_ms, size*1000UL/fgets_ms);
+        fprintf_P(stream_file, PSTR("\t\"reader\": { \"records\":%u, \"ms\":%lu, \"bytes_per_sec\":%lu }\n"), reader_nrec, reader_ms, size*1000UL/reader_ms);
+
+        return true;
+}
+
+#endif  // LOG_BENCHMARK
+
+LogCursor::LogCursor()
+{
+        log_type = 0;
+}
+
+LogCursor::~LogCursor()
+{
+        close();
+}
+
+// Start iterating over records of the log (log type and zone/sensor id) in the [start, end) range.
+// start_offset (if not 0) is the offset of the first record to read in the file containing start.
+//
+// Returns false if log type is not supported or the range is empty.
+//
+bool LogCursor::begin(byte type, int id, time_t range_start, time_t range_end, uint32_t offset)
+{
+        close();
+
+        if( (type != LOG_TYPE_WATERING) && (type != LOG_TYPE_WATERFLOW) && (logSensorType(type) == 0) ){
+
+              log_type = 0;
+              return false;
+        }
+
+        log_type = type;    log_id = id;
+        start = range_start;    end = range_end;
+        start_offset = offset;
+
+        nyear = year(start);    nmonth = (log_type == LOG_TYPE_WATERING) ? 1 : month(start);
+        files_end = end;
+
+#ifdef SENSOR_STORE
+        SensorStoreHeader  hdr;
+        SensorStorePage    page;
+        char               fname[MAX_LOG_FNAME_SIZE];
+
+        bStore = false;
+        store_slot = SENSOR_STORE_NO_SLOT;
+
+        strcpy_P(fname, PSTR(SENSOR_STORE_FNAME));
+
+        if( (logSensorType(type) != 0) && lfile.open(fname, O_READ) ){
+
+// find the series in the store. Log files are read only for the time before the oldest store page.
+              if( storeReadHeader(lfile, &hdr) ){
+
+                    for( byte i = 0; i < SENSOR_STORE_SERIES; i++ ){
+
+                          SensorStoreSeries  *pSeries = &hdr.series[i];
+
+                          if( (pSeries->sensor_type != logSensorType(type)) || (pSeries->sensor_id != id) || (pSeries->pages == 0) )
+                                continue;
+
+                          store_pages = pSeries->pages;
+                          store_oldest = (pSeries->pages == SENSOR_STORE_PAGES) ? (pSeries->head + 1) % SENSOR_STORE_PAGES : 0;
+
+                          if( storeReadPage(lfile, i, store_oldest, &page) ){
+
+                                store_slot = i;
+                                files_end = min(end, page.t_first);
+                          }
+                          break;
+                    }
+              }
+              lfile.close();
+        }
+#endif  // SENSOR_STORE
+
+        return start < end;
+}
+
+void LogCursor::close()
+{
+        if( lfile.isOpen() )
+              lfile.close();
+}
+
+// Open the next existing log file in the range. Returns false when there are no more files.
+//
+bool LogCursor::openNext()
+{
+        char   fname[MAX_LOG_FNAME_SIZE];
+
+        while( (log_type != 0) && (monthStart(nyear, nmonth) < files_end) ){
+
+              bool   bFirst = (nyear == year(start)) && ((log_type == LOG_TYPE_WATERING) || (nmonth == month(start)));
+
+              file_year = nyear;    file_month = nmonth;
+
+              if( log_type == LOG_TYPE_WATERING )
+                    sprintf_P(fname, PSTR(WATERING_LOG_FNAME_FORMAT), nyear, log_id );
+              else if( log_type == LOG_TYPE_WATERFLOW )
+                    sprintf_P(fname, PSTR(WFLOW_LOG_FNAME_FORMAT), nmonth, nyear%100, log_id );
+              else
+                    sensorLogFileName(fname, logSensorType(log_type), log_id, nmonth, nyear);
+
+              if( (log_type == LOG_TYPE_WATERING) || (nmonth == 12) ){     // advance to the next partition
+
+                    nyear++;    nmonth = 1;
+              }
+              else
+                    nmonth++;
+
+              if( !lfile.open(fname, O_READ) )
+                    continue;     // no log file for this partition
+
+              if( bFirst && (start_offset != 0) ){     // caller knows where the first record is
+
+                    format = ((log_type != LOG_TYPE_WATERING) && isBinarySensorLog(lfile)) ? LOG_FORMAT_BINARY : LOG_FORMAT_TEXT;
+
+                    if( lfile.seekSet(start_offset) ){
+
+                          reader.begin(&lfile);
+                          return true;
+                    }
+              }
+              else if( (log_type != LOG_TYPE_WATERING) && isBinarySensorLog(lfile) ){
+
+                    SensorLogHeader  hdr;
+
+                    format = LOG_FORMAT_BINARY;
+
+                    if( (lfile.read(&hdr, sizeof(hdr)) == sizeof(hdr)) && (hdr.record_size == sizeof(SensorLogRecord)) ){
+
+                          if( !bFirst )
+                                return true;
+
+// first month of the query, use day index to seek directly to the start day
+
+                          unsigned int  nd = day(start);
+
+                          while( (nd <= 31) && (hdr.day_index[nd] == SENSOR_LOG_NO_RECORDS) )
+                                nd++;
+
+                          if( (nd <= 31) && lfile.seekSet(sizeof(hdr) + (uint32_t)hdr.day_index[nd]*sizeof(SensorLogRecord)) )
+                                return true;
+                    }
+              }
+              else {
+
+                    format = LOG_FORMAT_TEXT;
+                    reader.begin(&lfile);
+                    reader.nextLine();      // skip first line in the file - column headers
+                    return true;
+              }
+
+              lfile.close();      // corrupted file or no records in the range, skip it
+        }
+
+        return false;
+}
+
+// Read the next record of the current file. Returns false at the end of file.
+//
+bool LogCursor::readRecord(LogRecord *pRec)
+{
+        memset(pRec, 0, sizeof(LogRecord));
+
+        while( true ){
+
+              if( log_type == LOG_TYPE_WATERING ){
+
+                    WateringRecord  rec;
+
+                    if( !readWateringRecord(reader, &rec) )
+                          return false;
+
+                    if( (rec.nmonth < 1) || (rec.nmonth > 12) || (rec.nday < 1) || (rec.nday > 31) || (rec.nhour > 23) )
+                          continue;      // basic protection to ensure corrupted data will not crash the system
+
+                    pRec->t = wateringRecordTime(&rec, file_year);
+                    pRec->value[0] = rec.nduration;   pRec->value[1] = rec.nschedule;   pRec->value[2] = rec.nsadj;   pRec->value[3] = rec.nwunderground;
+              }
+              else if( log_type == LOG_TYPE_WATERFLOW ){
+
+                    char          *line = reader.nextLine();
+                    unsigned int  nday = 0, nhour = 0, nminute = 0, flow_int = 0, flow_frac = 0, duration = 0;
+
+                    if( line == NULL )
+                          return false;
+
+                    sscanf_P( line, PSTR("%u,%u:%u,%u.%u,%u"), &nday, &nhour, &nminute, &flow_int, &flow_frac, &duration);
+
+                    if( (nday < 1) || (nday > 31) || (nhour > 23) )
+                          continue;      // basic protection to ensure corrupted data will not crash the system
+
+                    tmElements_t tm;   tm.Day = nday;  tm.Month = file_month; tm.Year = file_year - 1970;  tm.Hour = nhour;  tm.Minute = nminute;  tm.Second = 0;
+
+                    pRec->t = makeTime(tm);
+                    pRec->value[0] = flow_int*100 + flow_frac;      // note: flow is always written with two decimal places
+                    pRec->value[1] = duration;
+              }
+              else {
+
+                    SensorLogRecord  rec;
+
+                    if( !readSensorRecord(lfile, &reader, format, &rec) )
+                          return false;
+
+                    if( (rec.day < 1) || (rec.day > 31) || (rec.hour > 23) )
+                          continue;      // basic protection to ensure corrupted data will not crash the system
+
+                    tmElements_t tm;   tm.Day = rec.day;  tm.Month = file_month; tm.Year = file_year - 1970;  tm.Hour = rec.hour;  tm.Minute = rec.minute;  tm.Second = 0;
+
+                    pRec->t = makeTime(tm);
+                    pRec->value[0] = rec.reading;
+              }
+              return true;
+        }
+}
+
+#ifdef SENSOR_STORE
+
+// Switch to reading the sensor store. Pages are binary-searched for the first page that ends at or after the range start.
+// Returns false if there is no store data in the range.
+//
+bool LogCursor::storeBegin()
+{
+        char               fname[MAX_LOG_FNAME_SIZE];
+        SensorStorePage    page;
+        uint16_t           lo = 0, hi = store_pages;
+
+        if( bStore || (store_slot == SENSOR_STORE_NO_SLOT) )
+              return false;
+
+        bStore = true;
+        strcpy_P(fname, PSTR(SENSOR_STORE_FNAME));
+
+        if( !lfile.open(fname, O_READ) )
+              return false;
+
+        while( lo < hi ){
+
+              uint16_t  mid = (lo + hi) / 2;
+
+              if( !storeReadPage(lfile, store_slot, (store_oldest + mid) % SENSOR_STORE_PAGES, &page) )
+                    return false;
+
+              if( page.t_last < start )
+                    lo = mid + 1;
+              else
+                    hi = mid;
+        }
+
+        store_page = lo;
+        return storeLoadPage();
+}
+
+// Load the current store page header. Returns false if there are no more pages in the range.
+//
+bool LogCursor::storeLoadPage()
+{
+        SensorStorePage  page;
+
+        if( (store_page >= store_pages) || !storeReadPage(lfile, store_slot, (store_oldest + store_page) % SENSOR_STORE_PAGES, &page) )
+              return false;
+
+        if( (page.count == 0) || (page.t_first >= end) )
+              return false;
+
+        store_left = page.count;
+        store_first = true;
+        store_t = page.t_first;   store_v = page.v_first;   store_delta = 0;
+
+        return true;
+}
+
+// Decode the next reading from the store
+//
+bool LogCursor::storeNext(LogRecord *pRec)
+{
+        if( store_left == 0 ){
+
+              store_page++;
+              if( !storeLoadPage() )
+                    return false;
+        }
+
+        if( !store_first ){
+
+              long  dod, dv;
+
+              if( !storeDecode(lfile, &dod) || !storeDecode(lfile, &dv) )
+                    return false;
+
+              store_delta += dod;
+              store_t += store_delta;
+              store_v += dv;
+        }
+        store_first = false;
+        store_left--;
+
+        memset(pRec, 0, sizeof(LogRecord));
+        pRec->t = store_t;
+        pRec->value[0] = store_v;
+
+        return true;
+}
+#endif  // SENSOR_STORE
+
+// Get the next record in the range. Returns false when there are no more records.
+//
+bool LogCursor::next(LogRecord *pRec)
+{
+        while( log_type != 0 ){
+
+#ifdef SENSOR_STORE
+              if( bStore ){
+
+                    if( !storeNext(pRec) || (pRec->t >= end) )
+                          break;
+
+                    if( pRec->t < start )
+                          continue;
+
+                    return true;
+              }
+#endif  // SENSOR_STORE
+
+              if( !lfile.isOpen() && !openNext() ){
+
+#ifdef SENSOR_STORE
+                    if( storeBegin() )
+                          continue;     // log files are done, continue with the sensor store
+#endif  // SENSOR_STORE
+                    break;
+              }
+
+              if( !readRecord(pRec) ){
+
+                    lfile.close();
+                    continue;     // end of file, move to the next partition
+              }
+
+              if( pRec->t < start )
+                    continue;
+
+              if( pRec->t >= files_end ){
+
+#ifdef SENSOR_STORE
+                    lfile.close();
+                    if( storeBegin() )
+                          continue;
+#endif  // SENSOR_STORE
+                    break;
+              }
+
+              return true;
+        }
+
+        close();
+        log_type = 0;
+        return false;
+}
+
+
+//
+// Sensor rollups
+//
+// Hourly, daily and monthly summaries (sum/count/min/max) are accumulated in RAM as readings are logged, and appended to rollup files
+// when each period closes. Hourly rollups are stored in monthly files, daily and monthly rollups - in yearly files.
+//
+
+// Start of the rollup period containing time t
+//
+static time_t rollupPeriodStart(time_t t, byte level)
+{
+        tmElements_t tm;
+
+        switch (level){
+
+           case  ROLLUP_HOUR:    return t - t%SECS_PER_HOUR;
+           case  ROLLUP_DAY:     return previousMidnight(t);
+           default:
+                     breakTime(t, tm);
+                     tm.Day = 1;  tm.Hour = 0;  tm.Minute = 0;  tm.Second = 0;
+                     return makeTime(tm);
+        }
+}
+
+// Generate rollup file name for the given rollup level, covering month/year of time t
+//
+static void rollupFileName(char *fname, char sensor_type, int sensor_id, byte level, time_t t)
+{
+        char type_c = (sensor_type == SENSOR_TYPE_TEMPERATURE) ? 't' : ((sensor_type == SENSOR_TYPE_PRESSURE) ? 'p' : 'h');
+
+        if( level == ROLLUP_HOUR )
+              sprintf_P(fname, PSTR(SENSOR_ROLLUP_HOUR_FNAME_FORMAT), type_c, month(t), year(t)%100, sensor_id );
+        else
+              sprintf_P(fname, PSTR(SENSOR_ROLLUP_FNAME_FORMAT), type_c, (level == ROLLUP_DAY) ? 'd':'m', year(t), sensor_id );
+}
+
+// Merge rollup record into the accumulator
+//
+static void mergeRollup(SensorRollupRecord *pAcc, const SensorRollupRecord *pRec)
+{
+        if( pRec->count == 0 ) return;
+
+        if( pAcc->count == 0 ){
+
+              pAcc->min = pRec->min;
+              pAcc->max = pRec->max;
+        }
+        else {
+
+              if( pRec->min < pAcc->min ) pAcc->min = pRec->min;
+              if( pRec->max > pAcc->max ) pAcc->max = pRec->max;
+        }
+        pAcc->sum += pRec->sum;
+        pAcc->count += pRec->count;
+}
+
+// Find rollup accumulators for the sensor. If bCreate is true and sensor is not found, new series is allocated, to be seeded
+// from loop() as of time t (time of the reading being added). Returns NULL if not found or if the series table is full.
+//
+Logging::SensorRollup * Logging::getRollupSeries(char sensor_type, int sensor_id, bool bCreate, time_t t)
+{
+        for( byte i = 0; i < SENSOR_ROLLUP_SERIES; i++ ){
+
+              if( (rollups[i].sensor_type == sensor_type) && (rollups[i].sensor_id == sensor_id) )
+                     return &rollups[i];
+        }
+
+        if( !bCreate ) return NULL;
+
+        for( byte i = 0; i < SENSOR_ROLLUP_SERIES; i++ ){
+
+              if( rollups[i].sensor_type == 0 ){
+
+                     rollups[i].sensor_type = sensor_type;
+                     rollups[i].sensor_id = sensor_id;
+                     memset(rollups[i].acc, 0, sizeof(rollups[i].acc));
+                     rollups[i].seed_time = t;
+                     return &rollups[i];
+              }
+        }
+
+        trace(F("Sensor rollups table is full\n"));
+        return NULL;
+}
+
+// After restart the accumulators are seeded, so summaries for the current hour, day and month are not lost. The hourly accumulator
+// is seeded from the raw readings logged since the start of the hour, daily and monthly ones - from all closed lower level rollups
+// of the period plus the lower level accumulator (readings of the current hour count towards the day and the month).
+// Seeding reads the logs, so it is not done in the write path: the series is created by the first reading (at seed_time) and
+// accumulates new readings, the seeds as of seed_time are merged in later, from loop().
+// Note: if a period closed before the series was seeded, the seed for that period is lost (the period was already written out).
+//
+void Logging::seedRollups(SensorRollup *pSeries)
+{
+        char                fname[MAX_LOG_FNAME_SIZE];
+        SensorRollupRecord  rec, seed[ROLLUP_LEVELS];
+        LogCursor           cursor;
+        LogRecord           raw;
+        time_t              t = pSeries->seed_time;
+
+        pSeries->seed_time = 0;
+
+        Sync();     // closed rollups and raw readings may still be in the cached handles
+
+        memset(seed, 0, sizeof(seed));
+        seed[ROLLUP_HOUR].start = rollupPeriodStart(t, ROLLUP_HOUR);
+
+        cursor.begin(sensorLogType(pSeries->sensor_type), pSeries->sensor_id, seed[ROLLUP_HOUR].start, t);
+
+        while( cursor.next(&raw) ){
+
+              rec.sum = rec.min = rec.max = raw.value[0];
+              rec.count = 1;
+              mergeRollup(&seed[ROLLUP_HOUR], &rec);
+        }
+        cursor.close();
+
+        for( byte level = ROLLUP_DAY; level < ROLLUP_LEVELS; level++ ){
+
+              TimedSdFile  lfile;
+
+              seed[level].start = rollupPeriodStart(t, level);
+
+              rollupFileName(fname, pSeries->sensor_type, pSeries->sensor_id, level-1, t);
+              if( lfile.open(fname, O_READ) ){
+
+                    while( lfile.read(&rec, sizeof(rec)) == sizeof(rec) ){
+
+                          if( (rec.start >= seed[level].start) && (rec.start < seed[level-1].start) )    // lower level periods closed before seed_time
+                                 mergeRollup(&seed[level], &rec);
+                    }
+                    lfile.close();
+              }
+
+              mergeRollup(&seed[level], &seed[level-1]);      // open lower level period
+        }
+
+// merge the seeds with readings added since seed_time
+        for( byte level = 0; level < ROLLUP_LEVELS; level++ ){
+
+              if( pSeries->acc[level].start == seed[level].start )
+                    mergeRollup(&pSeries->acc[level], &seed[level]);
+        }
+}
+
+// Update rollup accumulators with the new reading, closing and writing out completed periods.
+//
+void Logging::updateRollups(char sensor_type, int sensor_id, time_t t, int sensor_reading)
+{
+        SensorRollup  *pSeries = getRollupSeries(sensor_type, sensor_id, true, t);
+        char          fname[MAX_LOG_FNAME_SIZE];
+
+        if( pSeries == NULL ) return;
+
+        for( byte level = 0; level < ROLLUP_LEVELS; level++ ){
+
+              SensorRollupRecord  *pAcc = &pSeries->acc[level];
+              time_t              period_start = rollupPeriodStart(t, level);
+
+              if( pAcc->start != period_start ){     // new period
+
+                    if( pAcc->count != 0 ){          // close previous period and write it out
+
+                          rollupFileName(fname, sensor_type, sensor_id, level, pAcc->start);
+
+                          LogHandle *pHandle = getLogFile(fname, NULL);
+                          if( pHandle != NULL )
+                                 appendLogData(pHandle, pAcc, sizeof(SensorRollupRecord));
+                          else
+                                 trace(F("Cannot open rollup file (%s)\n"), fname);
+                    }
+                    pAcc->start = period_start;
+                    pAcc->count = 0;
+                    pAcc->sum = 0;
+              }
+
+              SensorRollupRecord  rec;
+
+              rec.sum = rec.min = rec.max = sensor_reading;
+              rec.count = 1;
+              mergeRollup(pAcc, &rec);
+        }
+}
+
+// Emit summary series for the [start, end) range computed from raw sensor logs. Used for periods not covered by rollup files yet,
+// e.g. data logged before rollups were maintained.
+//
+static void emitRawSummary(FILE* stream_file, time_t start, time_t end, char sensor_type, int sensor_id, byte level, char *sensor_name, char *pbFirstRow)
+{
+        LogCursor           cursor;
+        LogRecord           rec;
+        SensorRollupRecord  acc, reading;
+
+        if( start >= end ) return;
+
+        acc.count = 0;
+        cursor.begin(sensorLogType(sensor_type), sensor_id, start, end);
+
+        while( cursor.next(&rec) ){
+
+              time_t  period_start = rollupPeriodStart(rec.t, level);
+
+              if( (acc.count != 0) && (acc.start != period_start) ){      // period closed
+
+                    emitSensorPoint(stream_file, pbFirstRow, sensor_name, sensor_id, acc.start, (int)(acc.sum/acc.count));
+                    acc.count = 0;
+              }
+              if( acc.count == 0 ){
+
+                    acc.start = period_start;
+                    acc.sum = 0;
+              }
+
+              reading.sum = reading.min = reading.max = rec.value[0];
+              reading.count = 1;
+              mergeRollup(&acc, &reading);
+        }
+
+        if( acc.count != 0 )
+              emitSensorPoint(stream_file, pbFirstRow, sensor_name, sensor_id, acc.start, (int)(acc.sum/acc.count));
+}
+
+// Emit sensor summary series from rollups. Closed periods are read from rollup files, current (open) period is taken from RAM accumulators.
+// Periods before the first record of a rollup file (or the whole file range, if there is no file) are aggregated from raw logs.
+//
+void Logging::emitSensorRollups(FILE* stream_file, time_t start, time_t end, char sensor_type, int sensor_id, byte level, char *sensor_name, char *pbFirstRow)
+{
+        char          fname[MAX_LOG_FNAME_SIZE];
+        time_t        period_start = rollupPeriodStart(start, level);
+        time_t        raw_end = end;
+        unsigned int  nyear = year(start);
+        unsigned int  nmonth = (level == ROLLUP_HOUR) ? month(start) : 1;
+        SensorRollup  *pSeries = getRollupSeries(sensor_type, sensor_id, false);
+
+        if( (pSeries != NULL) && (pSeries->acc[level].start < raw_end) )
+              raw_end = pSeries->acc[level].start;      // open period readings are in RAM
+
+// hourly rollups are stored in monthly files, other levels - in yearly files
+        while( (nyear < year(end)) || ((nyear == year(end)) && (nmonth <= month(end))) ){
+
+              TimedSdFile         lfile;
+              SensorRollupRecord  rec;
+              unsigned int        next_year = nyear, next_month = nmonth;
+
+              if( (level == ROLLUP_HOUR) && (nmonth < 12) )
+                    next_month++;
+              else {
+                    next_year++;
+                    next_month = 1;
+              }
+
+              time_t  file_start = max(monthStart(nyear, nmonth), period_start);
+              time_t  file_end = min(monthStart(next_year, next_month), raw_end);
+
+              rollupFileName(fname, sensor_type, sensor_id, level, file_start);
+
+              bool  bOpen = lfile.open(fname, O_READ);
+
+              if( bOpen && (lfile.read(&rec, sizeof(rec)) == sizeof(rec)) ){
+
+                    emitRawSummary(stream_file, file_start, min(rec.start, file_end), sensor_type, sensor_id, level, sensor_name, pbFirstRow);
+
+                    do {
+
+                           if( rec.start >= end )
+                                  break;
+
+                           if( (rec.start >= period_start) && (rec.count != 0) )
+                                  emitSensorPoint(stream_file, pbFirstRow, sensor_name, sensor_id, rec.start, (int)(rec.sum/rec.count));
+
+                    } while( lfile.read(&rec, sizeof(rec)) == sizeof(rec) );
+              }
+              else
+                    emitRawSummary(stream_file, file_start, file_end, sensor_type, sensor_id, level, sensor_name, pbFirstRow);
+
+              if( bOpen )
+                    lfile.close();
+
+              nyear = next_year;
+              nmonth = next_month;
+        }
+
+        if( pSeries != NULL ){
+
+              SensorRollupRecord *pAcc = &pSeries->acc[level];
+
+              if( (pAcc->count != 0) && (pAcc->start >= period_start) && (pAcc->start < end) )
+                    emitSensorPoint(stream_file, pbFirstRow, sensor_name, sensor_id, pAcc->start, (int)(pAcc->sum/pAcc->count));
+        }
+}
+
+
+#ifdef LOG_RETENTION
+//
+// Log retention
+//
+// Retention pass runs once a day in the background - one directory entry is processed on each loop() call. Expired files are
+// recognized by the name (log files names include month/year of the data):
+//
+//   - system logs older than LOG_KEEP_SYSLOG_MONTHS are removed
+//   - raw sensor logs older than LOG_KEEP_RAW_SENSOR_MONTHS are downsampled into hourly rollups (if not available yet) and removed
+//   - hourly sensor rollups older than LOG_KEEP_HOURLY_MONTHS are removed, daily and monthly rollups are kept
+//   - watering logs and watering summaries older than LOG_KEEP_WATERING_YEARS are removed
+//   - water flow logs older than LOG_KEEP_WFLOW_MONTHS are removed
+//
+// If total size of the files in the directory exceeds LOG_DIR_MAX_BYTES, the oldest expirable file (any of the above, from
+// the previous month/year or older) is removed and the directory is processed again.
+//
+
+#define RETENTION_KEEP          0
+#define RETENTION_REMOVE        1
+#define RETENTION_DOWNSAMPLE    2
+
+// Name of the log directory processed by the retention pass, false if there are no more directories
+//
+static bool retentionDirName(char *dname, byte dir)
+{
+        switch (dir){
+
+           case 0:    strcpy_P(dname, PSTR(SYSTEM_LOG_DIR));       return true;     // system logs, temperature and pressure logs
+           case 1:    strcpy_P(dname, PSTR(HUMIDITY_LOG_DIR));     return true;
+           case 2:    strcpy_P(dname, PSTR(WATERING_LOG_DIR));     return true;
+           case 3:    strcpy_P(dname, PSTR(SENSOR_ROLLUP_DIR));    return true;
+           case 4:    strcpy_P(dname, PSTR(WFLOW_LOG_DIR));        return true;
+           default:   return false;
+        }
+}
+
+// Check retention policy for the log file (8.3 name, as returned by the file system).
+// *pAge is set to the data age in months (0 - current month or year), or -1 if the file cannot be removed to free space.
+// For raw sensor logs sensor type, id and month/year are returned as well.
+//
+static byte retentionCheck(const char *fname, time_t t, int *pAge, char *pSensorType, int *pSensorId, unsigned int *pYear, unsigned int *pMonth)
+{
+        unsigned int  nmonth = 0, nyear = 0, nid = 0;
+        long          curr_key = (long)year(t)*12 + month(t) - 1;
+        int           keep = 0;
+
+        *pAge = -1;   *pSensorType = 0;
+
+        if( (strncasecmp_P(fname, PSTR("tem"), 3) == 0) || (strncasecmp_P(fname, PSTR("pre"), 3) == 0) || (strncasecmp_P(fname, PSTR("hum"), 3) == 0) ){
+
+// raw sensor log, xxxMM-YY.nnn
+              if( sscanf_P(fname+3, PSTR("%2u-%2u.%3u"), &nmonth, &nyear, &nid) != 3 )
+                    return RETENTION_KEEP;
+
+              nyear += 2000;
+              *pSensorType = (tolower(fname[0]) == 't') ? SENSOR_TYPE_TEMPERATURE : ((tolower(fname[0]) == 'p') ? SENSOR_TYPE_PRESSURE : SENSOR_TYPE_HUMIDITY);
+              *pSensorId = nid;
+              keep = LOG_KEEP_RAW_SENSOR_MONTHS;
+        }
+        else if( (strncasecmp_P(fname, PSTR("wat-"), 4) == 0) || (strncasecmp_P(fname, PSTR("wsm-"), 4) == 0) ){
+
+// watering log wat-YYYY.nnn or watering summary wsm-YYYY.bin, age is counted from the end of the year
+              if( sscanf_P(fname+4, PSTR("%4u."), &nyear) != 1 )
+                    return RETENTION_KEEP;
+
+              nmonth = 12;
+              keep = LOG_KEEP_WATERING_YEARS*12;
+        }
+        else if( strncasecmp_P(fname, PSTR("wfl"), 3) == 0 ){
+
+// water flow log, wflMM-YY.nnn
+              if( sscanf_P(fname+3, PSTR("%2u-%2u."), &nmonth, &nyear) != 2 )
+                    return RETENTION_KEEP;
+
+              nyear += 2000;
+              keep = LOG_KEEP_WFLOW_MONTHS;
+        }
+        else if( (tolower(fname[1]) == 'h') && (fname[4] == '-') ){
+
+// hourly sensor rollups, thMM-YY.nnn
+              if( sscanf_P(fname+2, PSTR("%2u-%2u."), &nmonth, &nyear) != 2 )
+                    return RETENTION_KEEP;
+
+              nyear += 2000;
+              keep = LOG_KEEP_HOURLY_MONTHS;
+        }
+        else if( isSyslogFileName(fname, &nmonth, &nyear) ){
+
+// system log, MM-YYYY.log. Day index MM-YYYY.idx is removed together with the log.
+              keep = LOG_KEEP_SYSLOG_MONTHS;
+        }
+        else
+              return RETENTION_KEEP;     // not an expirable file (e.g. daily or monthly rollups)
+
+        if( (nmonth < 1) || (nmonth > 12) )
+              return RETENTION_KEEP;
+
+        long  age = curr_key - ((long)nyear*12 + nmonth - 1);
+
+        *pYear = nyear;   *pMonth = nmonth;
+
+        if( age <= 0 )
+              return RETENTION_KEEP;     // current data, could be open for writing
+
+        *pAge = (age > 0x7FFF) ? 0x7FFF : age;
+
+        if( (keep == 0) || (age < keep) )
+              return RETENTION_KEEP;
+
+        return (*pSensorType != 0) ? RETENTION_DOWNSAMPLE : RETENTION_REMOVE;
+}
+
+// Start retention pass for the directory
+//
+void Logging::retentionStart(byte dir)
+{
+        retention_dir = dir;
+        retention_pos = 0;
+        retention_bytes = 0;
+        retention_oldest[0] = 0;
+        retention_oldest_age = 0;
+}
+
+// Process one entry of the log directory
+//
+void Logging::retentionStep()
+{
+        char     dname[MAX_LOG_FNAME_SIZE];
+        char     fname[13];
+        TimedSdFile   dir, entry;
+
+        if( !retentionDirName(dname, retention_dir) ){
+
+              retention_dir = RETENTION_IDLE;     // all done
+              return;
+        }
+
+        if( !dir.open(dname, O_READ) ){
+
+              retentionStart(retention_dir + 1);  // no such directory
+              return;
+        }
+
+        dir.seekSet(retention_pos);
+
+        if( !entry.openNext(&dir, O_READ) ){      // end of the directory
+
+              dir.close();
+
+              if( (retention_bytes > LOG_DIR_MAX_BYTES) && (retention_oldest[0] != 0) ){     // directory is too large, remove the oldest file and check again
+
+                    strcpy(fname, retention_oldest);
+                    retentionRemove(dname, fname);
+                    retentionStart(retention_dir);
+              }
+              else
+                    retentionStart(retention_dir + 1);
+
+              return;
+        }
+
+        retention_pos = dir.curPosition();
+        dir.close();
+
+        bool      bFile = entry.isFile();
+        uint32_t  fsize = entry.fileSize();
+
+        entry.getFilename(fname);
+        entry.close();
+
+        if( !bFile ) return;
+
+        char          sensor_type;
+        int           sensor_id, age;
+        unsigned int  nyear, nmonth;
+        byte          action = retentionCheck(fname, nntpTimeServer.LocalNow(), &age, &sensor_type, &sensor_id, &nyear, &nmonth);
+
+        if( action == RETENTION_DOWNSAMPLE ){
+
+              if( downsampleSensorLog(sensor_type, sensor_id, nyear, nmonth) )
+                    action = RETENTION_REMOVE;
+              else
+                    trace(F("Cannot downsample sensor log %s\n"), fname);
+        }
+
+        if( action == RETENTION_REMOVE ){
+
+              retentionRemove(dname, fname);
+              return;
+        }
+
+        retention_bytes += fsize;
+
+        if( age > retention_oldest_age ){      // oldest expirable file so far
+
+              retention_oldest_age = age;
+              strcpy(retention_oldest, fname);
+        }
+}
+
+// Remove log file
+//
+void Logging::retentionRemove(const char *dname, const char *fname)
+{
+        char  path[MAX_LOG_FNAME_SIZE];
+
+        if( (strlen(dname) + strlen(fname) + 2) > MAX_LOG_FNAME_SIZE )
+              return;
+
+        sprintf_P(path, PSTR("%s/%s"), dname, fname);
+
+        drainLogQueue();
+        closeLogFile(path);   // make sure the file is not open in the log files cache (e.g. watering summary of the previous year)
+
+        if( !sd.remove(path) )
+              trace(F("Cannot remove log file %s\n"), path);
+
+        unsigned int  nmonth, nyear;
+
+        if( isSyslogFileName(fname, &nmonth, &nyear) ){
+
+              sprintf_P(path, PSTR(SYSTEM_LOG_INDEX_FNAME_FORMAT), nmonth, nyear);
+              sd.remove(path);      // day index of the system log, could be missing
+        }
+}
+
+// Downsample raw sensor log for the month into hourly rollups, unless hourly rollups file for the month already exists.
+// Returns true if hourly rollups are available.
+//
+bool Logging::downsampleSensorLog(char sensor_type, int sensor_id, unsigned int nyear, unsigned int nmonth)
+{
+        char                fname[MAX_LOG_FNAME_SIZE];
+        TimedSdFile         rfile;
+        LogCursor           cursor;
+        LogRecord           rec;
+        SensorRollupRecord  acc, reading;
+        time_t              month_start = monthStart(nyear, nmonth);
+        bool                bOK = true;
+
+        rollupFileName(fname, sensor_type, sensor_id, ROLLUP_HOUR, month_start);
+
+        if( sd.exists(fname) )
+              return true;      // hourly rollups were maintained while the data was logged
+
+        if( !rfile.open(fname, O_WRITE | O_CREAT) )
+              return false;
+
+        acc.count = 0;
+        cursor.begin(sensorLogType(sensor_type), sensor_id, month_start, (nmonth == 12) ? monthStart(nyear+1, 1) : monthStart(nyear, nmonth+1));
+
+        while( bOK && cursor.next(&rec) ){
+
+              time_t  period_start = rollupPeriodStart(rec.t, ROLLUP_HOUR);
+
+              if( (acc.count != 0) && (acc.start != period_start) ){      // hour closed, write it out
+
+                    bOK = rfile.write(&acc, sizeof(acc)) == sizeof(acc);
+                    acc.count = 0;
+              }
+              if( acc.count == 0 ){
+
+                    acc.start = period_start;
+                    acc.sum = 0;
+              }
+
+              reading.sum = reading.min = reading.max = rec.value[0];
+              reading.count = 1;
+              mergeRollup(&acc, &reading);
+        }
+
+        if( bOK && (acc.count != 0) )
+              bOK = rfile.write(&acc, sizeof(acc)) == sizeof(acc);
+
+        if( !bOK )
+              rfile.remove();
+        else
+              rfile.close();
+
+        return bOK;
+}
+#endif  // LOG_RETENTION
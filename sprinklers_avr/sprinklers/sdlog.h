@@ -28,6 +28,7 @@ limitations under the License.
 #define SD-LOG_H_
 
 #include "port.h"
+#include "sdstats.h"
 #include <Time.h>
 
 //
@@ -37,14 +38,18 @@ limitations under the License.
 // System log directory and file name format (mm-yyyy.log)
 #define SYSTEM_LOG_DIR			"/logs"
 #define SYSTEM_LOG_FNAME_FORMAT "/logs/%2.2u-%4.4u.log"
+#define SYSTEM_LOG_INDEX_FNAME_FORMAT "/logs/%2.2u-%4.4u.idx"
 
 // Watering activity log directory and file name format (wat-yyyy.nnn)
 #define WATERING_LOG_DIR			"/watering.log"
 #define WATERING_LOG_FNAME_FORMAT "/watering.log/wat-%4.4u.%3.3u"
 
-// Water flow data directory and file name format (wfl-yyyy.nnn)
+// Watering summary (per-year) file name format (wsm-yyyy.bin)
+#define WATERING_SUMMARY_FNAME_FORMAT "/watering.log/wsm-%4.4u.bin"
+
+// Water flow data directory and file name format (wflMM-YY.nnn)
 #define WFLOW_LOG_DIR			"/wflow.log"
-#define WFLOW_LOG_FNAME_FORMAT "/wflow.log/wfl-%4.4u.%3.3u"
+#define WFLOW_LOG_FNAME_FORMAT "/wflow.log/wfl%2.2u-%2.2u.%3.3u"
 
 // Temperature data directory and file name format (temMM-YY.nnn)
 //#define TEMPERATURE_LOG_DIR		 	 "/tempr.log"
@@ -64,6 +69,12 @@ limitations under the License.
 #define PRESSURE_LOG_DIR		  "/logs"
 #define PRESSURE_LOG_FNAME_FORMAT "/logs/pre%2.2u-%2.2u.%3.3u"
 
+// Sensor rollups directory and file name formats. Hourly rollups are stored in monthly files (tHMM-YY.nnn, t - sensor type letter),
+// daily and monthly rollups - in yearly files (tD-YYYY.nnn and tM-YYYY.nnn)
+#define SENSOR_ROLLUP_DIR                 "/rollup.log"
+#define SENSOR_ROLLUP_HOUR_FNAME_FORMAT   "/rollup.log/%ch%2.2u-%2.2u.%3.3u"
+#define SENSOR_ROLLUP_FNAME_FORMAT        "/rollup.log/%c%c-%4.4u.%3.3u"
+
 
 //
 // Event types for system log
@@ -104,6 +115,319 @@ limitations under the License.
 // max log record size
 #define MAX_LOG_RECORD_SIZE          32
 
+//
+// Sensor log storage format.
+//
+// When SENSOR_LOG_BINARY is defined new sensor log files are created in binary format - fixed-size records
+// with per-file day index in the header, allowing queries to seek directly to the required day.
+// Otherwise (default) new files are created in CSV format (see log_format2.1.txt). Both formats are supported by readers,
+// and existing files are always appended in their own format. Binary files are exported as CSV on request through /logs.
+//
+//#define SENSOR_LOG_BINARY            1          // uncomment to create new sensor logs in binary format (CSV tools cannot read them)
+
+#define LOG_FORMAT_TEXT              0
+#define LOG_FORMAT_BINARY            1
+
+#define SENSOR_LOG_SIGNATURE         "SLB"      // binary sensor log file signature
+#define SENSOR_LOG_VERSION           1
+#define SENSOR_LOG_NO_RECORDS        0xFFFF     // day index value for days without records
+
+// system log day index (mm-yyyy.idx next to the log file)
+struct SyslogIndex
+{
+        uint32_t    day_offset[31];         // offset of the first record of the day + 1, 0 if there are no records for the day
+};
+
+// binary sensor log file header
+struct SensorLogHeader
+{
+        char      signature[3];             // SENSOR_LOG_SIGNATURE
+        byte      version;
+        byte      sensor_type;
+        byte      record_size;              // sizeof(SensorLogRecord)
+        uint16_t  day_index[32];            // index of the first record for each day of the month (1-31), or SENSOR_LOG_NO_RECORDS
+};
+
+// binary sensor log record
+struct SensorLogRecord
+{
+        byte      day;
+        byte      hour;
+        byte      minute;
+        int16_t   reading;
+};
+
+//
+// Sensor time-series store.
+//
+// When SENSOR_STORE is defined sensor readings are written to a single preallocated file instead of monthly sensor logs.
+// The file starts with a directory block, followed by a fixed ring of pages for each series (the oldest page is reused
+// when the ring is full). Each page is one card block - page header with the time range of the page, followed by
+// delta-of-delta encoded timestamps and delta encoded readings. Queries binary-search pages by time.
+// Monthly sensor logs written before the store was enabled remain readable, queries use them for the time before the first page.
+// If the store file cannot be created (e.g. there is no contiguous free space on the card) readings go to monthly sensor logs.
+//
+// Retention horizon: readings taken at regular intervals take ~2 bytes each, so a page holds ~240 readings and a series keeps
+// ~30000 raw readings (SENSOR_STORE_PAGES pages) - about 3 weeks at one reading per minute, 3.5 years at one reading per hour.
+// Older raw readings are dropped when the ring wraps, regardless of LOG_KEEP_RAW_SENSOR_MONTHS; summaries are kept in rollups.
+//
+//#define SENSOR_STORE                 1          // uncomment to write sensor readings to the sensor store
+#define SENSOR_STORE_FNAME           "/sensors.dat"
+#define SENSOR_STORE_SIGNATURE       "SST"
+#define SENSOR_STORE_VERSION         1
+#define SENSOR_STORE_SERIES          4          // max number of series
+#define SENSOR_STORE_PAGES           128        // pages per series
+#define SENSOR_STORE_PAGE_SIZE       512        // one card block
+#define SENSOR_STORE_NO_SLOT         0xFF
+
+// store directory entry
+struct SensorStoreSeries
+{
+        char      sensor_type;              // 0 if the slot is not used
+        byte      reserved;
+        int16_t   sensor_id;
+        uint16_t  head;                     // page being filled
+        uint16_t  pages;                    // number of pages used
+};
+
+// store directory (first block of the file)
+struct SensorStoreHeader
+{
+        char               signature[3];    // SENSOR_STORE_SIGNATURE
+        byte               version;
+        uint16_t           page_size;
+        uint16_t           pages;           // pages per series
+        byte               nseries;
+        SensorStoreSeries  series[SENSOR_STORE_SERIES];
+};
+
+// store page header, followed by encoded readings. The first reading of the page is kept in the header, each of the
+// following readings is encoded as two zigzag varints - timestamp delta-of-delta and reading delta.
+struct SensorStorePage
+{
+        time_t    t_first;
+        time_t    t_last;
+        int16_t   v_first;
+        int16_t   v_last;
+        int32_t   last_delta;               // last timestamp delta, base for the next delta-of-delta
+        uint16_t  count;                    // number of readings, 0 if the page is empty
+        uint16_t  used;                     // payload bytes used
+};
+
+#define SENSOR_STORE_PAYLOAD         (SENSOR_STORE_PAGE_SIZE - sizeof(SensorStorePage))
+
+//
+// Sensor rollups
+//
+#define SENSOR_ROLLUP_SERIES         4          // max number of sensor series with rollups
+
+#define ROLLUP_HOUR                  0
+#define ROLLUP_DAY                   1
+#define ROLLUP_MONTH                 2
+#define ROLLUP_LEVELS                3
+
+// rollup record - summary of the sensor readings for one period. The same structure is used for RAM accumulators.
+struct SensorRollupRecord
+{
+        time_t    start;                    // period start
+        long      sum;
+        uint16_t  count;
+        int16_t   min;
+        int16_t   max;
+};
+
+//
+// Watering summary
+//
+struct WateringBin
+{
+        long      sum;                      // sum of run times
+        uint16_t  count;                    // number of runs
+};
+
+// summary of watering runs for one zone and month
+struct WateringMonthSummary
+{
+        uint32_t     first_offset;          // offset of the first record for the month in the zone watering log, 0 if there are no records
+        WateringBin  hour[24];              // hour-of-day bins
+        WateringBin  weekday[7];            // weekday bins (Sunday is 0)
+};
+
+//
+// Log retention policy.
+//
+// When LOG_RETENTION is defined expired log files are removed (raw sensor logs are downsampled into hourly rollups first) by the
+// retention pass, which runs in the background once a day. Retention periods are in months (years for watering logs), 0 - keep forever.
+// If a log directory is still larger than LOG_DIR_MAX_BYTES, the oldest files are removed.
+// The sensor store (SENSOR_STORE) has a fixed size and is not processed by the retention pass: its ring bounds raw readings
+// instead, LOG_KEEP_RAW_SENSOR_MONTHS applies to monthly sensor logs only. Hourly rollups are written as each hour closes, so
+// readings dropped from the ring are already summarized.
+//
+#define LOG_RETENTION                1
+#define LOG_RETENTION_HOUR           3          // hour of the day when retention pass starts
+#define LOG_KEEP_SYSLOG_MONTHS       12
+#define LOG_KEEP_RAW_SENSOR_MONTHS   3
+#define LOG_KEEP_HOURLY_MONTHS       24
+#define LOG_KEEP_WATERING_YEARS      5
+#define LOG_KEEP_WFLOW_MONTHS        24
+#define LOG_DIR_MAX_BYTES            4000000UL
+
+#define RETENTION_IDLE               0xFF       // retention pass is not running
+
+//
+// Tail queries (newest records first)
+//
+#define LOG_TAIL_MAX                 20         // max number of records returned by a tail query
+#define LOG_TAIL_CHUNK_SIZE          64         // backwards read chunk size
+#define LOG_TAIL_YEARS               2          // watering logs - number of yearly files to look through
+#define LOG_TAIL_MONTHS              3          // system logs - number of monthly files to look through
+
+//
+// System log queries
+//
+#define SYSLOG_QUERY_MAX             50         // max number of events returned in one page
+#define SYSLOG_QUERY_LINE_SIZE       128        // line buffer size, substring filter is applied to the first part of longer lines
+
+// max log file name size (full path, including terminating zero)
+#define MAX_LOG_FNAME_SIZE           28
+
+//
+// Open log files cache and sync policy.
+//
+// Log files are kept open between writes, so the common append path is a buffered write without directory lookup.
+// Dirty files are synced when either time or size threshold is reached, all files are closed at month rollover.
+// The files written most often (system log and sensor store) are pinned - they are not evicted by the other files. The rest
+// (sensor logs written once per reading interval, rollups written when a period closes, watering logs and summaries) share
+// the remaining slots. Cache hits, misses and evictions are reported by /json/sdstats.
+//
+#define LOG_HANDLE_CACHE_SIZE        4          // number of log files kept open at the same time (~80 bytes of RAM each)
+#define LOG_SYNC_INTERVAL            10000      // max time (in ms) appended data can stay unsynced
+#define LOG_SYNC_BYTES               512        // max number of unsynced bytes per file
+
+//
+// Preallocated log files.
+//
+// When LOG_PREALLOCATE is defined watering logs and sensor logs are created as contiguous files of fixed size, with free space
+// filled with zeros. Appends overwrite the zeros in place, without cluster allocation or FAT updates. Readers stop at the end
+// of data marker - zero byte (text logs) or record with zero day (binary logs). If preallocated space is exhausted the file grows as usual.
+//
+#define LOG_PREALLOCATE              1
+#define WATERING_LOG_PREALLOC_SIZE   16384      // yearly watering log file (per zone)
+#define SENSOR_LOG_PREALLOC_SIZE     8192       // monthly sensor log file
+#define SENSOR_STORE_SIZE            ((1UL + SENSOR_STORE_SERIES*SENSOR_STORE_PAGES) * SENSOR_STORE_PAGE_SIZE)
+
+#if defined(SENSOR_STORE) && !defined(LOG_PREALLOCATE)
+#error SENSOR_STORE requires LOG_PREALLOCATE (sensor store pages are written in place)
+#endif
+
+//
+// Write-behind queue.
+//
+// Log records are queued in RAM and written to the card from the main loop, grouped by the log file. Error events and
+// readers (web queries, file serving) force the queue to be written immediately, the queue is also written on Close().
+// The queue only has to hold records logged between two drains (a few sensor readings and a burst of system events, 10-18 bytes
+// each with the 8 byte header), a full queue is drained synchronously. System events longer than the queue are written directly.
+//
+#define LOG_QUEUE_SIZE               128        // queue size (bytes)
+#define LOG_QUEUE_DRAIN_BYTES        64         // write queued records when this many bytes are queued
+#define LOG_QUEUE_DRAIN_INTERVAL     2000       // max time (in ms) a record can stay in the queue
+
+//
+// System log storm protection.
+//
+// Repeats of a recent event (same type and text) within the window are counted instead of logged, a single "repeated N times"
+// record is written when the window expires. Events beyond the rate limit are dropped and counted, the number of dropped
+// events is logged once the rate goes down. Error events are not rate limited (their repeats are still counted).
+//
+#define SYSLOG_COALESCE              1          // comment out to disable syslog coalescing and rate limiting
+#define SYSLOG_RECENT_SIZE           6          // number of recent events tracked
+#define SYSLOG_RECENT_TEXT           20         // event text prefix kept for the summary record
+#define SYSLOG_REPEAT_WINDOW         60000      // repeats suppression window (ms)
+#define SYSLOG_RATE_BURST            10         // max number of events logged in a burst
+#define SYSLOG_RATE_INTERVAL         2000       // sustained rate - one event per interval (ms)
+
+//
+// Buffered log reader.
+//
+// Text log queries read lines through a small buffer filled with bulk reads that never cross a card block boundary, instead of
+// per-line fgets() copies. Lines are parsed in place.
+//
+#define LOG_READ_BUFFER_SIZE         128        // line buffer size (up to 255), longer lines are truncated
+//#define LOG_BENCHMARK                1          // uncomment to enable /json/logbench (log scan throughput on a synthetic year of logs)
+
+// Line reader over a text log file, starting at the current file position
+class LogLineReader
+{
+public:
+        void begin(TimedSdFile *pFile);
+        // Next line (without line terminator, truncated to the buffer size), NULL at the end of data.
+        // Offset of the line in the file is returned in *pOffset.
+        char * nextLine(uint32_t *pOffset = NULL);
+
+private:
+        TimedSdFile   *pFile;
+        uint32_t      buf_offset;               // file offset of buf[0]
+        byte          head, tail;               // unread data is buf[head..tail)
+        bool          bEof;
+        char          buf[LOG_READ_BUFFER_SIZE + 1];
+
+        bool fill();
+};
+
+// log record returned by LogCursor
+struct LogRecord
+{
+        time_t    t;
+        int       value[4];                 // watering: duration, schedule, seasonal adjustment, wunderground adjustment. Sensors: reading.
+                                            // water flow: flow (0.01 gallon units), duration (sec)
+};
+
+//
+// Streaming cursor over time-partitioned log files (watering logs - one file per year, sensor logs - one file per month).
+// Files are opened one at a time in chronological order, files outside of the requested range are skipped by name.
+//
+class LogCursor
+{
+public:
+        LogCursor();
+        ~LogCursor();
+        // Start iterating over the log (LOG_TYPE_xxx, zone or sensor id) records in the [start, end) range
+        bool begin(byte log_type, int log_id, time_t start, time_t end, uint32_t start_offset = 0);
+        bool next(LogRecord *pRec);
+        void close();
+
+private:
+        TimedSdFile   lfile;
+        LogLineReader reader;                   // text logs reader
+        byte          log_type;                 // 0 when there are no more records
+        byte          format;                   // current file format, LOG_FORMAT_TEXT or LOG_FORMAT_BINARY
+        int           log_id;
+        time_t        start, end;
+        uint32_t      start_offset;
+        unsigned int  nyear, nmonth;            // next partition to open
+        unsigned int  file_year, file_month;    // partition of the current file
+        time_t        files_end;                // end of the range covered by log files (start of the sensor store data)
+
+#ifdef SENSOR_STORE
+        bool          bStore;                   // reading the sensor store
+        byte          store_slot;               // series slot in the store, SENSOR_STORE_NO_SLOT if there is no series
+        uint16_t      store_oldest, store_pages;
+        uint16_t      store_page;               // current page (0 - the oldest page)
+        uint16_t      store_left;               // readings left in the current page
+        bool          store_first;              // next reading is the first reading of the page
+        time_t        store_t;                  // decoder state
+        int           store_v;
+        long          store_delta;
+
+        bool storeBegin();
+        bool storeLoadPage();
+        bool storeNext(LogRecord *pRec);
+#endif  // SENSOR_STORE
+
+        bool openNext();
+        bool readRecord(LogRecord *pRec);
+};
+
 class Logging
 {
 public:
@@ -112,6 +436,16 @@ public:
         ~Logging();
         bool begin(char *str);
         void Close();
+#ifdef LOG_BENCHMARK
+        // Measure log scan throughput on a synthetic year of watering logs
+        bool BenchmarkScan(FILE* stream_file);
+#endif  // LOG_BENCHMARK
+        // Periodic housekeeping (log files sync policy). Intended to be called from the main loop.
+        void loop();
+        // Write-behind queue processing. Intended to be called from the main loop on every pass.
+        void Poll();
+        // Write queued records and flush all open log files to the card. Used before log files are read or served.
+        void Sync();
         // Watering activity logging. Note: signature is deliberately compatible with sprinklers_pi control program
         bool LogZoneEvent(time_t start, int zone, int duration, int schedule, int sadj, int wunderground);
 
@@ -121,10 +455,26 @@ public:
         // Retrieve data suitble for putting into a table
         bool TableZone(FILE* stream_file, time_t start, time_t end);
 
+        // Retrieve graph data and table data for the same range in one pass over the watering logs
+        bool WateringHistory(FILE* stream_file, time_t start, time_t end, GROUPING group);
+
+        // Retrieve the newest watering records (zone 0 - all zones), and the newest system log events (evt_type 0 - all types)
+        bool TailWatering(FILE* stream_file, int zone, int n);
+        bool TailSyslog(FILE* stream_file, char evt_type, int n);
+
+        // Retrieve system log events in the time range, filtered by severity and substring, one page at a time
+        bool QuerySyslog(FILE* stream_file, time_t sdate, time_t edate, char severity, const char *text, uint32_t cursor_month, uint32_t cursor_offset, int n);
+
         // Sensors logging. It covers all types of basic sensors (e.g. temperature, pressure etc) that provide momentarily (immediate) readings
         bool LogSensorReading(char sensor_type, int sensor_id, int sensor_reading);
 
-	bool EmitSensorLog(FILE* stream_file, time_t sdate, time_t edate, char sensor_type, int sensor_id, char summary_type);
+        // Raw readings (LOG_SUMMARY_NONE) are downsampled to at most max_points points, 0 - no downsampling
+	bool EmitSensorLog(FILE* stream_file, time_t sdate, time_t edate, char sensor_type, int sensor_id, char summary_type, int max_points = 0);
+
+        // Water flow logging. Flow is in 0.01 gallon units, duration - in seconds
+        bool LogWaterFlow(int sensor_id, unsigned int flow, unsigned int duration);
+
+        bool EmitWaterFlowLog(FILE* stream_file, time_t sdate, time_t edate, int sensor_id);
 
         // add event to the system log with the string str
         byte syslog_str(char evt_type, char *str);
@@ -133,12 +483,160 @@ public:
         
         void HandleWebRq(char *sPage, FILE *pFile);
 
+        // Check if the file is a binary sensor log
+        bool IsBinarySensorLog(TimedSdFile &lfile);
+        // Export binary sensor log as CSV
+        bool ExportSensorLog(FILE* stream_file, TimedSdFile &lfile);
+        // Size of the log data in the file (preallocated log files could be larger)
+        uint32_t LogDataSize(TimedSdFile &lfile);
+#ifdef SD_STATS
+        // Open log files cache statistics
+        void EmitCacheStats(FILE* stream_file);
+#endif  // SD_STATS
+
 private:
 
         bool   logger_ready;
+
+        // open log file handle, kept in the LRU cache
+        struct LogHandle
+        {
+                TimedSdFile     file;
+                char            fname[MAX_LOG_FNAME_SIZE];     // empty string if the slot is not used
+                byte            format;                        // LOG_FORMAT_TEXT or LOG_FORMAT_BINARY
+                byte            last_day;                      // binary sensor logs and system logs - day of the last record, 0 if not known yet
+                bool            bDirty;                        // file was modified in place (e.g. header update)
+                bool            bPinned;                       // hot file, not evicted by other files
+                uint32_t        data_end;                      // logical end of data, could be less than the file size for preallocated files
+                unsigned long   last_used;                     // millis() of the last access, used for LRU replacement
+                unsigned long   last_sync;                     // millis() of the last sync
+                uint32_t        synced_size;                   // data size at the last sync
+        };
+
+        // sensor rollup accumulators
+        struct SensorRollup
+        {
+                char                sensor_type;           // 0 if the slot is not used
+                int                 sensor_id;
+                time_t              seed_time;             // time of the first reading after restart, 0 once the series is seeded
+                SensorRollupRecord  acc[ROLLUP_LEVELS];    // current (open) period accumulators
+        };
+
+        // write-behind queue entry header, followed by len bytes of payload
+        struct LogQueueEntry
+        {
+                byte      len;                  // payload length
+                byte      log_type;             // LOG_TYPE_xxx, 0 if the entry was already written
+                int       id;                   // zone or sensor id
+                time_t    t;                    // time the record was logged
+        };
+
+        // recently logged system event
+        struct SyslogRecent
+        {
+                uint16_t        hash;                   // hash of the event type and text, 0 if the slot is not used
+                char            evt_type;
+                uint16_t        repeats;                // number of repeats suppressed in the current window
+                unsigned long   window_start;           // millis() when the event was logged
+                char            text[SYSLOG_RECENT_TEXT];
+        };
+
+        // watering event payload
+        struct ZoneEventRecord
+        {
+                time_t    start;
+                int       duration;
+                int       schedule;
+                int       sadj;
+                int       wunderground;
+        };
+
+        // water flow payload
+        struct WaterFlowRecord
+        {
+                unsigned int  flow;             // 0.01 gallon units
+                unsigned int  duration;         // seconds
+        };
+
+        LogHandle     log_handles[LOG_HANDLE_CACHE_SIZE];
+        SensorRollup  rollups[SENSOR_ROLLUP_SERIES];
+        byte       log_handles_month;                          // month the cached handles belong to
+#ifdef SD_STATS
+        uint32_t      log_handle_hits, log_handle_misses, log_handle_evictions;
+#endif  // SD_STATS
+#ifdef SENSOR_STORE
+        bool          store_unavailable;                       // sensor store could not be created, monthly sensor logs are used
+#endif  // SENSOR_STORE
+
+        byte          log_queue[LOG_QUEUE_SIZE];               // write-behind ring buffer
+        uint16_t      log_queue_head;                          // position of the oldest entry
+        uint16_t      log_queue_used;                          // number of bytes in the queue
+        unsigned long log_queue_time;                          // millis() when the oldest entry was queued
+        bool          log_queue_draining;
+
+#ifdef SYSLOG_COALESCE
+        SyslogRecent  syslog_recent[SYSLOG_RECENT_SIZE];
+        byte          syslog_tokens;                           // rate limiter - number of events that can be logged now
+        unsigned long syslog_tokens_time;                      // millis() of the last tokens refill
+        uint16_t      syslog_dropped;                          // number of events dropped by the rate limiter
+#endif  // SYSLOG_COALESCE
+
+        byte          retention_dir;                           // directory processed by the retention pass, RETENTION_IDLE if not running
+        byte          retention_day;                           // day of the last retention pass
+        uint32_t      retention_pos;                           // position in the directory
+        uint32_t      retention_bytes;                         // total size of the files retained in the directory
+        int           retention_oldest_age;                    // age (months) of the oldest expirable file
+        char          retention_oldest[13];                    // name of the oldest expirable file
+
+        LogHandle * getLogFile(const char *fname, bool *pCreated, byte flags = O_WRITE | O_APPEND, uint32_t prealloc_size = 0);
+        bool appendLogData(LogHandle *pHandle, const void *data, size_t len);
+        void syncLogFile(LogHandle *pHandle);
+        void syncLogFiles(bool bForce);
+        void closeLogFiles();
+        void closeLogFile(const char *path);
         
         byte syslog_str_internal(char evt_type, char *str, char flag);
-        int getZoneBins( int zone, time_t start, time_t end, long int *bin_data, int bins, GROUPING grouping);
+        bool syslogCoalesce(char evt_type, char *str, size_t len, char flag);
+        void syslogWriteRepeats(SyslogRecent *pRecent);
+        void syslogFlushRepeats(bool bForce);
+        LogHandle * beginSyslogRecord(time_t t, char evt_type);
+        void endSyslogRecord(LogHandle *pHandle);
+        bool writeSyslogRecord(time_t t, char evt_type, uint16_t pos, byte len);
+        bool writeSyslogDirect(time_t t, char evt_type, char *str, char flag);
+        bool updateSyslogIndex(LogHandle *pHandle, time_t t);
+        bool findSyslogDay(unsigned int nyear, unsigned int nmonth, byte nday, uint32_t *pOffset);
+        bool writeZoneEvent(time_t t, int zone, const ZoneEventRecord *pRec);
+        bool writeSensorReading(char sensor_type, int sensor_id, time_t t, int sensor_reading);
+#ifdef SENSOR_STORE
+        bool storeSensorReading(char sensor_type, int sensor_id, time_t t, int sensor_reading);
+#endif  // SENSOR_STORE
+        bool writeWaterFlow(int sensor_id, time_t t, const WaterFlowRecord *pRec);
+
+        void queuePut(const void *data, byte len, bool bProgmem);
+        void queueGet(uint16_t pos, void *data, byte len);
+        bool queueLogRecord(byte log_type, int log_id, time_t t, const void *data, byte len, bool bProgmem);
+        void drainLogQueue();
+        void writeLogRecord(const LogQueueEntry *pEntry, uint16_t pos);
+        LogHandle * findLogFile(const char *fname);
+
+        int getZoneBins( int zone, time_t start, time_t end, long int *bin_data, uint16_t *bin_counter, int bins, GROUPING grouping, time_t bin_scale);
+        LogHandle * getWateringSummary(unsigned int nyear, bool *pBuilt);
+        bool buildWateringSummary(LogHandle *pSumHandle, unsigned int nyear);
+        void updateWateringSummary(unsigned int nyear, int zone, time_t start, int duration, uint32_t rec_offset);
+        bool findWateringStart(int zone, time_t *pStart, time_t end, uint32_t *pOffset);
+        bool readWateringSummary(LogHandle *pSumHandle, int zone, unsigned int nmonth, WateringMonthSummary *pSum);
+        bool writeWateringSummary(LogHandle *pSumHandle, int zone, unsigned int nmonth, WateringMonthSummary *pSum);
+        bool appendBinarySensorRecord(LogHandle *pHandle, time_t t, int sensor_reading);
+
+        SensorRollup * getRollupSeries(char sensor_type, int sensor_id, bool bCreate, time_t t = 0);
+        void seedRollups(SensorRollup *pSeries);
+        void updateRollups(char sensor_type, int sensor_id, time_t t, int sensor_reading);
+        void emitSensorRollups(FILE* stream_file, time_t start, time_t end, char sensor_type, int sensor_id, byte level, char *sensor_name, char *pbFirstRow);
+
+        void retentionStart(byte dir);
+        void retentionStep();
+        void retentionRemove(const char *dname, const char *fname);
+        bool downsampleSensorLog(char sensor_type, int sensor_id, unsigned int nyear, unsigned int nmonth);
 
 };
 
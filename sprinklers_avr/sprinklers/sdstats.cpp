@@ -0,0 +1,250 @@
+/*
+
+SD card I/O latency statistics for Sprinklers control program.
+
+
+Copyright 2014 tony-osp (http://tony-osp.dreamwidth.org/)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+*/
+
+#include "sdstats.h"
+
+#ifdef SD_STATS
+
+SdStats sdstats;
+
+SdStats::SdStats()
+{
+        Reset();
+}
+
+void SdStats::Reset()
+{
+        memset(ops, 0, sizeof(ops));
+
+        last_slow_op = 0;
+        last_slow_us = 0;
+        last_slow_time = 0;
+        last_slow_fname[0] = 0;
+}
+
+// Copy the last path component (up to 12 characters)
+//
+static void statsFileName(char *fname, const char *path)
+{
+        const char  *p = strrchr(path, '/');
+
+        strncpy(fname, p ? p + 1 : path, 12);
+        fname[12] = 0;
+}
+
+void SdStats::Record(byte op, unsigned long t0, SdBaseFile *pFile, const char *path)
+{
+        uint32_t  us = micros() - t0;
+        OpStats   *pOp = &ops[op];
+        byte      bucket = 0;
+
+        pOp->count++;
+
+// bucket boundaries are 256us * 4^n
+        for( uint32_t v = us >> 8; (v != 0) && (bucket < SD_STATS_BUCKETS-1); v >>= 2 )
+              bucket++;
+
+        if( pOp->hist[bucket] != 0xFFFF )
+              pOp->hist[bucket]++;
+
+        if( (us <= pOp->max_us) && (us < SD_STATS_SLOW_US) )
+              return;     // common case - nothing else to record
+
+// slow or slowest operation, get the file name. Note: this could cause I/O, but only after a slow operation.
+        char  fname[13] = {0};
+
+        if( path != NULL )
+              statsFileName(fname, path);
+        else if( (pFile != NULL) && pFile->isOpen() )
+              pFile->getFilename(fname);
+
+        if( us > pOp->max_us ){
+
+              pOp->max_us = us;
+              strcpy(pOp->max_fname, fname);
+        }
+
+        if( us >= SD_STATS_SLOW_US ){
+
+              if( pOp->slow != 0xFFFF )
+                    pOp->slow++;
+
+              last_slow_op = op;   last_slow_us = us;   last_slow_time = millis();
+              strcpy(last_slow_fname, fname);
+        }
+}
+
+void SdStats::EmitJSON(FILE* stream_file)
+{
+        fprintf_P(stream_file, PSTR("\t\"uptime\": %lu,\n\t\"slow_us\": %lu,\n\t\"buckets_us\": [256, 1024, 4096, 16384, 65536, 262144, 1048576],\n\t\"ops\": ["),
+                                    millis()/1000, SD_STATS_SLOW_US );
+
+        for( byte op = 0; op < SD_OP_TYPES; op++ ){
+
+              OpStats  *pOp = &ops[op];
+
+              fprintf_P(stream_file, PSTR("%s\n\t\t{ \"op\":\"%S\", \"count\":%lu, \"slow\":%u, \"max_us\":%lu, \"max_file\":\"%s\", \"hist\":["),
+                                          op ? ",":"", opName(op), pOp->count, pOp->slow, pOp->max_us, pOp->max_fname );
+
+              for( byte i = 0; i < SD_STATS_BUCKETS; i++ )
+                    fprintf_P(stream_file, PSTR("%s%u"), i ? ",":"", pOp->hist[i]);
+
+              fprintf_P(stream_file, PSTR("] }"));
+        }
+
+        fprintf_P(stream_file, PSTR("\n\t],\n\t\"last_slow\": { \"op\":\"%S\", \"us\":%lu, \"file\":\"%s\", \"uptime\":%lu },\n"),
+                                    opName(last_slow_op), last_slow_us, last_slow_fname, last_slow_time/1000 );
+}
+
+// Operation name (in program memory)
+//
+const char * SdStats::opName(byte op)
+{
+        switch (op){
+
+           case SD_OP_OPEN:     return PSTR("open");
+           case SD_OP_READ:     return PSTR("read");
+           case SD_OP_WRITE:    return PSTR("write");
+           case SD_OP_SYNC:     return PSTR("sync");
+           default:             return PSTR("close");
+        }
+}
+
+
+//
+// TimedSdFile - SdFile calls wrapped with latency accounting
+//
+
+bool TimedSdFile::open(const char* path, uint8_t oflag)
+{
+        unsigned long  t0 = micros();
+        bool           rc = SdFile::open(path, oflag);
+
+        sdstats.Record(SD_OP_OPEN, t0, NULL, path);
+        return rc;
+}
+
+bool TimedSdFile::open(SdBaseFile* dirFile, const char* path, uint8_t oflag)
+{
+        unsigned long  t0 = micros();
+        bool           rc = SdFile::open(dirFile, path, oflag);
+
+        sdstats.Record(SD_OP_OPEN, t0, NULL, path);
+        return rc;
+}
+
+bool TimedSdFile::openNext(SdBaseFile* dirFile, uint8_t oflag)
+{
+        unsigned long  t0 = micros();
+        bool           rc = SdFile::openNext(dirFile, oflag);
+
+        sdstats.Record(SD_OP_OPEN, t0, this, NULL);
+        return rc;
+}
+
+bool TimedSdFile::createContiguous(SdBaseFile* dirFile, const char* path, uint32_t size)
+{
+        unsigned long  t0 = micros();
+        bool           rc = SdFile::createContiguous(dirFile, path, size);
+
+        sdstats.Record(SD_OP_OPEN, t0, NULL, path);
+        return rc;
+}
+
+int TimedSdFile::read()
+{
+        unsigned long  t0 = micros();
+        int            rc = SdFile::read();
+
+        sdstats.Record(SD_OP_READ, t0, this, NULL);
+        return rc;
+}
+
+int TimedSdFile::read(void* buf, size_t nbyte)
+{
+        unsigned long  t0 = micros();
+        int            rc = SdFile::read(buf, nbyte);
+
+        sdstats.Record(SD_OP_READ, t0, this, NULL);
+        return rc;
+}
+
+int16_t TimedSdFile::fgets(char* str, int16_t num, char* delim)
+{
+        unsigned long  t0 = micros();
+        int16_t        rc = SdFile::fgets(str, num, delim);
+
+        sdstats.Record(SD_OP_READ, t0, this, NULL);
+        return rc;
+}
+
+size_t TimedSdFile::write(uint8_t b)
+{
+        unsigned long  t0 = micros();
+        size_t         rc = SdFile::write(b);
+
+        sdstats.Record(SD_OP_WRITE, t0, this, NULL);
+        return rc;
+}
+
+size_t TimedSdFile::write(const uint8_t* buf, size_t size)
+{
+        unsigned long  t0 = micros();
+        int            rc = SdFile::write((const void*)buf, size);
+
+        sdstats.Record(SD_OP_WRITE, t0, this, NULL);
+        return (rc < 0) ? 0 : rc;
+}
+
+int TimedSdFile::write(const void* buf, size_t nbyte)
+{
+        unsigned long  t0 = micros();
+        int            rc = SdFile::write(buf, nbyte);
+
+        sdstats.Record(SD_OP_WRITE, t0, this, NULL);
+        return rc;
+}
+
+bool TimedSdFile::sync()
+{
+        unsigned long  t0 = micros();
+        bool           rc = SdFile::sync();
+
+        sdstats.Record(SD_OP_SYNC, t0, this, NULL);
+        return rc;
+}
+
+// Close is accounted as the final sync, the rest of close() does not access the card.
+//
+bool TimedSdFile::close()
+{
+        if( !isOpen() )
+              return SdFile::close();
+
+        unsigned long  t0 = micros();
+
+        SdFile::sync();
+        sdstats.Record(SD_OP_CLOSE, t0, this, NULL);
+
+        return SdFile::close();
+}
+
+#endif  // SD_STATS
@@ -0,0 +1,109 @@
+/*
+
+SD card I/O latency statistics for Sprinklers control program.
+
+Log files and web server files are accessed through TimedSdFile, which measures latency of every open, read, write, sync and
+close call and accumulates per-operation histograms, max latency and slow operations counts. Statistics are available
+as JSON (/json/sdstats), to tell card problems (e.g. internal garbage collection stalls) apart from firmware problems.
+
+
+Copyright 2014 tony-osp (http://tony-osp.dreamwidth.org/)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+*/
+
+#ifndef _SDSTATS_H_
+#define _SDSTATS_H_
+
+#include "port.h"
+
+#define SD_STATS                     1          // comment out to disable SD I/O latency statistics
+
+#define SD_STATS_SLOW_US             50000UL    // operations taking longer than this (in microseconds) are counted as slow
+#define SD_STATS_BUCKETS             8          // histogram buckets: <256us, <1ms, <4ms, <16ms, <65ms, <262ms, <1s, 1s and longer
+
+// operation types
+#define SD_OP_OPEN                   0
+#define SD_OP_READ                   1
+#define SD_OP_WRITE                  2
+#define SD_OP_SYNC                   3
+#define SD_OP_CLOSE                  4
+#define SD_OP_TYPES                  5
+
+#ifdef SD_STATS
+
+class SdStats
+{
+public:
+        SdStats();
+
+        // Account one operation started at t0 (micros()). File name (or path) is recorded for slow operations.
+        void Record(byte op, unsigned long t0, SdBaseFile *pFile, const char *path);
+
+        void Reset();
+        void EmitJSON(FILE* stream_file);
+
+private:
+
+        static const char * opName(byte op);      // returns string in program memory
+
+        // per operation type statistics
+        struct OpStats
+        {
+                uint32_t        count;
+                uint16_t        hist[SD_STATS_BUCKETS];         // saturating counters
+                uint16_t        slow;                           // number of slow operations
+                uint32_t        max_us;
+                char            max_fname[13];                  // file of the slowest operation
+        };
+
+        OpStats         ops[SD_OP_TYPES];
+
+        // last slow operation
+        byte            last_slow_op;
+        uint32_t        last_slow_us;
+        unsigned long   last_slow_time;                         // millis() of the last slow operation
+        char            last_slow_fname[13];
+};
+
+extern SdStats sdstats;
+
+// SdFile with latency accounting
+class TimedSdFile : public SdFile
+{
+public:
+        bool open(const char* path, uint8_t oflag = O_READ);
+        bool open(SdBaseFile* dirFile, const char* path, uint8_t oflag);
+        bool openNext(SdBaseFile* dirFile, uint8_t oflag);
+        bool createContiguous(SdBaseFile* dirFile, const char* path, uint32_t size);
+
+        int read();
+        int read(void* buf, size_t nbyte);
+        int16_t fgets(char* str, int16_t num, char* delim = 0);
+
+        size_t write(uint8_t b);
+        size_t write(const uint8_t* buf, size_t size);     // Print::write() override - print() and println() output
+        int write(const void* buf, size_t nbyte);
+
+        bool sync();
+        bool close();
+};
+
+#else   // SD_STATS
+
+typedef SdFile TimedSdFile;
+
+#endif  // SD_STATS
+
+#endif  // _SDSTATS_H_
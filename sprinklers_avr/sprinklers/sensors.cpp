@@ -36,6 +36,7 @@ limitations under the License.
 #include "port.h"
 #include <SFE_BMP180.h>
 #include <Wire.h>
+#include <util/atomic.h>
 
 // external reference
 extern Logging sdlog;
@@ -52,6 +53,18 @@ SFE_BMP180 bmp180;
 
 char pressure_MinTimer(void);
 char bmp180_Read(int *pressure, int *temperature);
+void wflow_SecTimer(void);
+
+#ifdef SENSOR_ENABLE_WATERFLOW
+// Water flow meter pulse counter, incremented by the interrupt handler.
+// Note: the counter is allowed to wrap, readers use the difference between snapshots.
+static volatile uint16_t  wflow_pulses = 0;
+
+static void wflow_ISR(void)
+{
+     wflow_pulses++;
+}
+#endif  //   SENSOR_ENABLE_WATERFLOW
 
 // initialization. Intended to be called from setup()
 //
@@ -70,6 +83,12 @@ byte Sensors::begin(void)
      }
 #endif  //   SENSOR_ENABLE_BMP180
 
+#ifdef SENSOR_ENABLE_WATERFLOW
+
+     pinMode(WFLOW_SENSOR_PIN, INPUT_PULLUP);
+     attachInterrupt(WFLOW_SENSOR_INTERRUPT, wflow_ISR, FALLING);
+#endif  //   SENSOR_ENABLE_WATERFLOW
+
      return true;
 }
 
@@ -79,9 +98,17 @@ byte Sensors::begin(void)
 byte Sensors::loop(void)
 {
        static unsigned long  old_millis = 0;
+       static unsigned long  old_sec_millis = 0;
        unsigned long  new_millis = millis();    // Note: we are using built-in Arduino millis() function instead of now() or time-zone adjusted LocalNow(), because it is a lot faster
                                                                   // and for detecting minutes changes it does not make any difference.
 
+       if( (new_millis - old_sec_millis) >= 1000 ){   // one second detection
+
+             old_sec_millis = new_millis;
+
+             wflow_SecTimer();
+       }
+
 //       if( (new_millis - old_millis) >= 10000 ){   // for now let's make it 10 sec
        if( (new_millis - old_millis) >= 60000 ){   // one minute detection
 
@@ -127,6 +154,56 @@ char pressure_MinTimer(void)
 }
 
 
+// timer worker for water flow sensor, called once a second.
+// Pulses are accumulated while water flow is detected. Record is logged when flow stops (no pulses for WFLOW_IDLE_TIMEOUT seconds),
+// or when the record covers WFLOW_LOG_INTERVAL seconds of continuous flow. No records are logged when there is no flow.
+
+void wflow_SecTimer(void)
+{
+#ifdef SENSOR_ENABLE_WATERFLOW
+
+     static uint16_t       last_count = 0;
+     static unsigned long  acc_pulses = 0;      // pulses in the current record
+     static unsigned int   duration = 0;        // seconds covered by the current record
+     static byte           idle = 0;            // seconds without pulses
+
+     uint16_t  count;
+
+     ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+     {
+           count = wflow_pulses;
+     }
+
+     uint16_t  delta = count - last_count;      // note: unsigned arithmetic handles counter wrap
+     last_count = count;
+
+     if( (delta == 0) && (acc_pulses == 0) )
+           return;      // no flow
+
+     duration++;
+
+     if( delta != 0 ){
+
+           acc_pulses += delta;
+           idle = 0;
+     }
+     else
+           idle++;
+
+     if( (idle >= WFLOW_IDLE_TIMEOUT) || (duration >= WFLOW_LOG_INTERVAL) ){
+
+           unsigned int  active = duration - idle;   // do not count trailing idle time
+
+           sdlog.LogWaterFlow(WFLOW_SENSOR_ID, (acc_pulses*100)/WFLOW_PULSES_PER_GALLON, active ? active : 1);
+
+           acc_pulses = 0;
+           duration = 0;
+           idle = 0;
+     }
+#endif  //   SENSOR_ENABLE_WATERFLOW
+}
+
+
 // Worker function to read bmp180 pressure sensor.
 // Returns true if successful, false if failed.
 char bmp180_Read(int *pressure, int *temperature)
@@ -50,10 +50,21 @@ limitations under the License.
 //
 //
 #define SENSOR_ENABLE_BMP180  1
+//#define SENSOR_ENABLE_WATERFLOW  1       // uncomment if a flow meter is connected to WFLOW_SENSOR_PIN
 
 // default repeat intervals, in minutes
 #define SENSORS_PRESSURE_DEFAULT_REPEAT 60
 
+// Water flow meter (pulse output flow sensor). Pulses are counted by the interrupt handler.
+// Wiring: sensor signal to WFLOW_SENSOR_PIN, sensor ground to board GND. The pin is configured with the internal pull-up, so
+// open collector (NPN) sensor outputs need no external resistor; pulses are counted on the falling edge.
+#define WFLOW_SENSOR_PIN             19         // Mega pin 19 (hardware INT2)
+#define WFLOW_SENSOR_INTERRUPT       4          // attachInterrupt() number for WFLOW_SENSOR_PIN on the Mega
+#define WFLOW_SENSOR_ID              1
+#define WFLOW_PULSES_PER_GALLON      1703       // sensor calibration (450 pulses per liter)
+#define WFLOW_LOG_INTERVAL           300        // max period (seconds) covered by one water flow record
+#define WFLOW_IDLE_TIMEOUT           10         // water flow is considered stopped after this many seconds without pulses
+
 class Sensors {
 public:
 
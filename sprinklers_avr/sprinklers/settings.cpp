@@ -136,20 +136,21 @@ bool SetSchedule(const KVPairs & key_value_pairs)
         for (int i = 0; i < key_value_pairs.num_pairs; i++)
         {
                 const char * key = key_value_pairs.keys[i];
+                const uint8_t key_id = key_value_pairs.key_ids[i];
                 const char * value = key_value_pairs.values[i];
-                if (strcmp_P(key, PSTR("id")) == 0)
+                if (key_id == KEY_ID)
                 {
                         sched_num = atoi(value);
                 }
-                else if (strcmp_P(key, PSTR("type")) == 0)
+                else if (key_id == KEY_TYPE)
                         sched.SetInterval(strcmp_P(value, PSTR("on")) != 0);
-                else if (strcmp_P(key, PSTR("enable")) == 0)
+                else if (key_id == KEY_ENABLE)
                         sched.SetEnabled(strcmp_P(value, PSTR("on")) == 0);
-                else if (strcmp_P(key, PSTR("wadj")) == 0)
+                else if (key_id == KEY_WADJ)
                         sched.SetWAdj(strcmp_P(value, PSTR("on")) == 0);
-                else if (strcmp_P(key, PSTR("name")) == 0)
+                else if (key_id == KEY_NAME)
                         strncpy(sched.name, value, sizeof(sched.name));
-                else if (strcmp_P(key, PSTR("interval")) == 0)
+                else if (key_id == KEY_INTERVAL)
                 {
                         if (sched.IsInterval())
                                 sched.interval = atoi(value);
@@ -230,9 +231,9 @@ bool DeleteSchedule(const KVPairs & key_value_pairs)
         // Iterate through the kv pairs and update the appropriate structure values.
         for (int i = 0; i < key_value_pairs.num_pairs; i++)
         {
-                const char * key = key_value_pairs.keys[i];
+                const uint8_t key = key_value_pairs.key_ids[i];
                 const char * value = key_value_pairs.values[i];
-                if (strcmp_P(key, PSTR("id")) == 0)
+                if (key == KEY_ID)
                 {
                         sched_num = atoi(value);
                 }
@@ -293,57 +294,57 @@ bool SetSettings(const KVPairs & key_value_pairs)
 {
         for (int i = 0; i < key_value_pairs.num_pairs; i++)
         {
-                const char * key = key_value_pairs.keys[i];
+                const uint8_t key = key_value_pairs.key_ids[i];
                 const char * value = key_value_pairs.values[i];
-                if (strcmp_P(key, PSTR("ip")) == 0)
+                if (key == KEY_IP)
                 {
                         SetIP(decodeIP(value));
                 }
-                else if (strcmp_P(key, PSTR("netmask")) == 0)
+                else if (key == KEY_NETMASK)
                 {
                         SetNetmask(decodeIP(value));
                 }
-                else if (strcmp_P(key, PSTR("gateway")) == 0)
+                else if (key == KEY_GATEWAY)
                 {
                         SetGateway(decodeIP(value));
                 }
-                else if (strcmp_P(key, PSTR("wuip")) == 0)
+                else if (key == KEY_WUIP)
                 {
                         SetWUIP(decodeIP(value));
                 }
-                else if (strcmp_P(key, PSTR("apikey")) == 0)
+                else if (key == KEY_APIKEY)
                 {
                         SetApiKey(value);
                 }
-                else if (strcmp_P(key, PSTR("zip")) == 0)
+                else if (key == KEY_ZIP)
                 {
                         SetZip(strtoul(value, 0, 10));
                 }
-                else if (strcmp_P(key, PSTR("NTPip")) == 0)
+                else if (key == KEY_NTPIP)
                 {
                         SetNTPIP(decodeIP(value));
                 }
-                else if (strcmp_P(key, PSTR("NTPoffset")) == 0)
+                else if (key == KEY_NTPOFFSET)
                 {
                         SetNTPOffset(atoi(value));
                 }
-                else if (strcmp_P(key, PSTR("ot")) == 0)
+                else if (key == KEY_OT)
                 {
                         SetOT((EOT)atoi(value));
                 }
-                else if (strcmp_P(key, PSTR("webport")) == 0)
+                else if (key == KEY_WEBPORT)
                 {
                         SetWebPort(atoi(value));
                 }
-                else if (strcmp_P(key, PSTR("sadj")) == 0)
+                else if (key == KEY_SADJ)
                 {
                         SetSeasonalAdjust(atoi(value));
                 }
-                else if (strcmp_P(key, PSTR("pws")) == 0)
+                else if (key == KEY_PWS)
                 {
                         SetPWS(value);
                 }
-                else if (strcmp_P(key, PSTR("wutype")) == 0)
+                else if (key == KEY_WUTYPE)
                 {
                         SetUsePWS(strcmp_P(value, PSTR("pws")) == 0);
                 }
@@ -16,9 +16,87 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "Event.h"
+#ifdef ARDUINO
+#include <utility/w5100.h>
+#endif
+
+// Connection states
+#define WEB_CONN_FREE 0                 // connection slot is not used
+#define WEB_CONN_IDLE 1                 // waiting for a request
+#define WEB_CONN_READING 2              // reading request header
+#define WEB_CONN_SENDING 3              // sending file data
+
+// Web connection. Request headers and file data are handled in time slices from ProcessWebClients(), so a slow client or
+// a large file does not hold up the main loop. Dynamic responses (JSON, log queries and listings) are not resumable: they are
+// generated to completion when the request is served, holding up the main loop and the other connections meanwhile.
+struct WebConnection
+{
+	EthernetClient client;
+	byte state;                     // WEB_CONN_xxx
+	bool bKeepAlive;                // keep the connection open after the response
+	bool bHttp11;                   // HTTP/1.1 request, chunked transfer encoding can be used in the response
+	bool bGzip;                     // client accepts gzip content encoding
+	unsigned long time;             // millis() of the last activity
+	TimedSdFile file;               // file being sent
+	uint32_t file_left;             // file data left to send
+#ifdef WEB_BENCHMARK
+	unsigned long send_start;       // millis() when file data sending started
+	uint32_t send_size;             // file data size
+	unsigned long send_sd_us;       // time spent reading the card
+	uint16_t send_waits;            // time slices without room in the socket transmit buffer
+#endif
+};
+
+static WebConnection connections[WEB_MAX_CONNECTIONS];
+
+#ifdef WEB_BENCHMARK
+#define WEB_BENCHMARK_LARGE_FILE 8192   // smaller files are not counted in the send throughput
+
+// Last large file sent
+static struct
+{
+	uint32_t size;
+	unsigned long ms;
+	unsigned long sd_us;
+	uint16_t waits;
+} lastSend;
+#endif
+
+// Receive buffer
+struct RecvBuffer
+{
+	char buf[100];  // note:  trial and error has shown that it doesn't help to increase this number.. few ms at the most.
+	char * ptr;
+	char * end;
+};
+
+// Request reader. Request header is read as data arrives, for one connection at a time - other clients' requests wait until
+// the reader is free. The request line is kept for parsing, from header lines only the few headers the server acts upon are
+// taken (see ParseHeaderLine()).
+struct RequestReader
+{
+	WebConnection * pConn;          // connection that owns the reader, NULL if the reader is free
+	RecvBuffer recv;                // received data not processed yet (the reader stays with the connection while there is any)
+	bool bHeaders;                  // request line is complete, reading header lines
+	bool bOverflow;                 // request line is too long
+	int len;                        // request line length
+	byte line_len;                  // header line length
+	char line[56];                  // start of the current header line
+	char if_none_match[24];         // conditional request headers (truncated)
+	char if_modified_since[30];
+	bool bRange;                    // single byte range requested
+	uint32_t range_first;           // first byte of the range, RANGE_NONE for the suffix form (last bytes of the file)
+	uint32_t range_last;            // last byte of the range (length of the suffix), RANGE_NONE if open-ended
+	char req[WEB_REQUEST_SIZE];     // request line (query string is decoded in place when the request is served)
+};
+
+static RequestReader reader;
+
+#define RANGE_NONE 0xFFFFFFFF
 
 // local forward declaration 
-static void ServeFile(FILE * stream_file, const char * fname, SdFile & theFile, EthernetClient & client);
+static bool CheckNameTables();
+static void ServeFile(FILE * stream_file, const char * fname, WebConnection * pConn, uint32_t data_size = 0xFFFFFFFF, bool bGzip = false);
 
 
 web::web(void)
@@ -38,6 +116,8 @@ bool web::Init()
 	uint16_t port = GetWebPort();
 	if ((port > 65000) || (port < 80))
 		port = 80;
+	if (!CheckNameTables())
+		trace(F("Web route/key hash tables do not match the names, rebuild them with tools/namehash.py\n"));
 	trace(F("Listening on Port %u\n"), port), 
 	m_server = new EthernetServer(port);
 #ifdef ARDUINO
@@ -50,32 +130,73 @@ bool web::Init()
 
 static char sendbuf[512];
 
+#define CONTENT_LENGTH_UNKNOWN 0xFFFFFFFF
+
+static bool bKeepAlive;         // keep the connection open after the response (persistent HTTP/1.1 connection)
+static bool bHttp11;            // current request is HTTP/1.1
+static bool bHeaderSent;        // response header was sent for the current request
+
 #ifdef ARDUINO
+// Responses of unknown length on persistent connections are sent with chunked transfer encoding. Each send buffer flush is one chunk:
+// space for the chunk size is reserved at the chunk start, and space for the chunk trailer and the last chunk - at the buffer end.
+#define CHUNK_HEADER_SIZE 6     // "XXXX\r\n"
+#define CHUNK_TRAILER_SIZE 7    // "\r\n" and the last chunk "0\r\n\r\n"
+
 static char * sendbufptr;
+static char * chunkptr;         // start of the current chunk in sendbuf, NULL if the response is not chunked
 static inline void setup_sendbuf()
 {
 	sendbufptr = sendbuf;
+	chunkptr = NULL;
+}
+
+static inline void start_chunk()
+{
+	chunkptr = sendbufptr;
+	sendbufptr += CHUNK_HEADER_SIZE;
 }
 
-static int flush_sendbuf(EthernetClient & client)
+// Send buffered data. For chunked responses the data is framed as a chunk, bLast adds the last (zero size) chunk.
+static int flush_sendbuf(EthernetClient & client, bool bLast = false)
 {
 	int ret = 0;
-	if (sendbufptr > sendbuf)
+	if (chunkptr)
 	{
-		ret = client.write((uint8_t*)sendbuf, sendbufptr-sendbuf);
-		setup_sendbuf();
+		int len = sendbufptr - chunkptr - CHUNK_HEADER_SIZE;
+		if (len > 0)
+		{
+			char hdr[CHUNK_HEADER_SIZE+1];
+			sprintf_P(hdr, PSTR("%04X\r\n"), len);
+			memcpy(chunkptr, hdr, CHUNK_HEADER_SIZE);
+			*(sendbufptr++) = '\r';
+			*(sendbufptr++) = '\n';
+		}
+		else
+			sendbufptr = chunkptr;          // empty chunk
+		if (bLast)
+		{
+			memcpy_P(sendbufptr, PSTR("0\r\n\r\n"), 5);
+			sendbufptr += 5;
+		}
 	}
+	if (sendbufptr > sendbuf)
+		ret = client.write((uint8_t*)sendbuf, sendbufptr-sendbuf);
+
+	sendbufptr = sendbuf;
+	if (chunkptr && !bLast)
+		start_chunk();
+	else
+		chunkptr = NULL;
 	return ret;
 }
 
 static int stream_putchar(char c, FILE *stream)
 {
-	if (sendbufptr >= sendbuf + sizeof(sendbuf))
+	if (sendbufptr >= sendbuf + sizeof(sendbuf) - (chunkptr ? CHUNK_TRAILER_SIZE : 0))
 	{
-		int send_len = ((EthernetClient*)(stream->udata))->write((uint8_t*)sendbuf, sizeof(sendbuf));
+		int send_len = flush_sendbuf(*(EthernetClient*)(stream->udata));
 		if (!send_len)
 		return 0;
-		setup_sendbuf();
 	}
 	*(sendbufptr++) = c;
 	return 1;
@@ -83,13 +204,41 @@ static int stream_putchar(char c, FILE *stream)
 #endif
 
 
-static void ServeHeader(FILE * stream_file, int code, const char * pReason, bool cache, char * type)
+// Response header. Content length is sent if known, otherwise the response on a persistent connection is chunked. HTTP/1.0 clients
+// do not know chunked encoding: responses of unknown length are ended by closing the connection.
+// Cacheable files are sent with their validators (etag and modified), if available.
+// Files accept byte ranges: range is "" for the complete file, or the Content-Range value of a partial response. NULL for other content.
+static void ServeHeader(FILE * stream_file, int code, const char * pReason, bool cache, char * type, uint32_t content_length, bool gzip,
+                        const char * etag, const char * modified, const char * range)
 {
-	fprintf_P(stream_file, PSTR("HTTP/1.1 %d %S\nContent-Type: %S\nConnection: close\n"), code, pReason, type);
-	if (cache)
-		fprintf_P(stream_file, PSTR("Last-Modified: Fri, 02 Jun 2006 09:46:32 GMT\nExpires: Sun, 17 Jan 2038 19:14:07 GMT\r\n\r\n"));
+	if ((content_length == CONTENT_LENGTH_UNKNOWN) && !bHttp11)
+		bKeepAlive = false;
+	fprintf_P(stream_file, PSTR("HTTP/1.1 %d %S\r\nContent-Type: %S\r\nConnection: %S\r\n"), code, pReason, type, bKeepAlive ? PSTR("keep-alive") : PSTR("close"));
+	if (gzip)
+		fprintf_P(stream_file, PSTR("Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n"));
+	if (content_length != CONTENT_LENGTH_UNKNOWN)
+		fprintf_P(stream_file, PSTR("Content-Length: %lu\r\n"), content_length);
+	else if (bKeepAlive)
+		fprintf_P(stream_file, PSTR("Transfer-Encoding: chunked\r\n"));
+	if (range != NULL)
+		fprintf_P(stream_file, *range ? PSTR("Accept-Ranges: bytes\r\nContent-Range: %s\r\n") : PSTR("Accept-Ranges: bytes\r\n"), range);
+	if (cache && (etag != NULL))
+		fprintf_P(stream_file, PSTR("ETag: %s\r\nLast-Modified: %s\r\nExpires: Sun, 17 Jan 2038 19:14:07 GMT\r\n\r\n"), etag, modified);
+	else if (cache)
+		fprintf_P(stream_file, PSTR("Last-Modified: Fri, 02 Jun 2006 09:46:32 GMT\r\nExpires: Sun, 17 Jan 2038 19:14:07 GMT\r\n\r\n"));
 	else
 		fprintf_P(stream_file, PSTR("Cache-Control: no-cache\r\n\r\n"));
+
+	bHeaderSent = true;
+#ifdef ARDUINO
+	if ((content_length == CONTENT_LENGTH_UNKNOWN) && bKeepAlive)
+		start_chunk();
+#endif
+}
+
+static void ServeHeader(FILE * stream_file, int code, const char * pReason, bool cache, char * type)
+{
+     ServeHeader(stream_file, code, pReason, cache, type, CONTENT_LENGTH_UNKNOWN, false, NULL, NULL, NULL);
 }
 
 static void ServeHeader(FILE * stream_file, int code, const char * pReason, bool cache)
@@ -100,6 +249,14 @@ static void ServeHeader(FILE * stream_file, int code, const char * pReason, bool
 
 
 
+// Bodiless response to a conditional request for a file that has not changed
+static void Serve304(FILE * stream_file, const char * etag, const char * modified)
+{
+	fprintf_P(stream_file, PSTR("HTTP/1.1 304 Not Modified\r\nConnection: %S\r\nETag: %s\r\nLast-Modified: %s\r\nExpires: Sun, 17 Jan 2038 19:14:07 GMT\r\n\r\n"),
+	                       bKeepAlive ? PSTR("keep-alive") : PSTR("close"), etag, modified);
+	bHeaderSent = true;
+}
+
 static void Serve404(FILE * stream_file)
 {
 	ServeHeader(stream_file, 404, PSTR("NOT FOUND"), false);
@@ -142,14 +299,24 @@ static void JSONZones(const KVPairs & key_value_pairs, FILE * stream_file)
 }
 
 #ifdef LOGGING
-static void ShowLogs(char *sPage, FILE * pFile, EthernetClient client)
+// Check if the file is a system log day index (binary file in the system logs directory)
+static bool IsSyslogIndex(const char *fname)
+{
+	const char *ext = strrchr(fname, '.');
+
+	return (ext != NULL) && (strncasecmp_P(ext, PSTR(".idx"), 4) == 0);
+}
+
+static void ShowLogs(char *sPage, FILE * pFile, WebConnection * pConn)
 {
 //   let's check what is it - log listing or a specific log file request
 
    if( sPage[4] == 0 || sPage[4] == ' ' || (sPage[4] == '/' && sPage[5] == ' ')){    // this is log listing - the string is either /logs or /logs/ with a spacebar after the last character
 
 // this is log listing request
-        SdFile logfile;
+        TimedSdFile logfile;
+
+        sdlog.Sync();     // flush cached log files, so listing shows actual sizes
 
 	trace(F("Serving logs directory listing\n"));
   
@@ -167,7 +334,7 @@ static void ShowLogs(char *sPage, FILE * pFile, EthernetClient client)
        while(true) {
 
             char fname[20] = {0};
-            SdFile entry;
+            TimedSdFile entry;
             if (!entry.openNext(&logfile, O_READ) ){
        // no more files
                   logfile.close();
@@ -177,7 +344,8 @@ static void ShowLogs(char *sPage, FILE * pFile, EthernetClient client)
             }
 
             entry.getFilename(fname);
-            fprintf_P( pFile, PSTR("<tr> <td> <a href=\"/logs/%s\">%s</a> </td> <td>&nbsp&nbsp</td> <td>%lu </td> </tr>"), fname, fname, entry.fileSize() ); 
+            if( !IsSyslogIndex(fname) )       // system log day indexes are internal files
+                  fprintf_P( pFile, PSTR("<tr> <td> <a href=\"/logs/%s\">%s</a> </td> <td>&nbsp&nbsp</td> <td>%lu </td> </tr>"), fname, fname, entry.fileSize() ); 
             entry.close();
        }
        logfile.close();
@@ -187,29 +355,47 @@ static void ShowLogs(char *sPage, FILE * pFile, EthernetClient client)
 
 	trace(F("Serving log file: %s\n"), sPage);
 
-	SdFile theFile;
+	sdlog.Sync();     // flush cached log files before reading
+
+	TimedSdFile & theFile = pConn->file;
 	if (!theFile.open(sPage, O_READ))
 		Serve404(pFile);
 	else
 	{
-		if (theFile.isFile())
-  		        ServeFile(pFile, sPage, theFile, client);
-		else  
+		if (!theFile.isFile())
 			Serve404(pFile);
+		else if (sdlog.IsBinarySensorLog(theFile))      // binary sensor logs are exported as CSV
+		{
+			ServeHeader(pFile, 200, PSTR("OK"), false, PSTR("text/plain"));
+			sdlog.ExportSensorLog(pFile, theFile);
+		}
+		else
+  		        ServeFile(pFile, sPage, pConn);
 
-		theFile.close();
+		if (pConn->state != WEB_CONN_SENDING)   // file is closed when its data is sent
+			theFile.close();
 	}
    }
 }
 
-static void ShowWateringLogs(char *sPage, FILE * pFile, EthernetClient client)
+// Check if the file is a watering summary (binary file in the watering logs directory)
+static bool IsWateringSummary(const char *fname)
+{
+	const char *ext = strrchr(fname, '.');
+
+	return (ext != NULL) && (strncasecmp_P(ext, PSTR(".bin"), 4) == 0);
+}
+
+static void ShowWateringLogs(char *sPage, FILE * pFile, WebConnection * pConn)
 {
 //   let's check what is it - log listing or a specific log file request
 
    if( sPage[12] == 0 || sPage[12] == ' ' || (sPage[12] == '/' && sPage[13] == ' ')){    // this is log listing - the string is either /logs or /logs/ with a spacebar after the last character
 
 // this is log listing request
-        SdFile logfile;
+        TimedSdFile logfile;
+
+        sdlog.Sync();     // flush cached log files, so listing shows actual sizes
 
 	trace(F("Serving watering logs directory listing\n"));
   
@@ -227,7 +413,7 @@ static void ShowWateringLogs(char *sPage, FILE * pFile, EthernetClient client)
        while(true) {
 
             char fname[20] = {0};
-            SdFile entry;
+            TimedSdFile entry;
             if (!entry.openNext(&logfile, O_READ) ){
        // no more files
                   logfile.close();
@@ -237,7 +423,8 @@ static void ShowWateringLogs(char *sPage, FILE * pFile, EthernetClient client)
             }
 
             entry.getFilename(fname);
-            fprintf_P( pFile, PSTR("<tr> <td> <a href=\"/watering.log/%s\">%s</a> </td> <td>&nbsp&nbsp</td> <td>%lu </td> </tr>"), fname, fname, entry.fileSize() ); 
+            fprintf_P( pFile, PSTR("<tr> <td> <a href=\"/watering.log/%s\">%s</a> </td> <td>&nbsp&nbsp</td> <td>%lu </td> </tr>"), fname, fname,
+                                 IsWateringSummary(fname) ? entry.fileSize() : sdlog.LogDataSize(entry) );    // note: watering logs could be preallocated
             entry.close();
        }
        logfile.close();
@@ -247,17 +434,20 @@ static void ShowWateringLogs(char *sPage, FILE * pFile, EthernetClient client)
 
 	trace(F("Serving watering log file: %s\n"), sPage);
 
-	SdFile theFile;
+	sdlog.Sync();     // flush cached log files before reading
+
+	TimedSdFile & theFile = pConn->file;
 	if (!theFile.open(sPage, O_READ))
 		Serve404(pFile);
 	else
 	{
 		if (theFile.isFile())
-  		        ServeFile(pFile, sPage, theFile, client);
+  		        ServeFile(pFile, sPage, pConn, IsWateringSummary(sPage) ? theFile.fileSize() : sdlog.LogDataSize(theFile));    // preallocated watering logs are served up to the end of data
 		else  
 			Serve404(pFile);
 
-		theFile.close();
+		if (pConn->state != WEB_CONN_SENDING)   // file is closed when its data is sent
+			theFile.close();
 	}
    }
 }
@@ -274,29 +464,30 @@ static void JSONSensor(const KVPairs & key_value_pairs, FILE * stream_file)
         char  sensor_type = 0;
         int     sensor_id     = 0;
         char  summary_type = LOG_SUMMARY_NONE;
+        int     max_points = 0;
 
 	// Iterate through the kv pairs and search for the start and end dates.
 	for (int i = 0; i < key_value_pairs.num_pairs; i++)
 	{
-		const char * key = key_value_pairs.keys[i];
+		const uint8_t key = key_value_pairs.key_ids[i];
 		const char * value = key_value_pairs.values[i];
-		if (strcmp_P(key, PSTR("sdate")) == 0)
+		if (key == KEY_SDATE)
 		{
 			sdate = strtol(value, 0, 10);
 		}
-		else if (strcmp_P(key, PSTR("edate")) == 0)
+		else if (key == KEY_EDATE)
 		{
 			edate = strtol(value, 0, 10);
 		}
-		else if (strcmp_P(key, PSTR("type")) == 0)
+		else if (key == KEY_TYPE)
 		{
 			sensor_type = atoi(value);
 		}
-		else if (strcmp_P(key, PSTR("id")) == 0)
+		else if (key == KEY_ID)
 		{
 			sensor_id = atoi(value);
 		}
-		else if (strcmp_P(key, PSTR("sum")) == 0)
+		else if (key == KEY_SUM)
 		{
 			if (value[0] == 'd')
 				summary_type = LOG_SUMMARY_DAY;
@@ -305,9 +496,47 @@ static void JSONSensor(const KVPairs & key_value_pairs, FILE * stream_file)
 			else if (value[0] == 'm')
 				summary_type = LOG_SUMMARY_MONTH;
 		}
+		else if (key == KEY_MAX_POINTS)
+		{
+			max_points = atoi(value);
+		}
+	}
+
+	sdlog.EmitSensorLog(stream_file, sdate, edate, sensor_type, sensor_id, summary_type, max_points);
+	fprintf_P(stream_file, PSTR("}"));
+}
+
+// Query water flow readings
+
+static void JSONWaterFlow(const KVPairs & key_value_pairs, FILE * stream_file)
+{
+	ServeHeader(stream_file, 200, PSTR("OK"), false, PSTR("text/plain"));
+	fprintf_P(stream_file, PSTR("{\n"));
+
+	time_t sdate = 0;
+	time_t edate = 0;
+        int     sensor_id     = 1;
+
+	// Iterate through the kv pairs and search for the start and end dates.
+	for (int i = 0; i < key_value_pairs.num_pairs; i++)
+	{
+		const uint8_t key = key_value_pairs.key_ids[i];
+		const char * value = key_value_pairs.values[i];
+		if (key == KEY_SDATE)
+		{
+			sdate = strtol(value, 0, 10);
+		}
+		else if (key == KEY_EDATE)
+		{
+			edate = strtol(value, 0, 10);
+		}
+		else if (key == KEY_ID)
+		{
+			sensor_id = atoi(value);
+		}
 	}
 
-	sdlog.EmitSensorLog(stream_file, sdate, edate, sensor_type, sensor_id, summary_type);
+	sdlog.EmitWaterFlowLog(stream_file, sdate, edate, sensor_id);
 	fprintf_P(stream_file, PSTR("}"));
 }
 
@@ -322,17 +551,17 @@ static void JSONLogs(const KVPairs & key_value_pairs, FILE * stream_file)
 	// Iterate through the kv pairs and search for the start and end dates.
 	for (int i = 0; i < key_value_pairs.num_pairs; i++)
 	{
-		const char * key = key_value_pairs.keys[i];
+		const uint8_t key = key_value_pairs.key_ids[i];
 		const char * value = key_value_pairs.values[i];
-		if (strcmp_P(key, PSTR("sdate")) == 0)
+		if (key == KEY_SDATE)
 		{
 			sdate = strtol(value, 0, 10);
 		}
-		else if (strcmp_P(key, PSTR("edate")) == 0)
+		else if (key == KEY_EDATE)
 		{
 			edate = strtol(value, 0, 10);
 		}
-		else if (strcmp_P(key, PSTR("g")) == 0)
+		else if (key == KEY_G)
 		{
 			if (value[0] == 'h')
 				grouping = Logging::HOURLY;
@@ -356,13 +585,13 @@ static void JSONtLogs(const KVPairs & key_value_pairs, FILE * stream_file)
 	// Iterate through the kv pairs and search for the start and end dates.
 	for (int i = 0; i < key_value_pairs.num_pairs; i++)
 	{
-		const char * key = key_value_pairs.keys[i];
+		const uint8_t key = key_value_pairs.key_ids[i];
 		const char * value = key_value_pairs.values[i];
-		if (strcmp_P(key, PSTR("sdate")) == 0)
+		if (key == KEY_SDATE)
 		{
 			sdate = strtol(value, 0, 10);
 		}
-		else if (strcmp_P(key, PSTR("edate")) == 0)
+		else if (key == KEY_EDATE)
 		{
 			edate = strtol(value, 0, 10);
 		}
@@ -371,6 +600,154 @@ static void JSONtLogs(const KVPairs & key_value_pairs, FILE * stream_file)
 	fprintf_P(stream_file, PSTR("\t]\n}"));
 }
 
+// Graph series and table rows for the Logs page, from one pass over the watering logs
+static void JSONwLogs(const KVPairs & key_value_pairs, FILE * stream_file)
+{
+	ServeHeader(stream_file, 200, PSTR("OK"), false, PSTR("text/plain"));
+	fprintf_P(stream_file, PSTR("{\n\t\"logs\": ["));
+
+	time_t sdate = 0;
+	time_t edate = 0;
+	Logging::GROUPING grouping = Logging::NONE;
+	// Iterate through the kv pairs and search for the start and end dates, and grouping.
+	for (int i = 0; i < key_value_pairs.num_pairs; i++)
+	{
+		const uint8_t key = key_value_pairs.key_ids[i];
+		const char * value = key_value_pairs.values[i];
+		if (key == KEY_SDATE)
+		{
+			sdate = strtol(value, 0, 10);
+		}
+		else if (key == KEY_EDATE)
+		{
+			edate = strtol(value, 0, 10);
+		}
+		else if (key == KEY_G)
+		{
+			if (value[0] == 'h')
+				grouping = Logging::HOURLY;
+			else if (value[0] == 'd')
+				grouping = Logging::DAILY;
+			else if (value[0] == 'm')
+				grouping = Logging::MONTHLY;
+		}
+	}
+
+	sdlog.WateringHistory(stream_file, sdate, edate, grouping);
+	fprintf_P(stream_file, PSTR("\n\t]\n}"));
+}
+
+#ifdef LOG_BENCHMARK
+// Log scan throughput benchmark (writes and removes a synthetic log file)
+static void JSONLogBench(const KVPairs & key_value_pairs, FILE * stream_file)
+{
+	ServeHeader(stream_file, 200, PSTR("OK"), false, PSTR("text/plain"));
+	fprintf_P(stream_file, PSTR("{\n"));
+	sdlog.BenchmarkScan(stream_file);
+	fprintf_P(stream_file, PSTR("}"));
+}
+#endif
+
+#ifdef SD_STATS
+// SD card I/O latency statistics, reset=1 clears the statistics after reporting
+static void JSONSdStats(const KVPairs & key_value_pairs, FILE * stream_file)
+{
+	ServeHeader(stream_file, 200, PSTR("OK"), false, PSTR("text/plain"));
+	fprintf_P(stream_file, PSTR("{\n"));
+	sdstats.EmitJSON(stream_file);
+	sdlog.EmitCacheStats(stream_file);
+	fprintf_P(stream_file, PSTR("}"));
+	for (int i = 0; i < key_value_pairs.num_pairs; i++)
+	{
+		if ((key_value_pairs.key_ids[i] == KEY_RESET) && (atoi(key_value_pairs.values[i]) == 1))
+			sdstats.Reset();
+	}
+}
+#endif
+
+// System log events in the time range, filtered by severity (type) and substring (q), paginated with the cursor returned by the previous page
+static void JSONSyslog(const KVPairs & key_value_pairs, FILE * stream_file)
+{
+	ServeHeader(stream_file, 200, PSTR("OK"), false, PSTR("text/plain"));
+	fprintf_P(stream_file, PSTR("{\n"));
+	time_t sdate = 0;
+	time_t edate = 0;
+	char severity = 0;
+	const char * text = NULL;
+	uint32_t cursor_month = 0;
+	uint32_t cursor_offset = 0;
+	int n = 20;
+	for (int i = 0; i < key_value_pairs.num_pairs; i++)
+	{
+		const uint8_t key = key_value_pairs.key_ids[i];
+		const char * value = key_value_pairs.values[i];
+		if (key == KEY_SDATE)
+		{
+			sdate = strtol(value, 0, 10);
+		}
+		else if (key == KEY_EDATE)
+		{
+			edate = strtol(value, 0, 10);
+		}
+		else if (key == KEY_TYPE)
+		{
+			severity = atoi(value);
+		}
+		else if (key == KEY_Q)
+		{
+			text = value;
+		}
+		else if (key == KEY_CURSOR)
+		{
+			if (sscanf_P(value, PSTR("%6lu.%lu"), &cursor_month, &cursor_offset) != 2)
+				cursor_month = 0;
+		}
+		else if (key == KEY_N)
+		{
+			n = atoi(value);
+		}
+	}
+	sdlog.QuerySyslog(stream_file, sdate, edate, severity, text, cursor_month, cursor_offset, n);
+	fprintf_P(stream_file, PSTR("}"));
+}
+
+// Newest watering records (log=w, optional zone filter) or system log events (log=s, optional event type filter)
+static void JSONTail(const KVPairs & key_value_pairs, FILE * stream_file)
+{
+	ServeHeader(stream_file, 200, PSTR("OK"), false, PSTR("text/plain"));
+	fprintf_P(stream_file, PSTR("{\n"));
+	char log_type = 'w';
+	int zone = 0;
+	char evt_type = 0;
+	int n = 10;
+	for (int i = 0; i < key_value_pairs.num_pairs; i++)
+	{
+		const uint8_t key = key_value_pairs.key_ids[i];
+		const char * value = key_value_pairs.values[i];
+		if (key == KEY_LOG)
+		{
+			log_type = value[0];
+		}
+		else if (key == KEY_ZONE)
+		{
+			zone = atoi(value);
+		}
+		else if (key == KEY_TYPE)
+		{
+			evt_type = atoi(value);
+		}
+		else if (key == KEY_N)
+		{
+			n = atoi(value);
+		}
+	}
+	if (log_type == 's')
+		sdlog.TailSyslog(stream_file, evt_type, n);
+	else
+		sdlog.TailWatering(stream_file, zone, n);
+	fprintf_P(stream_file, PSTR("}"));
+}
+
 #endif  //LOGGING
 
 static void JSONSettings(const KVPairs & key_value_pairs, FILE * stream_file)
@@ -456,9 +833,9 @@ static void JSONSchedule(const KVPairs & key_value_pairs, FILE * stream_file)
 	// Iterate through the kv pairs and search for the id.
 	for (int i = 0; i < key_value_pairs.num_pairs; i++)
 	{
-		const char * key = key_value_pairs.keys[i];
+		const uint8_t key = key_value_pairs.key_ids[i];
 		const char * value = key_value_pairs.values[i];
-		if (strcmp_P(key, PSTR("id")) == 0)
+		if (key == KEY_ID)
 		{
 			sched_num = atoi(value);
 		}
@@ -518,12 +895,13 @@ static bool SetQSched(const KVPairs & key_value_pairs)
 	for (int i = 0; i < key_value_pairs.num_pairs; i++)
 	{
 		const char * key = key_value_pairs.keys[i];
+		const uint8_t key_id = key_value_pairs.key_ids[i];
 		const char * value = key_value_pairs.values[i];
 		if ((key[0] == 'z') && (key[1] > 'a') && (key[1] <= ('a' + NUM_ZONES)) && (key[2] == 0))
 		{
 			quickSchedule.zone_duration[key[1] - 'b'] = atoi(value);
 		}
-		if (strcmp_P(key, PSTR("sched")) == 0)
+		if (key_id == KEY_SCHED)
 		{
 			sched = atoi(value);
 		}
@@ -616,9 +994,9 @@ static bool RunSchedules(const KVPairs & key_value_pairs)
 	// Iterate through the kv pairs and update the appropriate structure values.
 	for (int i = 0; i < key_value_pairs.num_pairs; i++)
 	{
-		const char * key = key_value_pairs.keys[i];
+		const uint8_t key = key_value_pairs.key_ids[i];
 		const char * value = key_value_pairs.values[i];
-		if (strcmp_P(key, PSTR("system")) == 0)
+		if (key == KEY_SYSTEM)
 		{
 			SetRunSchedules(strcmp_P(value, PSTR("on")) == 0);
 		}
@@ -639,13 +1017,13 @@ static bool ManualZone(const KVPairs & key_value_pairs)
 	// Iterate through the kv pairs and update the appropriate structure values.
 	for (int i = 0; i < key_value_pairs.num_pairs; i++)
 	{
-		const char * key = key_value_pairs.keys[i];
+		const uint8_t key = key_value_pairs.key_ids[i];
 		const char * value = key_value_pairs.values[i];
-		if ((strcmp_P(key, PSTR("zone")) == 0) && (value[0] == 'z') && (value[1] > 'a') && (value[1] <= ('a' + NUM_ZONES)))
+		if ((key == KEY_ZONE) && (value[0] == 'z') && (value[1] > 'a') && (value[1] <= ('a' + NUM_ZONES)))
 		{
 			iZoneNum = value[1] - 'a';
 		}
-		else if (strcmp_P(key, PSTR("state")) == 0)
+		else if (key == KEY_STATE)
 		{
 			if (strcmp_P(value, PSTR("on")) == 0)
 				bOn = true;
@@ -666,10 +1044,65 @@ static bool ManualZone(const KVPairs & key_value_pairs)
 	return true;
 }
 
-static void ServeFile(FILE * stream_file, const char * fname, SdFile & theFile, EthernetClient & client)
+// Time (UTC) of the FAT timestamp. File timestamps are in local time, NTP offset of the controller is applied.
+static time_t FatTimeUTC(uint16_t fat_date, uint16_t fat_time)
+{
+	tmElements_t tm;
+	tm.Year = FAT_YEAR(fat_date) - 1970;  tm.Month = max(FAT_MONTH(fat_date), 1);  tm.Day = max(FAT_DAY(fat_date), 1);
+	tm.Hour = FAT_HOUR(fat_time);  tm.Minute = FAT_MINUTE(fat_time);  tm.Second = FAT_SECOND(fat_time);
+
+	return makeTime(tm) - (long)GetNTPOffset()*3600;
+}
+
+// HTTP date (RFC 1123) of the UTC time, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+static void HttpDate(char * buf, time_t t)
+{
+	tmElements_t tm;
+	breakTime(t, tm);
+
+	char wday[4], mon[4];
+	strncpy_P(wday, PSTR("SunMonTueWedThuFriSat") + 3*(tm.Wday - 1), 3);
+	strncpy_P(mon, PSTR("JanFebMarAprMayJunJulAugSepOctNovDec") + 3*(tm.Month - 1), 3);
+	wday[3] = mon[3] = 0;
+
+	sprintf_P(buf, PSTR("%s, %02u %s %u %02u:%02u:%02u GMT"), wday, tm.Day, mon, tm.Year + 1970, tm.Hour, tm.Minute, tm.Second);
+}
+
+// Parse HTTP date in the RFC 1123 format (the format clients echo back in If-Modified-Since). Returns 0 if the date is not valid.
+static time_t ParseHttpDate(const char * str)
+{
+	const char * months = PSTR("JanFebMarAprMayJunJulAugSepOctNovDec");
+	unsigned int nday, nyear, nhour, nminute, nsecond;
+	char mon[4];
+
+	str = strchr(str, ',');
+	if ((str == NULL) || (sscanf_P(str + 1, PSTR("%u %3s %u %u:%u:%u"), &nday, mon, &nyear, &nhour, &nminute, &nsecond) != 6))
+		return 0;
+
+	for (byte i = 0; i < 12; i++)
+		if (strncmp_P(mon, months + 3*i, 3) == 0)
+		{
+			if ((nday < 1) || (nday > 31) || (nyear < 1970) || (nhour > 23) || (nminute > 59) || (nsecond > 59))
+				return 0;
+
+			tmElements_t tm;
+			tm.Year = nyear - 1970;  tm.Month = i + 1;  tm.Day = nday;
+			tm.Hour = nhour;  tm.Minute = nminute;  tm.Second = nsecond;
+			return makeTime(tm);
+		}
+
+	return 0;
+}
+
+// Serve the file opened in the connection file. Only the header is sent here, file data is sent by the connection in time slices
+// (see SendFileData()). Content type is taken from fname, bGzip is set if the file is a gzip-compressed copy.
+static void ServeFile(FILE * stream_file, const char * fname, WebConnection * pConn, uint32_t data_size, bool bGzip)
 {
+	TimedSdFile & theFile = pConn->file;
 	freeMemory();
 	const char * ext;
+	char * type = PSTR("text/html");
+	bool cache = true;
 	for (ext=fname + strlen(fname); ext>fname; ext--)
 		if (*ext == '.')
 		{
@@ -679,40 +1112,164 @@ static void ServeFile(FILE * stream_file, const char * fname, SdFile & theFile,
 	if (ext > fname)
 	{
 		if (strcmp_P(ext, PSTR("htm")) == 0)                    // accelerate checks for common case - HTML
-			ServeHeader(stream_file, 200, PSTR("OK"), true);
+			type = PSTR("text/html");
 		else if (strcmp_P(ext, PSTR("js")) == 0)
-			ServeHeader(stream_file, 200, PSTR("OK"), true, PSTR("application/javascript"));
+			type = PSTR("application/javascript");
 		else if (strcmp_P(ext, PSTR("jpg")) == 0)
-			ServeHeader(stream_file, 200, PSTR("OK"), true, PSTR("image/jpeg"));
+			type = PSTR("image/jpeg");
 		else if (strcmp_P(ext, PSTR("gif")) == 0)
-			ServeHeader(stream_file, 200, PSTR("OK"), true, PSTR("image/gif"));
+			type = PSTR("image/gif");
 		else if (strcmp_P(ext, PSTR("css")) == 0)
-			ServeHeader(stream_file, 200, PSTR("OK"), true, PSTR("text/css"));
+			type = PSTR("text/css");
 		else if (strcmp_P(ext, PSTR("ico")) == 0)
-			ServeHeader(stream_file, 200, PSTR("OK"), true, PSTR("image/x-icon"));
+			type = PSTR("image/x-icon");
 		else if ( (strcmp_P(ext, PSTR("log")) == 0) || (strcmp_P(ext, PSTR("LOG")) == 0))
-			ServeHeader(stream_file, 200, PSTR("OK"), false, PSTR("text/plain"));
+		{
+			type = PSTR("text/plain");
+			cache = false;
+		}
 		else if ( ext[0] == '0' && ext[1] == '0' )
-			ServeHeader(stream_file, 200, PSTR("OK"), false, PSTR("text/plain"));
-		else
-			ServeHeader(stream_file, 200, PSTR("OK"), true);
+		{
+			type = PSTR("text/plain");
+			cache = false;
+		}
 	}
-	else
-		ServeHeader(stream_file, 200, PSTR("OK"), true);
 
+	data_size = min(data_size, theFile.fileSize() - theFile.curPosition());
+
+// validators of cacheable files - ETag from the file size and modification time, and Last-Modified
+	dir_t dir;
+	char etag[24];
+	char modified[30];
+	bool bValidators = cache && theFile.dirEntry(&dir);
+
+	if (bValidators)
+	{
+		time_t t_modified = FatTimeUTC(dir.lastWriteDate, dir.lastWriteTime);
+		time_t t_since = ParseHttpDate(reader.if_modified_since);
+
+		sprintf_P(etag, PSTR("\"%lx-%x-%x\""), dir.fileSize, dir.lastWriteDate, dir.lastWriteTime);
+		HttpDate(modified, t_modified);
+
+		if (reader.if_none_match[0] ? (strstr(reader.if_none_match, etag) != NULL) : ((t_since != 0) && (t_modified <= t_since)))
+		{
+			Serve304(stream_file, etag, modified);
+			return;         // file is closed by the caller
+		}
+	}
+
+// single byte range - the file is positioned at the first byte and only the range is sent
+	if (reader.bRange)
+	{
+		uint32_t first = reader.range_first;
+		uint32_t last = data_size - 1;
+		char content_range[40];
+
+		if (first == RANGE_NONE)                        // suffix range - last bytes of the file
+		{
+			first = (reader.range_last < data_size) ? data_size - reader.range_last : 0;
+			if (reader.range_last == 0)
+				first = data_size;
+		}
+		else if (reader.range_last < last)
+			last = reader.range_last;
+
+		if ((first >= data_size) || (first > last))
+		{
+			sprintf_P(content_range, PSTR("bytes */%lu"), data_size);
+			ServeHeader(stream_file, 416, PSTR("Range Not Satisfiable"), false, PSTR("text/plain"), 0, false, NULL, NULL, content_range);
+			return;         // file is closed by the caller
+		}
+		if (!theFile.seekSet(theFile.curPosition() + first))
+		{
+			trace(F("ServeFile - seek error\n"));
+			Serve404(stream_file);
+			return;
+		}
+		sprintf_P(content_range, PSTR("bytes %lu-%lu/%lu"), first, last, data_size);
+		data_size = last - first + 1;
+		ServeHeader(stream_file, 206, PSTR("Partial Content"), cache, type, data_size, bGzip, bValidators ? etag : NULL, modified, content_range);
+	}
+	else
+		ServeHeader(stream_file, 200, PSTR("OK"), cache, type, data_size, bGzip, bValidators ? etag : NULL, modified, "");
 
 #ifdef ARDUINO
-	flush_sendbuf(client);
+	flush_sendbuf(pConn->client);
 #else
 	fflush(stream_file);
 #endif
-	while (theFile.available())
+	pConn->file_left = data_size;
+	pConn->state = WEB_CONN_SENDING;
+#ifdef WEB_BENCHMARK
+	pConn->send_start = millis();
+	pConn->send_size = data_size;
+	pConn->send_sd_us = 0;
+	pConn->send_waits = 0;
+#endif
+}
+
+#ifdef ARDUINO
+// Free space in the connection socket transmit buffer
+static uint16_t TxFreeSize(EthernetClient & client)
+{
+	for (uint8_t sock = 0; sock < MAX_SOCK_NUM; sock++)
+		if (EthernetClient(sock) == client)
+			return W5100.getTXFreeSize(sock);
+	return 0;
+}
+#endif
+
+// Send file data, as much as the socket transmit buffer takes (up to WEB_TX_BUFFER_SIZE per time slice), without waiting for space in it.
+// File data is read in whole card blocks (after the first block of a range), which SdFat reads straight into sendbuf, and a block is read
+// only when the socket can take all of it. sendbuf and the W5100 transmit buffer work as a double buffer: blocks written to the socket
+// are sent by the W5100 while the next block is read from the card. Returns true when all data is sent.
+static bool SendFileData(WebConnection * pConn)
+{
+	uint16_t sent = 0;
+
+	while ((pConn->file_left > 0) && (sent < WEB_TX_BUFFER_SIZE))
 	{
-		int bytes = theFile.read(sendbuf, 512);
+		uint16_t len = sizeof(sendbuf) - (uint16_t) (pConn->file.curPosition() % sizeof(sendbuf));     // up to the card block boundary
+		len = min(pConn->file_left, len);
+#ifdef ARDUINO
+		if (TxFreeSize(pConn->client) < len)
+		{
+#ifdef WEB_BENCHMARK
+			if (sent == 0)
+				pConn->send_waits++;
+#endif
+			break;          // previous blocks are still in the socket buffer, this one goes in a later time slice
+		}
+#endif
+#ifdef WEB_BENCHMARK
+		unsigned long t0 = micros();
+#endif
+		int bytes = pConn->file.read(sendbuf, len);
+#ifdef WEB_BENCHMARK
+		pConn->send_sd_us += micros() - t0;
+#endif
 		if (bytes <= 0)
-			break;
-		client.write((uint8_t*) sendbuf, bytes);
+		{
+			pConn->bKeepAlive = false;      // Content-Length cannot be met, the client will see the connection closed
+			return true;
+		}
+		pConn->client.write((uint8_t*) sendbuf, bytes);
+		pConn->file_left -= bytes;
+		sent += bytes;
+	}
+	if (sent > 0)
+		pConn->time = millis();
+
+#ifdef WEB_BENCHMARK
+	if ((pConn->file_left == 0) && (pConn->send_size >= WEB_BENCHMARK_LARGE_FILE))
+	{
+		lastSend.size = pConn->send_size;
+		lastSend.ms = millis() - pConn->send_start;
+		lastSend.sd_us = pConn->send_sd_us;
+		lastSend.waits = pConn->send_waits;
 	}
+#endif
+	return pConn->file_left == 0;
 }
 
 // change a character represented hex digit (0-9, a-f, A-F) to the numeric value
@@ -734,225 +1291,567 @@ static inline char hex2int(const char ch)
 		return 0;
 }
 
-//  Pass in a connected client, and this function will parse the HTTP header and return the requested page 
-//   and a KV pairs structure for the variable assignments.
-static bool ParseHTTPHeader(EthernetClient & client, KVPairs * key_value_pairs, char * sPage, int iPageSize)
+
+static void CopyHeaderValue(char * dst, const char * value, size_t size)
 {
-	enum
+	while (*value == ' ')
+		value++;
+	strncpy(dst, value, size - 1);
+	dst[size - 1] = 0;
+}
+
+// Check HTTP version or header line for the connection persistence, accepted content encodings and conditional request headers.
+static void ParseHeaderLine(char * line, int len, WebConnection * pConn)
+{
+	line[len] = 0;
+	if (strncmp_P(line, PSTR("HTTP/1.1"), 8) == 0)
+		pConn->bKeepAlive = pConn->bHttp11 = true;      // HTTP/1.1 connections are persistent by default
+	else if (strncasecmp_P(line, PSTR("Connection:"), 11) == 0)
 	{
-		INITIALIZED = 0, PARSING_PAGE, PARSING_KEY, PARSING_VALUE, PARSING_VALUE_PERCENT, PARSING_VALUE_PERCENT1, LOOKING_FOR_BLANKLINE, FOUND_BLANKLINE, DONE, ERROR
-	} current_state = INITIALIZED;
-	// an http request ends with a blank line
-	static const char get_text[] = "GET /";
-	const char * gettext_ptr = get_text;
-	char * page_ptr = sPage;
-	key_value_pairs->num_pairs = 0;
-	char * key_ptr = key_value_pairs->keys[0];
-	char * value_ptr = key_value_pairs->values[0];
-	char recvbuf[100];  // note:  trial and error has shown that it doesn't help to increase this number.. few ms at the most.
-	char * recvbufptr = recvbuf;
-	char * recvbufend = recvbuf;
+		char * p = line + 11;
+		while (*p == ' ')
+			p++;
+		if (strncasecmp_P(p, PSTR("close"), 5) == 0)
+			pConn->bKeepAlive = false;
+		else if (strncasecmp_P(p, PSTR("keep-alive"), 10) == 0)
+			pConn->bKeepAlive = true;
+	}
+	else if (strncasecmp_P(line, PSTR("Accept-Encoding:"), 16) == 0)
+	{
+		for (char * p = line + 16; *p; p++)
+			if (strncasecmp_P(p, PSTR("gzip"), 4) == 0)
+				pConn->bGzip = true;
+	}
+	else if (strncasecmp_P(line, PSTR("If-None-Match:"), 14) == 0)
+		CopyHeaderValue(reader.if_none_match, line + 14, sizeof(reader.if_none_match));
+	else if (strncasecmp_P(line, PSTR("If-Modified-Since:"), 18) == 0)
+		CopyHeaderValue(reader.if_modified_since, line + 18, sizeof(reader.if_modified_since));
+	else if (strncasecmp_P(line, PSTR("Range:"), 6) == 0)
+	{
+		char * p = line + 6;
+		while (*p == ' ')
+			p++;
+		if ((strncasecmp_P(p, PSTR("bytes="), 6) != 0) || (strchr(p, ',') != NULL))
+			return;         // multiple ranges are not supported, the complete file is sent
+
+		p += 6;
+		reader.range_first = isdigit(*p) ? strtoul(p, &p, 10) : RANGE_NONE;
+		if (*(p++) != '-')
+			return;
+		reader.range_last = isdigit(*p) ? strtoul(p, NULL, 10) : RANGE_NONE;
+		reader.bRange = (reader.range_first != RANGE_NONE) || (reader.range_last != RANGE_NONE);
+	}
+}
+
+// Read the request header as far as received data goes, without waiting for more data. Returns true when the header is complete.
+static bool ReadRequest(WebConnection * pConn)
+{
 	while (true)
 	{
-		if (recvbufptr >= recvbufend)
+		if (reader.recv.ptr >= reader.recv.end)
 		{
-			int len = client.read((uint8_t*) recvbuf, sizeof(recvbuf));
+			int len = pConn->client.read((uint8_t*) reader.recv.buf, sizeof(reader.recv.buf));
 			if (len <= 0)
+				return false;
+			reader.recv.ptr = reader.recv.buf;
+			reader.recv.end = reader.recv.buf + len;
+		}
+		char c = *(reader.recv.ptr++);
+
+		if (c == '\r')
+			continue;
+		if (!reader.bHeaders)
+		{
+			if (c == '\n')
 			{
-				if (!client.connected())
-					break;
-				else
-					continue;
+				reader.req[reader.len] = 0;
+				reader.bHeaders = true;
+				reader.line_len = 0;
+
+				char * version = strrchr(reader.req, ' ');
+				pConn->bKeepAlive = pConn->bHttp11 = pConn->bGzip = false;
+				reader.if_none_match[0] = reader.if_modified_since[0] = 0;
+				reader.bRange = false;
+				if (version != NULL)
+					ParseHeaderLine(version + 1, strlen(version + 1), pConn);
 			}
+			else if (reader.len < WEB_REQUEST_SIZE - 1)
+				reader.req[reader.len++] = c;
 			else
-			{
-				recvbufptr = recvbuf;
-				recvbufend = recvbuf + len;
-			}
+				reader.bOverflow = true;
 		}
-		char c = *(recvbufptr++);
-		//Serial.print(c);
+		else if (c == '\n')
+		{
+			if (reader.line_len == 0)
+				return true;            // blank line - end of the header
+			ParseHeaderLine(reader.line, reader.line_len, pConn);
+			reader.line_len = 0;
+		}
+		else if (reader.line_len < sizeof(reader.line) - 1)
+			reader.line[reader.line_len++] = c;
+	}
+}
+
+// Request routes (pages served by handlers)
+enum ERoute
+{
+	ROUTE_NONE = 0, ROUTE_SET_SCHED, ROUTE_SET_ZONES, ROUTE_DEL_SCHED, ROUTE_SET_QSCHED, ROUTE_SETTINGS, ROUTE_MANUAL, ROUTE_RUN, ROUTE_FACTORY,
+	ROUTE_RESET, ROUTE_JSON_SCHEDULES, ROUTE_JSON_ZONES, ROUTE_JSON_SETTINGS, ROUTE_JSON_STATE, ROUTE_JSON_SCHEDULE, ROUTE_JSON_WCHECK,
+	ROUTE_JSON_LOGS, ROUTE_JSON_TLOGS, ROUTE_JSON_WLOGS, ROUTE_JSON_SYSLOG, ROUTE_JSON_TAIL, ROUTE_JSON_LOGBENCH, ROUTE_JSON_SDSTATS,
+	ROUTE_JSON_SENS, ROUTE_JSON_WFLOW, ROUTE_JSON_WEBBENCH, ROUTE_SHOW_SCHED, ROUTE_SHOW_ZONES, ROUTE_SHOW_EVENT, ROUTE_RELOAD_EVENT,
+	ROUTE_COUNT
+};
+
+//
+// Route and key lookup.
+//
+// Route pages and query keys are found with a perfect hash: every known name has its own slot in a PROGMEM slot table, and a single
+// strcmp_P() confirms the match, instead of a strcmp_P() chain over all names.
+// Slot tables are built offline for the hash seeds below. When a route or a key is added, its name goes to the names table and
+// the slot tables and seeds are rebuilt with tools/namehash.py. The tables are checked on startup (see CheckNameTables()).
+//
+#define NAME_HASH_MULT 0x8D15U
+#define NAME_HASH_SLOTS 64
+#define ROUTE_HASH_SEED 238
+#define KEY_HASH_SEED 253
+
+#define ROUTE_NAME_SIZE 15
+#define KEY_NAME_SIZE KEY_SIZE
+
+static const char route_names[ROUTE_COUNT - 1][ROUTE_NAME_SIZE] PROGMEM =
+{
+	"bin/setSched", "bin/setZones", "bin/delSched", "bin/setQSched", "bin/settings", "bin/manual", "bin/run", "bin/factory",
+	"bin/reset", "json/schedules", "json/zones", "json/settings", "json/state", "json/schedule", "json/wcheck",
+	"json/logs", "json/tlogs", "json/wlogs", "json/syslog", "json/tail", "json/logbench", "json/sdstats",
+	"json/sens", "json/wflow", "json/webbench", "ShowSched", "ShowZones", "ShowEvent", "ReloadEvent"
+};
+
+static const uint8_t route_slots[NAME_HASH_SLOTS] PROGMEM =
+{
+	ROUTE_JSON_TAIL,       ROUTE_NONE,            ROUTE_NONE,            ROUTE_RESET,
+	ROUTE_NONE,            ROUTE_NONE,            ROUTE_NONE,            ROUTE_JSON_SYSLOG,
+	ROUTE_MANUAL,          ROUTE_NONE,            ROUTE_NONE,            ROUTE_NONE,
+	ROUTE_JSON_ZONES,      ROUTE_NONE,            ROUTE_NONE,            ROUTE_NONE,
+	ROUTE_NONE,            ROUTE_SHOW_EVENT,      ROUTE_JSON_SCHEDULE,   ROUTE_NONE,
+	ROUTE_NONE,            ROUTE_NONE,            ROUTE_JSON_STATE,      ROUTE_JSON_TLOGS,
+	ROUTE_JSON_WLOGS,      ROUTE_NONE,            ROUTE_RUN,             ROUTE_JSON_SETTINGS,
+	ROUTE_NONE,            ROUTE_NONE,            ROUTE_JSON_SENS,       ROUTE_JSON_WEBBENCH,
+	ROUTE_SET_SCHED,       ROUTE_NONE,            ROUTE_SHOW_ZONES,      ROUTE_FACTORY,
+	ROUTE_NONE,            ROUTE_NONE,            ROUTE_DEL_SCHED,       ROUTE_NONE,
+	ROUTE_NONE,            ROUTE_JSON_LOGBENCH,   ROUTE_NONE,            ROUTE_JSON_SDSTATS,
+	ROUTE_NONE,            ROUTE_NONE,            ROUTE_JSON_LOGS,       ROUTE_JSON_WCHECK,
+	ROUTE_NONE,            ROUTE_SETTINGS,        ROUTE_JSON_SCHEDULES,  ROUTE_SHOW_SCHED,
+	ROUTE_RELOAD_EVENT,    ROUTE_NONE,            ROUTE_NONE,            ROUTE_SET_QSCHED,
+	ROUTE_NONE,            ROUTE_NONE,            ROUTE_NONE,            ROUTE_SET_ZONES,
+	ROUTE_NONE,            ROUTE_NONE,            ROUTE_JSON_WFLOW,      ROUTE_NONE,
+};
+
+static const char key_names[KEY_COUNT - 1][KEY_NAME_SIZE] PROGMEM =
+{
+	"apikey", "cursor", "edate", "enable", "g", "gateway", "id", "interval", "ip", "log", "max_points",
+	"n", "name", "netmask", "NTPip", "NTPoffset", "ot", "pws", "q", "reset", "sadj", "sched", "sdate",
+	"state", "sum", "system", "type", "wadj", "webport", "wuip", "wutype", "zip", "zone"
+};
+
+static const uint8_t key_slots[NAME_HASH_SLOTS] PROGMEM =
+{
+	KEY_N,                 KEY_NONE,              KEY_SYSTEM,            KEY_EDATE,
+	KEY_APIKEY,            KEY_ID,                KEY_IP,                KEY_NONE,
+	KEY_ZONE,              KEY_Q,                 KEY_PWS,               KEY_SCHED,
+	KEY_NONE,              KEY_WADJ,              KEY_WEBPORT,           KEY_NONE,
+	KEY_NONE,              KEY_NONE,              KEY_NONE,              KEY_CURSOR,
+	KEY_RESET,             KEY_NONE,              KEY_NONE,              KEY_NONE,
+	KEY_NONE,              KEY_NONE,              KEY_NONE,              KEY_NETMASK,
+	KEY_NONE,              KEY_ZIP,               KEY_NONE,              KEY_WUTYPE,
+	KEY_NONE,              KEY_NTPIP,             KEY_ENABLE,            KEY_NONE,
+	KEY_STATE,             KEY_GATEWAY,           KEY_INTERVAL,          KEY_SUM,
+	KEY_NONE,              KEY_MAX_POINTS,        KEY_NONE,              KEY_NONE,
+	KEY_NONE,              KEY_NONE,              KEY_NONE,              KEY_TYPE,
+	KEY_NONE,              KEY_NONE,              KEY_NONE,              KEY_WUIP,
+	KEY_NONE,              KEY_NONE,              KEY_OT,                KEY_G,
+	KEY_SADJ,              KEY_NONE,              KEY_NTPOFFSET,         KEY_LOG,
+	KEY_NONE,              KEY_NONE,              KEY_NAME,              KEY_SDATE,
+};
+
+static uint8_t NameHash(const char * name, uint8_t seed)
+{
+	uint16_t h = seed;
+	while (*name)
+		h = (h ^ (uint8_t) *(name++)) * NAME_HASH_MULT;
+	return h >> 10;         // top bits are the best mixed ones, NAME_HASH_SLOTS
+}
+
+// Id of a known name, 0 (ROUTE_NONE, KEY_NONE) if the name is not known
+static uint8_t LookupName(const char * name, uint8_t seed, const uint8_t * slots, const char * names, uint8_t name_size)
+{
+	uint8_t id = pgm_read_byte(slots + NameHash(name, seed));
+	if ((id != 0) && (strcmp_P(name, names + (id - 1) * name_size) == 0))
+		return id;
+	return 0;
+}
+
+// Check that every name of the names table is found in its own slot (slot tables match the names and the seed).
+static bool CheckNameTable(uint8_t seed, const uint8_t * slots, const char * names, uint8_t count, uint8_t name_size)
+{
+	char name[ROUTE_NAME_SIZE];
+
+	for (uint8_t id = 1; id <= count; id++)
+	{
+		strcpy_P(name, names + (id - 1) * name_size);
+		if (LookupName(name, seed, slots, names, name_size) != id)
+			return false;
+	}
+	return true;
+}
+
+static bool CheckNameTables()
+{
+	return CheckNameTable(ROUTE_HASH_SEED, route_slots, &route_names[0][0], ROUTE_COUNT - 1, ROUTE_NAME_SIZE) &&
+	       CheckNameTable(KEY_HASH_SEED, key_slots, &key_names[0][0], KEY_COUNT - 1, KEY_NAME_SIZE);
+}
+
+static inline uint8_t LookupRoute(const char * sPage)
+{
+	return LookupName(sPage, ROUTE_HASH_SEED, route_slots, &route_names[0][0], ROUTE_NAME_SIZE);
+}
+
+static inline uint8_t LookupKey(const char * key)
+{
+	return LookupName(key, KEY_HASH_SEED, key_slots, &key_names[0][0], KEY_NAME_SIZE);
+}
+
+//  Pass in the request line, and this function will parse it and return the requested page
+//   and a KV pairs structure for the variable assignments.
+//  The query string is decoded in place, in the request line itself ('=' and '&' become string terminators), and key_value_pairs
+//   point to the keys and values there. Value sizes are checked per route (RouteValuesFit).
+static bool ParseRequestLine(char * req, KVPairs * key_value_pairs, char * sPage, int iPageSize)
+{
+	key_value_pairs->num_pairs = 0;
+	*sPage = 0;
+	if (strncmp_P(req, PSTR("GET /"), 5) != 0)
+		return false;
 
-		switch (current_state)
+	char * p = req + 5;
+	char * page_ptr = sPage;
+	for (; (*p != 0) && (*p != ' ') && (*p != '?'); p++)
+	{
+		if ((*p > 32) && (*p < 127))
 		{
-		case INITIALIZED:
-			if (c == *gettext_ptr)
-			{
-				gettext_ptr++;
-				if (gettext_ptr - get_text >= (long)sizeof(get_text) - 1)
-				{
-					current_state = PARSING_PAGE;
-				}
-			}
+			if (page_ptr - sPage >= iPageSize - 1)
+				return false;
+			*page_ptr++ = *p;
+		}
+	}
+	*page_ptr = 0;
+	if (*p != '?')
+		return true;
 
-			break;
-		case PARSING_PAGE:
-			if (c == '?')
-			{
-				*page_ptr = 0;
-				current_state = PARSING_KEY;
-			}
-			else if (c == ' ')
-			{
-				*page_ptr = 0;
-				current_state = LOOKING_FOR_BLANKLINE;
-			}
-			else if (c == '\n')
-			{
-				*page_ptr = 0;
-				current_state = FOUND_BLANKLINE;
-			}
-			else if ((c > 32) && (c < 127))
-			{
-				if (page_ptr - sPage >= iPageSize - 1)
-				{
-					current_state = ERROR;
-				}
-				else
-					*page_ptr++ = c;
-			}
-			break;
-		case PARSING_KEY:
-			if (c == ' ')
-				current_state = LOOKING_FOR_BLANKLINE;
-			else if (c == '\n')
-			{
-				current_state = FOUND_BLANKLINE;
-			}
-			else if (c == '&')
-			{
-				current_state = ERROR;
-			}
-			else if (c == '=')
-			{
-				*key_ptr = 0;
-				current_state = PARSING_VALUE;
-			}
-			else if ((c > 32) && (c < 127))
+	char * out = ++p;       // decoded data never gets ahead of the data being decoded
+	while (true)
+	{
+		char * key = out;
+		for (; *p != '='; p++)
+		{
+			if ((*p == 0) || (*p == ' '))
+				return true;            // key without a value is ignored
+			if (*p == '&')
+				return false;
+			if ((*p > 32) && (*p < 127))
+				*out++ = *p;
+		}
+		p++;
+		*out++ = 0;
+
+		char * value = out;
+		for (; (*p != 0) && (*p != ' ') && (*p != '&'); p++)
+		{
+			if ((*p <= 32) || (*p >= 127))
+				return false;
+			if (*p == '+')
+				*out++ = ' ';
+			else if (*p != '%')
+				*out++ = *p;
+			else if (isxdigit(p[1]) && isxdigit(p[2]))
 			{
-				if (key_ptr - key_value_pairs->keys[key_value_pairs->num_pairs] >= KEY_SIZE - 1)
-				{
-					current_state = ERROR;
-				}
-				else
-					*key_ptr++ = c;
+				char c = (hex2int(p[1]) << 4) + hex2int(p[2]);
+				// let's check this value to see if it's legal
+				if (((c >= 0 ) && (c < 32)) || (c == 127) || (c == '"') || (c == '\\'))
+					c = ' ';
+				*out++ = c;
+				p += 2;
 			}
-			break;
-		case PARSING_VALUE:
-		case PARSING_VALUE_PERCENT:
-		case PARSING_VALUE_PERCENT1:
-			if ((c == ' ') || c == '&')
-			{
-				*value_ptr = 0;
-				trace(F("Found a KV pair : %s -> %s\n"), key_value_pairs->keys[key_value_pairs->num_pairs], key_value_pairs->values[key_value_pairs->num_pairs]);
+		}
+		char end = *p;
+		*out++ = 0;
 
-				if ((c == '&') && (key_value_pairs->num_pairs >= NUM_KEY_VALUES - 1))
-				{
-					current_state = ERROR;
-					break;
-				}
-				if (c == '&')
-				{
-					key_value_pairs->num_pairs++;
-					key_ptr = key_value_pairs->keys[key_value_pairs->num_pairs];
-					value_ptr = key_value_pairs->values[key_value_pairs->num_pairs];
-					current_state = PARSING_KEY;
-				}
-				else
-				{
-					key_value_pairs->num_pairs++;
-					current_state = LOOKING_FOR_BLANKLINE;
-				}
-				break;
-			}
-			else if ((c > 32) && (c < 127))
-			{
-				if (value_ptr - key_value_pairs->values[key_value_pairs->num_pairs] >= VALUE_SIZE - 1)
-				{
-					current_state = ERROR;
-					break;
-				}
-				switch (current_state)
+		if (key_value_pairs->num_pairs >= NUM_KEY_VALUES)
+			return false;
+		trace(F("Found a KV pair : %s -> %s\n"), key, value);
+		key_value_pairs->keys[key_value_pairs->num_pairs] = key;
+		key_value_pairs->values[key_value_pairs->num_pairs] = value;
+		key_value_pairs->key_ids[key_value_pairs->num_pairs++] = LookupKey(key);
+
+		if (end != '&')
+			return true;
+		p++;
+	}
+}
+
+// Check query values against the longest value the route handler accepts
+static bool RouteValuesFit(uint8_t route, const KVPairs & key_value_pairs)
+{
+	size_t value_max = (route == ROUTE_JSON_SYSLOG) ? SYSLOG_QUERY_SIZE - 1 : VALUE_SIZE - 1;     // search text, or a number or a name
+
+	for (int i = 0; i < key_value_pairs.num_pairs; i++)
+		if (strlen(key_value_pairs.values[i]) > value_max)
+			return false;
+	return true;
+}
+
+#ifdef WEB_BENCHMARK
+#define WEB_BENCHMARK_LOOPS 100
+
+// Lookup time of every name in the table, with the perfect hash and with a strcmp_P() scan over all names (as request
+// dispatch worked before the slot tables). Returns the number of names not found in their own slot.
+static uint8_t BenchmarkNames(FILE * stream_file, const char * pLabel, uint8_t seed, const uint8_t * slots, const char * names,
+                              uint8_t count, uint8_t name_size)
+{
+	char name[ROUTE_NAME_SIZE];
+	unsigned long t0, hash_us = 0, scan_us = 0;
+	volatile uint8_t found;
+	uint8_t errors = 0;
+
+	for (uint8_t id = 1; id <= count; id++)
+	{
+		strcpy_P(name, names + (id - 1) * name_size);
+		if (LookupName(name, seed, slots, names, name_size) != id)
+			errors++;
+
+		t0 = micros();
+		for (int i = 0; i < WEB_BENCHMARK_LOOPS; i++)
+			found = LookupName(name, seed, slots, names, name_size);
+		hash_us += micros() - t0;
+
+		t0 = micros();
+		for (int i = 0; i < WEB_BENCHMARK_LOOPS; i++)
+		{
+			found = 0;
+			for (uint8_t n = 0; n < count; n++)
+				if (strcmp_P(name, names + n * name_size) == 0)
 				{
-				case PARSING_VALUE_PERCENT:
-					if (isxdigit(c))
-					{
-						*value_ptr = hex2int(c) << 4;
-						current_state = PARSING_VALUE_PERCENT1;
-					}
-					else
-						current_state = PARSING_VALUE;
-					break;
-				case PARSING_VALUE_PERCENT1:
-					if (isxdigit(c))
-					{
-						*value_ptr += hex2int(c);
-						// let's check this value to see if it's legal
-						if (((*value_ptr >= 0 ) && (*value_ptr < 32)) || (*value_ptr == 127) || (*value_ptr == '"') || (*value_ptr == '\\'))
-							*value_ptr = ' ';
-						value_ptr++;
-					}
-					current_state = PARSING_VALUE;
-					break;
-				default:
-					if (c == '+')
-						*value_ptr++ = ' ';
-					else if (c == '%')
-						current_state = PARSING_VALUE_PERCENT;
-					else
-						*value_ptr++ = c;
+					found = n + 1;
 					break;
 				}
-			}
-			else
-				current_state = ERROR;
-			break;
-		case LOOKING_FOR_BLANKLINE:
-			if (c == '\n')
-				current_state = FOUND_BLANKLINE;
-			break;
-		case FOUND_BLANKLINE:
-			if (c == '\n')
-				current_state = DONE;
-			else if (c != '\r')
-				current_state = LOOKING_FOR_BLANKLINE;
-			break;
-		default:
-			break;
-		} // switch
-		if (current_state == DONE)
-			return true;
-		else if (current_state == ERROR)
-			return false;
-	} // true
-	return false;
+		}
+		scan_us += micros() - t0;
+	}
+	fprintf_P(stream_file, PSTR("\t\"%S\": { \"names\":%u, \"hash_ns\":%lu, \"scan_ns\":%lu, \"errors\":%u },\n"), pLabel, count,
+	                       hash_us * 1000UL / (WEB_BENCHMARK_LOOPS * count), scan_us * 1000UL / (WEB_BENCHMARK_LOOPS * count), errors);
+	return errors;
 }
 
-void web::ProcessWebClients()
+// Request dispatch benchmark - average route and key lookup time per name, in nanoseconds. Also reports the last large file send.
+static void JSONWebBench(FILE * stream_file)
 {
-	// listen for incoming clients
-	EthernetClient client = m_server->available();
-	if (client)
+	ServeHeader(stream_file, 200, PSTR("OK"), false, PSTR("text/plain"));
+	fprintf_P(stream_file, PSTR("{\n\t\"loops\": %u,\n"), WEB_BENCHMARK_LOOPS);
+	uint8_t errors = BenchmarkNames(stream_file, PSTR("routes"), ROUTE_HASH_SEED, route_slots, &route_names[0][0], ROUTE_COUNT - 1, ROUTE_NAME_SIZE);
+	errors += BenchmarkNames(stream_file, PSTR("keys"), KEY_HASH_SEED, key_slots, &key_names[0][0], KEY_COUNT - 1, KEY_NAME_SIZE);
+	fprintf_P(stream_file, PSTR("\t\"tables_ok\": %s,\n"), errors ? "false" : "true");
+
+	// throughput of the last large file sent (request a large file, e.g. flotmin.js, before this page)
+	unsigned long ms = max(lastSend.ms, 1UL);
+	fprintf_P(stream_file, PSTR("\t\"send\": { \"bytes\":%lu, \"ms\":%lu, \"bytes_per_sec\":%lu, \"sd_ms\":%lu, \"waits\":%u }\n}"),
+	                       lastSend.size, lastSend.ms, lastSend.size * 1000UL / ms, lastSend.sd_us / 1000, lastSend.waits);
+}
+#endif  // WEB_BENCHMARK
+
+// Serve a request for one of the routes
+static void ServeRoute(uint8_t route, const KVPairs & key_value_pairs, FILE * pFile, bool & bReset)
+{
+	switch (route)
 	{
-		bool bReset = false;
+	case ROUTE_SET_SCHED:
+		if (SetSchedule(key_value_pairs))
+		{
+			if (GetRunSchedules())
+				ReloadEvents();
+			ServeHeader(pFile, 200, PSTR("OK"), false);
+		}
+		else
+			ServeError(pFile);
+		break;
+	case ROUTE_SET_ZONES:
+		if (SetZones(key_value_pairs))
+		{
+			ReloadEvents();
+			ServeHeader(pFile, 200, PSTR("OK"), false);
+		}
+		else
+			ServeError(pFile);
+		break;
+	case ROUTE_DEL_SCHED:
+		if (DeleteSchedule(key_value_pairs))
+		{
+			if (GetRunSchedules())
+				ReloadEvents();
+			ServeHeader(pFile, 200, PSTR("OK"), false);
+		}
+		else
+			ServeError(pFile);
+		break;
+	case ROUTE_SET_QSCHED:
+		if (SetQSched(key_value_pairs))
+			ServeHeader(pFile, 200, PSTR("OK"), false);
+		else
+			ServeError(pFile);
+		break;
+	case ROUTE_SETTINGS:
+		if (SetSettings(key_value_pairs))
+		{
+			ReloadEvents();
+			ServeHeader(pFile, 200, PSTR("OK"), false);
+		}
+		else
+			ServeError(pFile);
+		break;
+	case ROUTE_MANUAL:
+		if (ManualZone(key_value_pairs))
+			ServeHeader(pFile, 200, PSTR("OK"), false);
+		else
+			ServeError(pFile);
+		break;
+	case ROUTE_RUN:
+		if (RunSchedules(key_value_pairs))
+		{
+			ReloadEvents();
+			ServeHeader(pFile, 200, PSTR("OK"), false);
+		}
+		else
+			ServeError(pFile);
+		break;
+	case ROUTE_FACTORY:
+		ResetEEPROM();
+		ReloadEvents();
+		ServeHeader(pFile, 200, PSTR("OK"), false);
+		break;
+	case ROUTE_RESET:
+		bReset = true;
+		bKeepAlive = false;
+		ServeHeader(pFile, 200, PSTR("OK"), false);
+		break;
+
+	case ROUTE_JSON_SCHEDULES:
+		JSONSchedules(key_value_pairs, pFile);
+		break;
+	case ROUTE_JSON_ZONES:
+		JSONZones(key_value_pairs, pFile);
+		break;
+	case ROUTE_JSON_SETTINGS:
+		JSONSettings(key_value_pairs, pFile);
+		break;
+	case ROUTE_JSON_STATE:
+		JSONState(key_value_pairs, pFile);
+		break;
+	case ROUTE_JSON_SCHEDULE:
+		JSONSchedule(key_value_pairs, pFile);
+		break;
+	case ROUTE_JSON_WCHECK:
+		JSONwCheck(key_value_pairs, pFile);
+		break;
+#ifdef LOGGING
+	case ROUTE_JSON_LOGS:
+		JSONLogs(key_value_pairs, pFile);
+		break;
+	case ROUTE_JSON_TLOGS:
+		JSONtLogs(key_value_pairs, pFile);
+		break;
+	case ROUTE_JSON_WLOGS:
+		JSONwLogs(key_value_pairs, pFile);
+		break;
+	case ROUTE_JSON_SYSLOG:
+		JSONSyslog(key_value_pairs, pFile);
+		break;
+	case ROUTE_JSON_TAIL:
+		JSONTail(key_value_pairs, pFile);
+		break;
+#endif //LOGGING
+#ifdef LOG_BENCHMARK
+	case ROUTE_JSON_LOGBENCH:
+		JSONLogBench(key_value_pairs, pFile);
+		break;
+#endif //LOG_BENCHMARK
+#ifdef SD_STATS
+	case ROUTE_JSON_SDSTATS:
+		JSONSdStats(key_value_pairs, pFile);
+		break;
+#endif //SD_STATS
+#ifdef WEB_BENCHMARK
+	case ROUTE_JSON_WEBBENCH:
+		JSONWebBench(pFile);
+		break;
+#endif //WEB_BENCHMARK
+
+// Sensors
+	case ROUTE_JSON_SENS:
+		JSONSensor(key_value_pairs, pFile);
+		break;
+	case ROUTE_JSON_WFLOW:
+		JSONWaterFlow(key_value_pairs, pFile);
+		break;
+
+// simple scheduling debug requests, enable when required
+#ifdef SCHEDULE_WEB_DEBUG
+	case ROUTE_SHOW_SCHED:
+		freeMemory();
+		ServeSchedPage(pFile);
+		break;
+	case ROUTE_SHOW_ZONES:
+		freeMemory();
+		ServeZonesPage(pFile);
+		break;
+	case ROUTE_SHOW_EVENT:
+		ServeEventPage(pFile);
+		break;
+	case ROUTE_RELOAD_EVENT:
+		ReloadEvents(true);
+		ServeEventPage(pFile);
+		break;
+#endif  // SCHEDULE_WEB_DEBUG
+
+	default:
+		break;          // route is disabled in this build, answered with 404
+	}
+}
+
+// Serve the request read by the request reader. Dynamic responses are generated and sent here in one go (bounded only by the
+// query limits of their generators), file data is sent later in time slices.
+static void ServeRequest(WebConnection * pConn, bool & bReset)
+{
 #ifdef ARDUINO
 		FILE stream_file;
 		FILE * pFile = &stream_file;
 		setup_sendbuf();
 		fdev_setup_stream(pFile, stream_putchar, NULL, _FDEV_SETUP_WRITE);
-		stream_file.udata = &client;
+		stream_file.udata = &pConn->client;
 #else
-		FILE * pFile = fdopen(client.GetSocket(), "w");
+		FILE * pFile = fdopen(pConn->client.GetSocket(), "w");
 #endif
 		 freeMemory();
-		 trace(F("Got a client\n"));
 		 //ShowSockStatus();
 		 KVPairs key_value_pairs;
 		 char sPage[35];
 
-		 if (!ParseHTTPHeader(client, &key_value_pairs, sPage, sizeof(sPage)))
+		 bHeaderSent = false;
+		 bKeepAlive = pConn->bKeepAlive;
+		 bHttp11 = pConn->bHttp11;
+#if !defined(ARDUINO) || !defined(WEB_KEEPALIVE)
+		 bKeepAlive = false;
+#endif
+		 if (reader.bOverflow || !ParseRequestLine(reader.req, &key_value_pairs, sPage, sizeof(sPage)))
 		 {
 			trace(F("ERROR!\n"));
+			bKeepAlive = false;     // malformed request, do not expect anything good from this client
 			ServeError(pFile);
 		 }
 		 else
@@ -961,179 +1860,22 @@ void web::ProcessWebClients()
 			trace(F("Page:%s\n"), sPage);
 			//ShowSockStatus();
 
-                        if( strncmp_P(sPage, PSTR("bin/"), 4) == 0 )       // We do the check in two phases. 
-                                                                                                      // First we check that the URL starts with "bin/" to identify the block of bin requests, 
-                                                                                                      // and then we check for a specific request in the bin/ block
-                                                                                                      //
-                                                                                                      // This optimization speeds up request decoding, allowing to reduce the number of strcmp() each request goes through as well as the string lengh to check
-                                                                                                      //
-                        {
-                             char *xP4 = sPage + 4;
-
-     			     if (strcmp_P(xP4, PSTR("setSched")) == 0)
-			     {
-				     if (SetSchedule(key_value_pairs))
-				     {
-					     if (GetRunSchedules())
-						     ReloadEvents();
-					     ServeHeader(pFile, 200, PSTR("OK"), false);
-				     }
-				     else
-					     ServeError(pFile);
-			     }
-			     else if (strcmp_P(xP4, PSTR("setZones")) == 0)
-			     {
-				     if (SetZones(key_value_pairs))
-				     {
-					     ReloadEvents();
-					     ServeHeader(pFile, 200, PSTR("OK"), false);
-				     }
-				     else
-					     ServeError(pFile);
-			     }
-			     else if (strcmp_P(xP4, PSTR("delSched")) == 0)
-  			     {
-				     if (DeleteSchedule(key_value_pairs))
-				     {
-					     if (GetRunSchedules())
-						     ReloadEvents();
-					     ServeHeader(pFile, 200, PSTR("OK"), false);
-				     }
-				     else
-					     ServeError(pFile);
-			     }
-			     else if (strcmp_P(xP4, PSTR("setQSched")) == 0)
-			     {
-				     if (SetQSched(key_value_pairs))
-				     {
-					     ServeHeader(pFile, 200, PSTR("OK"), false);
-				     }
-				     else
-					     ServeError(pFile);
-			     }
-			     else if (strcmp_P(xP4, PSTR("settings")) == 0)
-			     {
-				     if (SetSettings(key_value_pairs))
-				     {
-					     ReloadEvents();
-					     ServeHeader(pFile, 200, PSTR("OK"), false);
-				     }
-				     else
-					     ServeError(pFile);
-			     }
-			     else if (strcmp_P(xP4, PSTR("manual")) == 0)
-			     {
-				     if (ManualZone(key_value_pairs))
-				     {
-					     ServeHeader(pFile, 200, PSTR("OK"), false);
-				     }
-				     else
-					     ServeError(pFile);
-			     }
-			     else if (strcmp_P(xP4, PSTR("run")) == 0)
-			     {
-				     if (RunSchedules(key_value_pairs))
-				     {
-					     ReloadEvents();
-					     ServeHeader(pFile, 200, PSTR("OK"), false);
-				     }
-				     else
-					     ServeError(pFile);
-			     }
-			     else if (strcmp_P(xP4, PSTR("factory")) == 0)
-			     {
-				     ResetEEPROM();
-				     ReloadEvents();
-				     ServeHeader(pFile, 200, PSTR("OK"), false);
-			     }
-			     else if (strcmp_P(xP4, PSTR("reset")) == 0)
-			     {
-				     ServeHeader(pFile, 200, PSTR("OK"), false);
-				     bReset = true;
-			     }
-                        }
-                        else if( strncmp_P(sPage, PSTR("json/"), 5) == 0 )      // We do the check in two phases. 
-                                                                                                              // First we check that the URL starts with "json/" to identify the block of json requests, 
-                                                                                                              // and then each request in the block checks the rest of the URL to determine specific request
-                        {
-                             char *xP5 = sPage + 5;
-                             
-			     if (strcmp_P(xP5, PSTR("schedules")) == 0)
-			     {
-				     JSONSchedules(key_value_pairs, pFile);
-			     }
-			     else if (strcmp_P(xP5, PSTR("zones")) == 0)
-			     {
-				     JSONZones(key_value_pairs, pFile);
-			     }
-			     else if (strcmp_P(xP5, PSTR("settings")) == 0)
-			     {
-				     JSONSettings(key_value_pairs, pFile);
-			     }
-			     else if (strcmp_P(xP5, PSTR("state")) == 0)
-			     {
-				     JSONState(key_value_pairs, pFile);
-			     }
-			     else if (strcmp_P(xP5, PSTR("schedule")) == 0)
-			     {
-				     JSONSchedule(key_value_pairs, pFile);
-			     }
-			     else if (strcmp_P(xP5, PSTR("wcheck")) == 0)
-			     {
-				     JSONwCheck(key_value_pairs, pFile);
-			     }
-#ifdef LOGGING
-			     else if (strcmp_P(xP5, PSTR("logs")) == 0)
-			     {
-			 	      JSONLogs(key_value_pairs, pFile);
-			     }
-			     else if (strcmp_P(xP5, PSTR("tlogs")) == 0)
-			     {
-				     JSONtLogs(key_value_pairs, pFile);
-			     }
-#endif //LOGGING
-
-// Sensors
-			     else if (strcmp_P(xP5, PSTR("sens")) == 0)
-			     {
-			 	      JSONSensor(key_value_pairs, pFile);
-			     }
-
-                        }
-// simple scheduling debug requests, enable when required (to reduce unnecessary overhead on each web request)
-#ifdef SCHEDULE_WEB_DEBUG
-			else if (strcmp_P(sPage, PSTR("ShowSched")) == 0)
-			{
-				freeMemory();
-				ServeSchedPage(pFile);
-			}
-			else if (strcmp_P(sPage, PSTR("ShowZones")) == 0)
-			{
-				freeMemory();
-				ServeZonesPage(pFile);
-			}
-			else if (strcmp_P(sPage, PSTR("ShowEvent")) == 0)
-			{
-				ServeEventPage(pFile);
-			}
-			else if (strcmp_P(sPage, PSTR("ReloadEvent")) == 0)
-			{
-				ReloadEvents(true);
-				ServeEventPage(pFile);
-			}
-#endif  // SCHEDULE_WEB_DEBUG
-
+			uint8_t route = LookupRoute(sPage);
+			if ((route != ROUTE_NONE) && !RouteValuesFit(route, key_value_pairs))
+				ServeError(pFile);
+			else if (route != ROUTE_NONE)
+				ServeRoute(route, key_value_pairs, pFile, bReset);
 // access system logs directory
 			else if (strncmp_P(sPage, PSTR("logs"), 4) == 0)
 			{
   				freeMemory();
-				ShowLogs(sPage, pFile, client);
+				ShowLogs(sPage, pFile, pConn);
 			}
 // watering logs
 			else if (strncmp_P(sPage, PSTR("watering.log"), 12) == 0)
 			{
   				freeMemory();
-				ShowWateringLogs(sPage, pFile, client);
+				ShowWateringLogs(sPage, pFile, pConn);
 			}
 			else
 			{
@@ -1147,33 +1889,183 @@ void web::ProcessWebClients()
 				memcpy(sPage, "/web/", 5);
 				sPage[sizeof(sPage)-1] = 0;
 				trace(F("Serving file: %s\n"), sPage);
-				SdFile theFile;
-				if (!theFile.open(sPage, O_READ))
+				TimedSdFile & theFile = pConn->file;
+				bool bGzip = false;
+#ifdef WEB_GZIP
+				if (pConn->bGzip)       // look for compressed copy of the file
+				{
+					char gzname[sizeof(sPage) + 3];
+					sprintf_P(gzname, PSTR("/web/gz/%s"), sPage + 5);
+					if (theFile.open(gzname, O_READ))
+					{
+						bGzip = theFile.isFile();
+						if (!bGzip)
+							theFile.close();
+					}
+				}
+#endif
+				if (!bGzip && !theFile.open(sPage, O_READ))
 					Serve404(pFile);
 				else
 				{
 					if (theFile.isFile())
-						ServeFile(pFile, sPage, theFile, client);
+						ServeFile(pFile, sPage, pConn, 0xFFFFFFFF, bGzip);
 					else
+					{
 						Serve404(pFile);
-					theFile.close();
+						theFile.close();
+					}
 				}
 			}
 		}
 
+		 if (!bHeaderSent)
+			Serve404(pFile);        // request was not recognized
+
 #ifdef ARDUINO
-		flush_sendbuf(client);
-		// give the web browser time to receive the data
-		delay(1);
+		flush_sendbuf(pConn->client, true);
 #else
 		fflush(pFile);
 		fclose(pFile);
 #endif
-		// close the connection:
-		client.stop();
+		pConn->bKeepAlive = bKeepAlive;
+}
+
+// Close the connection, and the file being sent (if any)
+static void CloseConnection(WebConnection * pConn)
+{
+	if (reader.pConn == pConn)
+		reader.pConn = NULL;            // unprocessed data (if any) is dropped
+
+	if (pConn->file.isOpen())
+		pConn->file.close();
+
+	// give the web browser time to receive the data
+	delay(1);
+	// close the connection:
+	pConn->client.stop();
+	pConn->state = WEB_CONN_FREE;
+}
+
+// Response is complete - wait for the next request on a persistent connection, or close the connection
+static void EndResponse(WebConnection * pConn)
+{
+	if (pConn->bKeepAlive)
+	{
+		pConn->state = WEB_CONN_IDLE;
+		pConn->time = millis();
+	}
+	else
+		CloseConnection(pConn);
+}
+
+// Take a connection slot for the new client. If all slots are used the oldest idle connection is closed;
+// if there are no idle connections the client waits until a connection is free.
+static void AcceptConnection(EthernetClient & client)
+{
+	WebConnection * pConn = NULL;
+
+	for (byte i = 0; i < WEB_MAX_CONNECTIONS; i++)
+	{
+		WebConnection * p = &connections[i];
+
+		if (p->state == WEB_CONN_FREE)
+		{
+			pConn = p;
+			break;
+		}
+		if ((p->state == WEB_CONN_IDLE) && (reader.pConn != p) && ((pConn == NULL) || (millis() - p->time > millis() - pConn->time)))
+			pConn = p;
+	}
+	if (pConn == NULL)
+		return;
+
+	if (pConn->state != WEB_CONN_FREE)
+		CloseConnection(pConn);
+
+	trace(F("Got a client\n"));
+	pConn->client = client;
+	pConn->state = WEB_CONN_IDLE;
+	pConn->bKeepAlive = false;
+	pConn->time = millis();
+}
 
-		if (bReset)
-			sysreset();
+// Give the connection a time slice: read available request data and serve the request once it is complete,
+// or send the next block of file data.
+static void ServiceConnection(WebConnection * pConn, bool & bReset)
+{
+	if (pConn->state == WEB_CONN_IDLE)
+	{
+		if ((reader.pConn == pConn) || ((reader.pConn == NULL) && pConn->client.available()))
+		{
+			if (reader.pConn == NULL)
+			{
+				reader.pConn = pConn;
+				reader.recv.ptr = reader.recv.end = reader.recv.buf;
+			}
+			reader.bHeaders = reader.bOverflow = false;
+			reader.len = reader.line_len = 0;
+
+			pConn->state = WEB_CONN_READING;
+			pConn->time = millis();
+		}
+		else if (!pConn->client.connected() || (millis() - pConn->time > WEB_KEEPALIVE_TIMEOUT))
+			CloseConnection(pConn);
+	}
+
+	if (pConn->state == WEB_CONN_READING)
+	{
+		if (ReadRequest(pConn))
+		{
+			ServeRequest(pConn, bReset);
+
+			if (reader.recv.ptr >= reader.recv.end)
+				reader.pConn = NULL;    // no pipelined requests, the reader is free for other connections
+
+			if (pConn->state == WEB_CONN_READING)
+				EndResponse(pConn);
+		}
+		else if (!pConn->client.connected() || (millis() - pConn->time > WEB_REQUEST_TIMEOUT))
+			CloseConnection(pConn);
+	}
+	else if (pConn->state == WEB_CONN_SENDING)
+	{
+		if (SendFileData(pConn))
+		{
+			pConn->file.close();
+			EndResponse(pConn);
+		}
+		else if (!pConn->client.connected() || (millis() - pConn->time > WEB_SEND_TIMEOUT))
+			CloseConnection(pConn);
+	}
+}
+
+void web::ProcessWebClients()
+{
+	bool bReset = false;
+
+	// listen for incoming clients
+	EthernetClient client = m_server->available();
+	if (client)
+	{
+		byte i;
+		for (i = 0; i < WEB_MAX_CONNECTIONS; i++)
+			if ((connections[i].state != WEB_CONN_FREE) && (connections[i].client == client))
+				break;
+
+		if (i == WEB_MAX_CONNECTIONS)   // new client
+			AcceptConnection(client);
+	}
+
+	for (byte i = 0; i < WEB_MAX_CONNECTIONS; i++)
+		ServiceConnection(&connections[i], bReset);
+
+	if (bReset)
+	{
+#ifdef LOGGING
+		sdlog.Close();     // flush and close cached log files
+#endif
+		sysreset();
 	}
 }
 
@@ -7,17 +7,43 @@
 #ifndef _WEB_h
 #define _WEB_h
 
+#include <inttypes.h>
+
 class EthernetServer;
 
 #define NUM_KEY_VALUES 30
-#define KEY_SIZE 10
-#define VALUE_SIZE 20
+#define KEY_SIZE 11                     // longest known key name (with the terminator)
+#define VALUE_SIZE 20                   // longest query value accepted by most requests (with the terminator)
+#define SYSLOG_QUERY_SIZE 64            // longest system log search text (with the terminator)
+
+#define WEB_MAX_CONNECTIONS 2           // connections open at the same time (W5100 has four sockets, one is needed for listening)
+#define WEB_REQUEST_SIZE 512            // max request line size (page and query string)
+#define WEB_REQUEST_TIMEOUT 3000        // connection is closed if request header does not arrive within this time (ms)
+#define WEB_SEND_TIMEOUT 5000           // connection is closed if the client does not accept data within this time (ms)
+#define WEB_TX_BUFFER_SIZE 2048         // W5100 socket transmit buffer size (2 KB per socket with four sockets), file data sent per time slice
+
+#define WEB_KEEPALIVE 1                 // comment out to close the connection after each request
+#define WEB_KEEPALIVE_TIMEOUT 5000      // idle persistent connection is closed after this time (ms)
+
+#define WEB_GZIP 1                      // serve gzip-compressed copies of static files from /web/gz/ (same file names) to clients accepting gzip
+//#define WEB_BENCHMARK 1               // uncomment to enable /json/webbench (request dispatch cost and file send throughput)
+
+// Known request keys. Keys are looked up once, when the request is parsed, and handlers switch on the key id.
+// Keys with numbered names (d1, t1, zb, zbname etc.) are KEY_NONE and are recognized by the handlers.
+enum EKey
+{
+	KEY_NONE = 0, KEY_APIKEY, KEY_CURSOR, KEY_EDATE, KEY_ENABLE, KEY_G, KEY_GATEWAY, KEY_ID, KEY_INTERVAL, KEY_IP, KEY_LOG, KEY_MAX_POINTS,
+	KEY_N, KEY_NAME, KEY_NETMASK, KEY_NTPIP, KEY_NTPOFFSET, KEY_OT, KEY_PWS, KEY_Q, KEY_RESET, KEY_SADJ, KEY_SCHED, KEY_SDATE,
+	KEY_STATE, KEY_SUM, KEY_SYSTEM, KEY_TYPE, KEY_WADJ, KEY_WEBPORT, KEY_WUIP, KEY_WUTYPE, KEY_ZIP, KEY_ZONE, KEY_COUNT
+};
 
+// Query string keys and values, decoded in place in the request line
 struct KVPairs
 {
 	int num_pairs;
-	char keys[NUM_KEY_VALUES][KEY_SIZE];
-	char values[NUM_KEY_VALUES][VALUE_SIZE];
+	uint8_t key_ids[NUM_KEY_VALUES];        // EKey
+	const char * keys[NUM_KEY_VALUES];
+	const char * values[NUM_KEY_VALUES];
 };
 
 class web
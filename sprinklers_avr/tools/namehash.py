@@ -0,0 +1,210 @@
+#!/usr/bin/env python
+#
+# namehash.py - rebuilds the perfect hash slot tables of the web server (route_slots and key_slots in sprinklers/web.cpp).
+#
+# Names are taken from route_names[] / key_names[] in web.cpp, ids - from the ERoute (web.cpp) and EKey (web.h) enums.
+# The script finds hash seeds that put every name into its own slot, and prints the seed defines and the slot tables
+# to be pasted into web.cpp. With --check it only verifies the tables and seeds currently in web.cpp.
+#
+# It also prints dispatch cost of both lookup methods, in string compares per lookup of a known name (perfect hash - one
+# compare, strcmp_P() chain - the average position of the name in the chain).
+#
+# With --bench the lookup code and tables are taken from web.cpp and built into a host program (C++ compiler from $CXX, c++ by
+# default), which runs CheckNameTables() and times both lookup methods for every known name. Host times only show the ratio
+# between the methods, not the times on the board.
+#
+# Usage:  python namehash.py [--check] [--bench] [path to the sprinklers directory]
+#
+
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+HASH_MULT = 0x8D15      # NAME_HASH_MULT
+HASH_SLOTS = 64         # NAME_HASH_SLOTS, hash is the top 6 bits of the 16-bit state
+
+
+def name_hash(name, seed):
+    h = seed
+    for c in name.encode('ascii'):
+        h = ((h ^ c) * HASH_MULT) & 0xFFFF
+    return h >> 10
+
+
+def c_block(src, start_pattern):
+    m = re.search(start_pattern, src)
+    if not m:
+        sys.exit('cannot find "%s"' % start_pattern)
+    return src[m.end():src.index('}', m.end())]
+
+
+def enum_ids(src, enum_name, prefix):
+    body = c_block(src, r'enum\s+%s\s*\{' % enum_name)
+    names = [n.split('=')[0].strip() for n in body.split(',')]
+    return [n for n in names if n and n not in (prefix + 'NONE', prefix + 'COUNT')]
+
+
+def table_names(src, table):
+    return re.findall(r'"([^"]*)"', c_block(src, r'%s\[[^\]]*\]\[[^\]]*\]\s*PROGMEM\s*=\s*\{' % table))
+
+
+def slot_table(names, ids, seed, prefix):
+    slots = [prefix + 'NONE'] * HASH_SLOTS
+    for name, ident in zip(names, ids):
+        slots[name_hash(name, seed)] = ident
+    rows = []
+    for i in range(0, HASH_SLOTS, 4):
+        rows.append('\t' + ' '.join((s + ',').ljust(22) for s in slots[i:i + 4]).rstrip())
+    return '\n'.join(rows)
+
+
+def find_seed(names):
+    for seed in range(256):
+        if len(set(name_hash(n, seed) for n in names)) == len(names):
+            return seed
+    return None
+
+
+def committed(src, define):
+    m = re.search(r'#define\s+%s\s+(\d+)' % define, src)
+    return int(m.group(1)) if m else None
+
+
+BENCH_MAIN = r'''
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+
+#define PROGMEM
+#define pgm_read_byte(p) (*(const volatile uint8_t *)(p))
+#define strcpy_P strcpy
+static int compare(const char * a, const char * b) { return strcmp(a, b); }
+static int (* volatile strcmp_P)(const char *, const char *) = compare;     // out of line, like the flash compare
+
+#define KEY_SIZE %(key_size)s
+%(enums)s
+%(lookup)s
+
+static uint8_t LookupChain(const char * name, const char * names, uint8_t count, uint8_t name_size)
+{
+	for (uint8_t id = 1; id <= count; id++)
+		if (strcmp_P(name, names + (id - 1) * name_size) == 0)
+			return id;
+	return 0;
+}
+
+static void Bench(const char * label, uint8_t seed, const uint8_t * slots, const char * names, uint8_t count, uint8_t name_size)
+{
+	const long loops = 100000;
+	volatile uint8_t id;
+	double hash_ns = 0, chain_ns = 0;
+
+	for (uint8_t n = 1; n <= count; n++)
+	{
+		const char * name = names + (n - 1) * name_size;
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		for (long i = 0; i < loops; i++)
+			id = LookupName(name, seed, slots, names, name_size);
+		std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+		for (long i = 0; i < loops; i++)
+			id = LookupChain(name, names, count, name_size);
+		std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+		hash_ns += std::chrono::duration<double, std::nano>(t1 - t0).count();
+		chain_ns += std::chrono::duration<double, std::nano>(t2 - t1).count();
+	}
+	(void) id;
+	printf("%%s: %%u names, host time per lookup: hash %%.1f ns, strcmp_P chain %%.1f ns\n", label, count,
+	       hash_ns / (loops * count), chain_ns / (loops * count));
+}
+
+int main()
+{
+	if (!CheckNameTables())
+	{
+		printf("CheckNameTables() failed\n");
+		return 1;
+	}
+	Bench("route_slots", ROUTE_HASH_SEED, route_slots, &route_names[0][0], ROUTE_COUNT - 1, ROUTE_NAME_SIZE);
+	Bench("key_slots", KEY_HASH_SEED, key_slots, &key_names[0][0], KEY_COUNT - 1, KEY_NAME_SIZE);
+	return 0;
+}
+'''
+
+
+def c_source(src, start_pattern, end_pattern):
+    start = re.search(start_pattern, src)
+    end = re.compile(end_pattern).search(src, start.end()) if start else None
+    if not end:
+        sys.exit('cannot find "%s"' % start_pattern)
+    return src[start.start():end.end()]
+
+
+def bench(web_cpp, web_h):
+    source = BENCH_MAIN % {
+        'key_size': committed(web_h, 'KEY_SIZE'),
+        'enums': c_source(web_h, r'enum\s+EKey\s*\{', r'\};') + '\n' + c_source(web_cpp, r'enum\s+ERoute\s*\{', r'\};'),
+        'lookup': c_source(web_cpp, r'#define\s+NAME_HASH_MULT', r'static bool CheckNameTables\(\)\s*\{[^}]*\}'),
+    }
+    tmp = tempfile.mkdtemp()
+    try:
+        src_name = os.path.join(tmp, 'namebench.cpp')
+        exe_name = os.path.join(tmp, 'namebench')
+        open(src_name, 'w').write(source)
+        if subprocess.call([os.environ.get('CXX', 'c++'), '-O2', '-o', exe_name, src_name]) != 0:
+            sys.stderr.write('cannot build the benchmark\n')
+            return False
+        return subprocess.call([exe_name]) == 0
+    finally:
+        shutil.rmtree(tmp)
+
+
+def main():
+    args = [a for a in sys.argv[1:] if a not in ('--check', '--bench')]
+    check = '--check' in sys.argv[1:]
+    sketch = args[0] if args else os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'sprinklers')
+
+    web_cpp = open(os.path.join(sketch, 'web.cpp')).read()
+    web_h = open(os.path.join(sketch, 'web.h')).read()
+
+    tables = [
+        ('ROUTE', 'route_slots', table_names(web_cpp, 'route_names'), enum_ids(web_cpp, 'ERoute', 'ROUTE_'), 'ROUTE_HASH_SEED'),
+        ('KEY', 'key_slots', table_names(web_cpp, 'key_names'), enum_ids(web_h, 'EKey', 'KEY_'), 'KEY_HASH_SEED'),
+    ]
+
+    ok = True
+    for prefix, slots_name, names, ids, seed_define in tables:
+        if len(names) != len(ids):
+            sys.exit('%s: %d names, %d enum values' % (slots_name, len(names), len(ids)))
+
+        chain = sum(range(1, len(names) + 1)) / float(len(names))
+        sys.stderr.write('%s: %d names, compares per lookup: hash 1, strcmp_P chain %.1f\n' % (slots_name, len(names), chain))
+
+        if check:
+            seed = committed(web_cpp, seed_define)
+            table = slot_table(names, ids, seed, prefix + '_')
+            current = c_block(web_cpp, r'%s\[[^\]]*\]\s*PROGMEM\s*=\s*\{' % slots_name)
+            if (len(set(name_hash(n, seed) for n in names)) != len(names)) or \
+               (re.sub(r'\s', '', current) != re.sub(r'\s', '', table)):
+                sys.stderr.write('%s does not match the names, rebuild it\n' % slots_name)
+                ok = False
+            continue
+
+        seed = find_seed(names)
+        if seed is None:
+            sys.exit('%s: no seed puts all names into different slots, increase NAME_HASH_SLOTS' % slots_name)
+
+        print('#define %s %d\n' % (seed_define, seed))
+        print('static const uint8_t %s[NAME_HASH_SLOTS] PROGMEM =\n{\n%s\n};\n' % (slots_name, slot_table(names, ids, seed, prefix + '_')))
+
+    if ok and ('--bench' in sys.argv[1:]):
+        ok = bench(web_cpp, web_h)
+
+    return 0 if ok else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())